@@ -18,6 +18,8 @@
 */
 #include "avl.h"
 #include "avl_util.h"
+#include "avl_pool.h"
+#include "avl_foreach.h"
 
 void avl_tree_init(avl_tree *t,
 		avl_tree_node * (*allocate_node)(void *item),
@@ -27,41 +29,107 @@ void avl_tree_init(avl_tree *t,
 		void (*free_entry)(avl_queue_entry * ))
 {
 	t->root = NULL;
+	t->num_items = 0;
+	t->order_statistics = 0;
+	t->atomic_links = 0;
+	t->augment = NULL;
 	t->allocate_node = allocate_node;
 	t->free_node = free_node;
 	t->compare_items = compare_items;
 	t->allocate_entry = allocate_entry;
 	t->free_entry = free_entry;
+	t->use_slab = !allocate_node || !free_node;
+	t->node_size = sizeof(avl_tree_node);
+	avl_slab_init(&t->slab);
 }
 
-static void avl_tree_destroy_node(avl_tree *t, avl_tree_node *node)
+void avl_tree_set_node_size(avl_tree *t, uint64_t node_size)
 {
+	t->node_size = node_size;
+}
+
+typedef struct _avl_tree_destroy_task {
+	avl_pool_task task;
+	avl_pool *pool;
+	avl_tree *t;
+	avl_tree_node *node;
+} avl_tree_destroy_task;
+
+static void avl_tree_destroy_task_run(avl_pool_task *task);
+
+// Rotate left children up until none is left, freeing each node that has
+// no left child; no stack is needed.
+static void avl_tree_destroy_vine(avl_tree *t, avl_tree_node *node)
+{
+	avl_tree_node *next;
+
+	while (node) {
+		if (node->left) {
+			next = node->left;
+			node->left = next->right;
+			next->right = node;
+		} else {
+			next = node->right;
+			t->free_node(node);
+		}
+		node = next;
+	}
+}
+
+static void avl_tree_destroy_node(avl_pool *p, avl_tree *t, avl_tree_node *node)
+{
+	avl_tree_destroy_task left;
+
 	if (!node)
 		return;
 
-	avl_tree_destroy_node(t, node->left);
-	avl_tree_destroy_node(t, node->right);
+	if (p && node->height > AVL_POOL_GRAIN_HEIGHT) {
+		left.task.run = avl_tree_destroy_task_run;
+		left.pool = p;
+		left.t = t;
+		left.node = node->left;
+		avl_pool_fork(p, &left.task);
+		avl_tree_destroy_node(p, t, node->right);
+		avl_pool_join(p, &left.task);
+		t->free_node(node);
+	} else {
+		avl_tree_destroy_vine(t, node);
+	}
+}
 
-	t->free_node(node);
+static void avl_tree_destroy_task_run(avl_pool_task *task)
+{
+	avl_tree_destroy_task *dt = (avl_tree_destroy_task *) task;
+	avl_tree_destroy_node(dt->pool, dt->t, dt->node);
 }
 
-void avl_tree_destroy(avl_tree *t)
+void avl_tree_destroy_parallel(avl_pool *p, avl_tree *t)
 {
-	avl_tree_destroy_node(t, t->root);
+	avl_tree_destroy_task root;
+
+	if (t->use_slab) {
+		avl_slab_destroy(&t->slab);
+	} else if (p) {
+		root.task.run = avl_tree_destroy_task_run;
+		root.pool = p;
+		root.t = t;
+		root.node = t->root;
+		avl_pool_run(p, &root.task);
+	} else {
+		avl_tree_destroy_node(NULL, t, t->root);
+	}
 	t->root = NULL;
+	t->num_items = 0;
 }
 
-static uint32_t avl_tree_num_items_node(avl_tree_node *node)
+void avl_tree_destroy(avl_tree *t)
 {
-	if (!node)
-		return 0;
-	return 1 + avl_tree_num_items_node(node->left) +
-		   avl_tree_num_items_node(node->right);
+	avl_tree_destroy_parallel(NULL, t);
 }
 
-uint32_t avl_tree_num_items(avl_tree *t)
+uint64_t avl_tree_num_items(avl_tree *t)
 {
-	return avl_tree_num_items_node(t->root);
+	return t->num_items;
 }
 
 avl_tree_node * avl_tree_find(avl_tree *t, void *item)
@@ -88,143 +156,205 @@ avl_tree_node * avl_tree_find(avl_tree *t, void *item)
 	return NULL;
 }
 
-static void avl_tree_pre_order_node(avl_tree *t,
-				    void (*visitor)(avl_tree_node *node, void *context),
-				    void *context,
-				    avl_tree_node *node)
+// Searches that avl_tree_find_batch() advances together.
+#define AVL_TREE_FIND_GROUP 16
+
+void avl_tree_find_batch(avl_tree *t, void **items, uint64_t n,
+			 avl_tree_node **results)
 {
-	if (!node)
-		return;
+	avl_tree_node *nodes[AVL_TREE_FIND_GROUP];
+	uint64_t active[AVL_TREE_FIND_GROUP];
+	uint64_t base;
+
+	for (base = 0 ; base < n ; base += AVL_TREE_FIND_GROUP) {
+		uint64_t num_active = n - base;
+		uint64_t i;
 
-	visitor(node, context);
+		if (num_active > AVL_TREE_FIND_GROUP)
+			num_active = AVL_TREE_FIND_GROUP;
+
+		for (i = 0 ; i < num_active ; ++i) {
+			active[i] = base + i;
+			nodes[i] = t->root;
+		}
 
-	avl_tree_pre_order_node(t, visitor, context, node->left);
-	avl_tree_pre_order_node(t, visitor, context, node->right);
+		// One step of every unfinished search per pass. A finished
+		// search is replaced by the last unfinished one.
+		while (num_active) {
+			for (i = 0 ; i < num_active ; ) {
+				avl_tree_node *node = nodes[i];
+				int64_t res;
+
+				if (node) {
+					res = t->compare_items(items[active[i]], node->item);
+					if (res) {
+						node = res < 0 ? node->left : node->right;
+						if (node) {
+							__builtin_prefetch(node);
+							nodes[i++] = node;
+							continue;
+						}
+					}
+				}
+
+				results[active[i]] = node;
+
+				--num_active;
+				active[i] = active[num_active];
+				nodes[i] = nodes[num_active];
+			}
+		}
+	}
 }
 
 void avl_tree_pre_order(avl_tree *t,
 			void (*visitor)(avl_tree_node *node, void *context),
 			void *context)
 {
-	avl_tree_pre_order_node(t, visitor, context, t->root);
-}
-
-static void avl_tree_in_order_node(avl_tree *t,
-				   void (*visitor)(avl_tree_node *node, void *context),
-				   void *context,
-				   avl_tree_node *node)
-{
-	if (!node)
-		return;
-
-	avl_tree_in_order_node(t, visitor, context, node->left);
-
-	visitor(node, context);
+	avl_tree_node *node;
 
-	avl_tree_in_order_node(t, visitor, context, node->right);
+	AVL_FOREACH_PRE_ORDER(t, node)
+		visitor(node, context);
 }
 
 void avl_tree_in_order(avl_tree *t,
 		       void (*visitor)(avl_tree_node *node, void *context),
 		       void *context)
 {
-	avl_tree_in_order_node(t, visitor, context, t->root);
+	avl_tree_node *node;
+
+	AVL_FOREACH_IN_ORDER(t, node)
+		visitor(node, context);
 }
 
-static void avl_tree_post_order_node(avl_tree *t,
-				     void (*visitor)(avl_tree_node *node, void *context),
-				     void *context,
-				     avl_tree_node *node)
+// Subtrees wholly below lo or at or above hi are skipped.
+static void avl_tree_range_visit_node(avl_tree *t, void *lo, void *hi,
+				      void (*visitor)(avl_tree_node *node, void *context),
+				      void *context,
+				      avl_tree_node *node)
 {
-	if (!node)
-		return;
+	while (node) {
 
-	avl_tree_post_order_node(t, visitor, context, node->left);
+		if (t->compare_items(node->item, lo) < 0) {
+			node = node->right;
+		} else if (t->compare_items(node->item, hi) >= 0) {
+			node = node->left;
+		} else {
+			avl_tree_range_visit_node(t, lo, hi, visitor, context, node->left);
+			visitor(node, context);
+			node = node->right;
+		}
 
-	avl_tree_post_order_node(t, visitor, context, node->right);
+	}
+}
 
-	visitor(node, context);
+void avl_tree_range_visit(avl_tree *t, void *lo, void *hi,
+			  void (*visitor)(avl_tree_node *node, void *context),
+			  void *context)
+{
+	avl_tree_range_visit_node(t, lo, hi, visitor, context, t->root);
 }
 
 void avl_tree_post_order(avl_tree *t,
 			 void (*visitor)(avl_tree_node *node, void *context),
 			 void *context)
 {
-	avl_tree_post_order_node(t, visitor, context, t->root);
+	avl_tree_node *node;
+
+	AVL_FOREACH_POST_ORDER(t, node)
+		visitor(node, context);
 }
 
-static void avl_add_queue_entry(avl_tree *t,
-				avl_tree_node *node,
-				avl_queue_entry **queue_head)
+// i < 2 * size
+static inline uint64_t avl_tree_ring_index(uint64_t i, uint64_t size)
 {
-	avl_queue_entry *entry;
-
-	entry = t->allocate_entry(node);
+	return i < size ? i : i - size;
+}
 
-	entry->next = NULL;
+uint64_t avl_tree_level_order_scratch_size(avl_tree *t)
+{
+	int32_t height = avl_tree_height(t);
+	uint64_t bound;
 
-	if (*queue_head == NULL) {
-		*queue_head = entry;
-	} else {
-		avl_queue_entry *last = *queue_head;
+	if (!height)
+		return 0;
 
-		while (last->next)
-			last = last->next;
+	// The queue holds the rest of one level and the children of the part
+	// already visited, at most w(d) + w(d+1)/2 nodes. The levels above d
+	// hold at least w(d) - 1 nodes, so that is at most (n + 1) / 2.
+	bound = (t->num_items + 1) / 2;
+	if (height <= 64 && bound > (1ULL << (height - 1)))
+		bound = 1ULL << (height - 1);
 
-		last->next = entry;
-	}
+	return bound;
 }
 
-static void avl_tree_level_order_node(avl_tree *t,
-				      avl_tree_node *node,
-				      avl_queue_entry **queue_array,
-				      int level)
+int avl_tree_level_order_scratch(avl_tree *t,
+				 void (*visitor)(avl_tree_node *node, void *context, int level),
+				 void *context,
+				 avl_tree_node **scratch,
+				 uint64_t scratch_size)
 {
-	if (!node)
-		return;
+	avl_tree_node *node;
+	uint64_t head = 0;
+	uint64_t count;
+	uint64_t level_left;
+	int level = 0;
 
-	avl_add_queue_entry(t, node, &queue_array[level]);
+	if (!t->root)
+		return 1;
 
-	avl_tree_level_order_node(t, node->left, queue_array, level+1);
-	avl_tree_level_order_node(t, node->right, queue_array, level+1);
-}
+	if (scratch_size < avl_tree_level_order_scratch_size(t))
+		return 0;
 
-void avl_tree_level_order(avl_tree *t,
-			  void (*visitor)(avl_tree_node *node, void *context, int level),
-			  void *context)
-{
-	avl_queue_entry **queue_array;
-	int32_t height;
-	int32_t i;
+	// scratch is a ring buffer; level_left counts the nodes of the current
+	// level still queued.
+	scratch[0] = t->root;
+	count = 1;
+	level_left = 1;
 
-	// Allocate an array of queues, one for each level of the tree.
-	height = avl_tree_height(t);
+	while (count) {
+		node = scratch[head];
+		if (++head == scratch_size)
+			head = 0;
+		--count;
 
-	if (!height)
-		return;
+		visitor(node, context, level);
 
-	queue_array = (avl_queue_entry **)
-			calloc(height, sizeof(avl_queue_entry *));
+		if (node->left)
+			scratch[avl_tree_ring_index(head + count++, scratch_size)] = node->left;
+		if (node->right)
+			scratch[avl_tree_ring_index(head + count++, scratch_size)] = node->right;
 
-	// Place each tree item in one of the queues, based on the tree level.
-	avl_tree_level_order_node(t, t->root, queue_array, 0);
+		if (!--level_left) {
+			level_left = count;
+			++level;
+		}
+	}
+
+	return 1;
+}
 
-	// Iterate over each queue.
-	for (i = 0 ; i < height ; ++i) {
-		avl_queue_entry *entry = queue_array[i];
+int avl_tree_level_order(avl_tree *t,
+			 void (*visitor)(avl_tree_node *node, void *context, int level),
+			 void *context)
+{
+	avl_tree_node **scratch;
+	uint64_t scratch_size;
+	int res;
 
-		while (entry) {
-			avl_queue_entry *trash;
+	scratch_size = avl_tree_level_order_scratch_size(t);
+	if (!scratch_size)
+		return 1;
 
-			visitor(entry->node, context, i);
+	scratch = (avl_tree_node **) malloc(scratch_size * sizeof(avl_tree_node *));
+	if (!scratch)
+		return 0;
 
-			trash = entry;
-			entry = entry->next;
-			t->free_entry(trash);
-		}
-	}
+	res = avl_tree_level_order_scratch(t, visitor, context, scratch, scratch_size);
 
-	free(queue_array);
+	free(scratch);
+	return res;
 }
 
 int32_t avl_tree_height_node(avl_tree_node *node);
@@ -21,6 +21,12 @@
 #include <stdlib.h>
 #include <stdint.h>
 
+// The tallest AVL tree that can hold 2^64 - 1 items. The sparsest AVL tree
+// of height h holds F(h+2) - 1 items (F being the Fibonacci numbers), and
+// F(93) is the last Fibonacci number that does not exceed 2^64.
+// Root-to-leaf paths are therefore never longer than this.
+#define AVL_TREE_MAX_HEIGHT 91
+
 typedef struct _avl_tree_node {
 	void *item;
 	struct _avl_tree_node *left;
@@ -28,20 +34,55 @@ typedef struct _avl_tree_node {
 	int32_t height;
 } avl_tree_node;
 
+// A node of a tree in order statistics mode, which also counts the nodes
+// of its subtree. Other trees do not pay for the count.
+typedef struct _avl_tree_counted_node {
+	avl_tree_node node;
+	uint64_t size;
+} avl_tree_counted_node;
+
 typedef struct _avl_queue_entry {
 	avl_tree_node *node;
 	struct _avl_queue_entry *next;
 } avl_queue_entry;
 
+// Built-in node allocator. Nodes are handed out from large chunks and
+// recycled through a free list; all of them are released together.
+typedef struct _avl_slab_chunk {
+	struct _avl_slab_chunk *next;
+	uint64_t num_nodes;
+	avl_tree_node nodes[];
+} avl_slab_chunk;
+
+typedef struct _avl_slab {
+	avl_slab_chunk *chunks;   // most recently allocated chunk first
+	uint64_t chunk_used;      // nodes handed out of the first chunk
+	uint64_t node_size;       // bytes per node, sizeof(avl_tree_node) or more
+	avl_tree_node *free_list; // linked through the left pointers
+} avl_slab;
+
 typedef struct _avl_tree {
 	avl_tree_node *root;
+	uint64_t num_items;
+	int order_statistics;
+	int atomic_links; // set by avl_concurrent_tree for its lock-free lookups
+	void (*augment)(avl_tree_node *node);
 	avl_tree_node * (*allocate_node)(void *item);
 	void (*free_node)(avl_tree_node * );
 	int64_t (*compare_items)(void * , void * );
 	avl_queue_entry * (*allocate_entry)(avl_tree_node * );
 	void (*free_entry)(avl_queue_entry * );
+	int use_slab;
+	uint64_t node_size; // bytes per node allocate_node returns
+	avl_slab slab;
 } avl_tree;
 
+// Pass NULL for both allocate_node and free_node to have the tree use its
+// built-in slab allocator. avl_tree_destroy() then frees whole chunks
+// instead of visiting each node. If only one of them is NULL, the slab is
+// used and the other is ignored, so nodes are never freed by a different
+// allocator than the one they came from.
+// allocate_entry and free_entry are no longer called and may be NULL.
 void avl_tree_init(avl_tree *t,
 		avl_tree_node * (*allocate_node)(void *item),
 		void (*free_node)(avl_tree_node * ),
@@ -49,6 +90,12 @@ void avl_tree_init(avl_tree *t,
 		avl_queue_entry * (*allocate_entry)(avl_tree_node * ),
 		void (*free_entry)(avl_queue_entry * ));
 
+// Declares that allocate_node returns nodes of node_size bytes, such as
+// avl_tree_counted_nodes for a tree that will enable order statistics.
+// avl_tree_init() assumes sizeof(avl_tree_node). Slab trees size their
+// own nodes and ignore it.
+void avl_tree_set_node_size(avl_tree *t, uint64_t node_size);
+
 void avl_tree_destroy(avl_tree *t);
 
 // 0 if insertion failed
@@ -57,11 +104,99 @@ int avl_tree_insert(avl_tree *t, void *item);
 // 0 if removal failed
 int avl_tree_remove(avl_tree *t, void *item);
 
-uint32_t avl_tree_num_items(avl_tree *t);
+// Builds a perfectly balanced tree from items, which must be strictly
+// increasing, in O(n). The order is checked before any node is allocated.
+// The tree must be empty. Slab trees get their nodes from a single chunk.
+// 0 if building failed; the tree is then left empty.
+int avl_tree_build_sorted(avl_tree *t, void **items, uint64_t n);
+
+// Insert or remove a batch of m items, in any order, and return how many
+// were inserted or removed. The batch is sorted first, O(m log m), and
+// then takes O(m log(n/m + 1)): it is built into a tree and combined with
+// t by avl_tree_union() or avl_tree_difference(). A batch of at least a
+// quarter of n is instead merged with the tree's items and the tree
+// rebuilt, O(n + m); one of a few dozen items is applied item by item.
+// Items already present (or missing, for removal) are skipped.
+uint64_t avl_tree_insert_batch(avl_tree *t, void **items, uint64_t n);
+
+uint64_t avl_tree_remove_batch(avl_tree *t, void **items, uint64_t n);
+
+// Moves item and every item of t2 into t1, leaving t2 empty. Every item
+// of t1 must be less than item, and item less than every item of t2.
+// Both trees must allocate nodes the same way. O(log n).
+// 0 if joining failed
+int avl_tree_join(avl_tree *t1, void *item, avl_tree *t2);
+
+// Moves every item of t greater than item into greater, which must be
+// empty and allocate nodes the same way as t. Slab trees cannot be split,
+// since a slab can only release its nodes all together.
+// O(log n) in order statistics mode; otherwise counting the items moved
+// costs O(their number).
+// 0 if splitting failed
+int avl_tree_split(avl_tree *t, void *item, avl_tree *greater);
+
+// Removes the items in [lo, hi) and returns how many there were. The
+// range is cut out with two splits and the rest joined back together,
+// O(log n), and then its k nodes are released, O(k). Works for slab
+// trees too, since the nodes never leave t.
+uint64_t avl_tree_range_remove(avl_tree *t, void *lo, void *hi);
+
+// Set operations on the items of t1 and t2, in O(m log(n/m + 1)) time
+// for trees of sizes m <= n, plus O(1) for each node that drops out and
+// is released. The result is left in t1; t2 is left empty.
+// Where both trees hold an item, t1's copy is kept.
+// The union moves t2's nodes into t1, so both trees must allocate nodes
+// the same way; 0 if they do not, or if out of memory.
+int avl_tree_union(avl_tree *t1, avl_tree *t2);
+
+void avl_tree_intersection(avl_tree *t1, avl_tree *t2);
+
+void avl_tree_difference(avl_tree *t1, avl_tree *t2);
+
+uint64_t avl_tree_num_items(avl_tree *t);
 
 // NULL if not found
 avl_tree_node * avl_tree_find(avl_tree *t, void *item);
 
+// Looks up n items, storing the node of each (or NULL) in results.
+// The searches advance in lockstep, each prefetching its next node, so
+// that the cache misses of independent searches overlap.
+void avl_tree_find_batch(avl_tree *t, void **items, uint64_t n,
+			 avl_tree_node **results);
+
+// An iterator holds the path from the root to its current node, so
+// stepping to the next or previous node takes O(1) amortized time and
+// no memory is allocated. It can be stopped at any point and needs no
+// cleanup. Changing the tree invalidates its iterators.
+typedef struct _avl_tree_iter {
+	avl_tree *t;
+	int depth; // 0 when past either end
+	avl_tree_node *path[AVL_TREE_MAX_HEIGHT];
+} avl_tree_iter;
+
+// The iterator starts past the end; the functions below position it.
+void avl_tree_iter_init(avl_tree_iter *it, avl_tree *t);
+
+// Each returns the node the iterator moves to,
+// NULL if it moves past the end (or there is no such node).
+avl_tree_node * avl_tree_iter_first(avl_tree_iter *it);
+
+avl_tree_node * avl_tree_iter_last(avl_tree_iter *it);
+
+// The first node whose item is not less than item.
+avl_tree_node * avl_tree_iter_seek_lower_bound(avl_tree_iter *it, void *item);
+
+// The first node whose item is greater than item.
+avl_tree_node * avl_tree_iter_seek_upper_bound(avl_tree_iter *it, void *item);
+
+// Stepping from past the end gives NULL.
+avl_tree_node * avl_tree_iter_next(avl_tree_iter *it);
+
+avl_tree_node * avl_tree_iter_prev(avl_tree_iter *it);
+
+// NULL if past the end
+avl_tree_node * avl_tree_iter_node(avl_tree_iter *it);
+
 void avl_tree_pre_order(avl_tree *t,
 			void (*visitor)(avl_tree_node *node, void *context),
 			void *context);
@@ -70,14 +205,88 @@ void avl_tree_in_order(avl_tree *t,
 		       void (*visitor)(avl_tree_node *node, void *context),
 		       void *context);
 
+// Visits the items in [lo, hi) in order, in O(log n + k) for k items.
+void avl_tree_range_visit(avl_tree *t, void *lo, void *hi,
+			  void (*visitor)(avl_tree_node *node, void *context),
+			  void *context);
+
 void avl_tree_post_order(avl_tree *t,
 			 void (*visitor)(avl_tree_node *node, void *context),
 			 void *context);
 
-void avl_tree_level_order(avl_tree *t,
-			  void (*visitor)(avl_tree_node *node, void *context, int level),
-			  void *context);
+// Visits the nodes level by level, in O(n). The queue is a single array
+// of avl_tree_level_order_scratch_size() node pointers, never more than
+// (n + 1) / 2 of them.
+// 0 if the queue could not be allocated; nothing is visited then.
+int avl_tree_level_order(avl_tree *t,
+			 void (*visitor)(avl_tree_node *node, void *context, int level),
+			 void *context);
+
+uint64_t avl_tree_level_order_scratch_size(avl_tree *t);
+
+// The same, with the queue in memory the caller provides.
+// 0 if scratch_size is too small; nothing is visited then.
+int avl_tree_level_order_scratch(avl_tree *t,
+				 void (*visitor)(avl_tree_node *node, void *context, int level),
+				 void *context,
+				 avl_tree_node **scratch,
+				 uint64_t scratch_size);
 
 int32_t avl_tree_height(avl_tree *t);
 
+// Order statistics mode: each node tracks the size of its subtree so that
+// the queries below run in O(log n). The count lives in an
+// avl_tree_counted_node, so only trees in this mode pay for it.
+// A slab tree moves its nodes to a slab of counted nodes, which makes
+// node pointers taken before the call invalid. A tree with its own
+// allocate_node must have declared counted nodes with
+// avl_tree_set_node_size(). Enabling the mode on a non-empty tree
+// computes the sizes of the existing nodes once, in O(n).
+// 0 if the nodes are too small or out of memory; the tree is then
+// unchanged.
+int avl_tree_enable_order_statistics(avl_tree *t);
+
+// The k-th smallest item (k is 0-based).
+// NULL if k is out of range or order statistics are not enabled.
+avl_tree_node * avl_tree_select(avl_tree *t, uint64_t k);
+
+// The number of items that are less than item.
+// 0 if order statistics are not enabled.
+uint64_t avl_tree_rank(avl_tree *t, void *item);
+
+// The number of items in [lo, hi).
+// 0 if order statistics are not enabled.
+uint64_t avl_tree_count_range(avl_tree *t, void *lo, void *hi);
+
+// Augmentation: augment(node) is called wherever a node's height is
+// recomputed, after its children are final, to recompute whatever the
+// caller derives from node->item and the children (a subtree sum or
+// maximum, kept in the items). Insertions and removals then update every
+// ancestor of the change instead of stopping where the heights settle.
+// Setting a hook on a non-empty tree calls it on every node once, in
+// post order, O(n). NULL turns augmentation off.
+void avl_tree_set_augment(avl_tree *t, void (*augment)(avl_tree_node *node));
+
+void avl_slab_init(avl_slab *s);
+
+// A slab of nodes node_size bytes long, such as avl_tree_counted_node.
+void avl_slab_init_size(avl_slab *s, uint64_t node_size);
+
+// NULL if out of memory
+avl_tree_node * avl_slab_alloc(avl_slab *s, void *item);
+
+void avl_slab_free(avl_slab *s, avl_tree_node *node);
+
+// Makes sure that the next num_nodes allocations which do not come from the
+// free list are carved consecutively out of one chunk.
+// 0 if out of memory
+int avl_slab_reserve(avl_slab *s, uint64_t num_nodes);
+
+// Moves every node of src, handed out or free, to dst; src is left empty.
+// src's nodes must be at least as large as dst's.
+void avl_slab_merge(avl_slab *dst, avl_slab *src);
+
+// Releases every node handed out by the slab. Its node size is kept.
+void avl_slab_destroy(avl_slab *s);
+
 #endif // __AVL_H__
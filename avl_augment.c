@@ -0,0 +1,33 @@
+/*
+** avl_augment.c : implementation of AVL Tree augmentation
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "avl.h"
+#include "avl_foreach.h"
+
+void avl_tree_set_augment(avl_tree *t, void (*augment)(avl_tree_node *node))
+{
+	avl_tree_node *node;
+
+	t->augment = augment;
+	if (!augment)
+		return;
+
+	// children before parents
+	AVL_FOREACH_POST_ORDER(t, node)
+		augment(node);
+}
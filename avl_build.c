@@ -0,0 +1,458 @@
+/*
+** avl_build.c : bulk loading and batch updates of AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#define _GNU_SOURCE // qsort_r
+#include <stdlib.h>
+
+#include "avl.h"
+#include "avl_util.h"
+#include "avl_pool.h"
+
+// A batch of m items is merged into a tree of n by flattening and
+// rebuilding it, O(n + m), once m is at least n over this ratio. Smaller
+// batches are built into a tree of their own and combined with the split
+// and join set operations, O(m log(n/m + 1)).
+#define AVL_TREE_BATCH_REBUILD_RATIO 4
+
+// Batches of at most this many items are applied one by one, in order:
+// for so few, sorting and building a tree of them costs more than the
+// set operations save.
+#define AVL_TREE_BATCH_LOOP_MAX 64
+
+typedef struct _avl_tree_build_context {
+	avl_tree *t;
+	avl_pool *pool;
+	void **first;
+	avl_tree_node *slab_nodes; // a slab tree's nodes, one per item, or NULL
+	int failed;
+} avl_tree_build_context;
+
+static avl_tree_node * avl_tree_build_node(avl_tree_build_context *c,
+					   void **items, uint64_t n);
+
+typedef struct _avl_tree_build_task {
+	avl_pool_task task;
+	avl_tree_build_context *c;
+	void **items;
+	uint64_t n;
+	avl_tree_node *result;
+} avl_tree_build_task;
+
+static void avl_tree_build_task_run(avl_pool_task *task)
+{
+	avl_tree_build_task *bt = (avl_tree_build_task *) task;
+	bt->result = avl_tree_build_node(bt->c, bt->items, bt->n);
+}
+
+// Build the subtree holding items[0 .. n-1], rooted at the middle item.
+// The halves differ in size by at most one, so the subtree is perfectly
+// balanced. Without a pool, nodes are allocated in order, which keeps an
+// in-order walk moving forward through memory; a slab tree's nodes are
+// placed in order in any case.
+// NULL if n == 0 or out of memory.
+static avl_tree_node * avl_tree_build_node(avl_tree_build_context *c,
+					   void **items, uint64_t n)
+{
+	avl_tree_build_task left_task;
+	avl_tree_node *left;
+	avl_tree_node *right;
+	avl_tree_node *node;
+	avl_tree *t = c->t;
+	uint64_t mid;
+	int forked = 0;
+
+	if (!n)
+		return NULL;
+
+	mid = n / 2;
+
+	if (c->pool && n >= (1ULL << AVL_POOL_GRAIN_HEIGHT)) {
+		left_task.task.run = avl_tree_build_task_run;
+		left_task.c = c;
+		left_task.items = items;
+		left_task.n = mid;
+		avl_pool_fork(c->pool, &left_task.task);
+		forked = 1;
+	} else {
+		left = avl_tree_build_node(c, items, mid);
+	}
+
+	if (c->slab_nodes) {
+		node = (avl_tree_node *) ((char *) c->slab_nodes +
+					  (items + mid - c->first) * t->slab.node_size);
+		node->item = items[mid];
+	} else {
+		node = t->allocate_node(items[mid]);
+	}
+
+	right = avl_tree_build_node(c, items + mid + 1, n - mid - 1);
+
+	if (forked) {
+		avl_pool_join(c->pool, &left_task.task);
+		left = left_task.result;
+	}
+
+	if (!node || (mid && !left) || (n - mid - 1 && !right)) {
+		__atomic_store_n(&c->failed, 1, __ATOMIC_RELAXED);
+		if (!c->slab_nodes) {
+			avl_tree_release_subtree(t, left, NULL);
+			avl_tree_release_subtree(t, right, NULL);
+			if (node)
+				avl_tree_release_node(t, node);
+		}
+		return NULL;
+	}
+
+	node->left = left;
+	node->right = right;
+	avl_tree_update_node(t, node);
+	return node;
+}
+
+int avl_tree_build_sorted_parallel(avl_pool *p, avl_tree *t, void **items, uint64_t n)
+{
+	avl_tree_build_context c;
+	avl_tree_build_task root;
+	uint64_t i;
+
+	if (t->root)
+		return 0;
+
+	if (!n)
+		return 1;
+
+	// Reject unsorted input before anything is allocated; one pass of
+	// comparisons is cheap next to n allocations.
+	for (i = 1 ; i < n ; ++i) {
+		if (t->compare_items(items[i - 1], items[i]) >= 0)
+			return 0;
+	}
+
+	c.t = t;
+	c.pool = p;
+	c.first = items;
+	c.slab_nodes = NULL;
+	c.failed = 0;
+
+	if (t->use_slab) {
+		// The tree is empty, so every node of the slab is free.
+		avl_slab_destroy(&t->slab);
+		if (!avl_slab_reserve(&t->slab, n))
+			return 0;
+		c.slab_nodes = avl_slab_node_at(&t->slab, t->slab.chunks,
+						t->slab.chunk_used);
+		t->slab.chunk_used += n;
+	}
+
+	root.task.run = avl_tree_build_task_run;
+	root.c = &c;
+	root.items = items;
+	root.n = n;
+
+	if (p)
+		avl_pool_run(p, &root.task);
+	else
+		avl_tree_build_task_run(&root.task);
+
+	if (c.failed) {
+		if (c.slab_nodes)
+			avl_slab_destroy(&t->slab);
+		else
+			avl_tree_release_subtree(t, root.result, NULL);
+		return 0;
+	}
+
+	t->root = root.result;
+	t->num_items = n;
+	return 1;
+}
+
+int avl_tree_build_sorted(avl_tree *t, void **items, uint64_t n)
+{
+	return avl_tree_build_sorted_parallel(NULL, t, items, n);
+}
+
+// Link nodes[0 .. n-1], which are in order, into a perfectly balanced
+// subtree and return its root.
+static avl_tree_node * avl_tree_link_nodes(avl_tree *t, avl_tree_node **nodes, uint64_t n)
+{
+	avl_tree_node *node;
+	uint64_t mid;
+
+	if (!n)
+		return NULL;
+
+	mid = n / 2;
+	node = nodes[mid];
+
+	node->left = avl_tree_link_nodes(t, nodes, mid);
+	node->right = avl_tree_link_nodes(t, nodes + mid + 1, n - mid - 1);
+
+	avl_tree_update_node(t, node);
+	return node;
+}
+
+// Store the nodes of the tree in order; returns how many were stored.
+static uint64_t avl_tree_flatten(avl_tree *t, avl_tree_node **nodes)
+{
+	avl_tree_node *stack[AVL_TREE_MAX_HEIGHT];
+	avl_tree_node *node = t->root;
+	uint64_t n = 0;
+	int depth = 0;
+
+	while (node || depth) {
+		while (node) {
+			stack[depth++] = node;
+			node = node->left;
+		}
+		node = stack[--depth];
+		nodes[n++] = node;
+		node = node->right;
+	}
+
+	return n;
+}
+
+static int avl_tree_compare_pointers(const void *a, const void *b, void *context)
+{
+	avl_tree *t = (avl_tree *) context;
+	int64_t res = t->compare_items(*(void **) a, *(void **) b);
+	return (res > 0) - (res < 0);
+}
+
+// A sorted copy of items, or NULL if out of memory.
+static void ** avl_tree_sort_batch(avl_tree *t, void **items, uint64_t n)
+{
+	void **sorted = (void **) malloc(n * sizeof(void *));
+	uint64_t i;
+
+	if (!sorted)
+		return NULL;
+
+	for (i = 0 ; i < n ; ++i)
+		sorted[i] = items[i];
+
+	qsort_r(sorted, n, sizeof(void *), avl_tree_compare_pointers, t);
+	return sorted;
+}
+
+// Drop the repeats from sorted, keeping the first of equal items, and
+// return how many items are left.
+static uint64_t avl_tree_unique_batch(avl_tree *t, void **sorted, uint64_t m)
+{
+	uint64_t out = 1;
+	uint64_t i;
+
+	for (i = 1 ; i < m ; ++i) {
+		if (t->compare_items(sorted[out - 1], sorted[i]))
+			sorted[out++] = sorted[i];
+	}
+
+	return out;
+}
+
+// Whether m updates should be merged into the tree in O(n + m) rather
+// than combined with it in O(m log(n/m + 1)).
+static int avl_tree_batch_rebuilds(avl_tree *t, uint64_t m)
+{
+	return m * AVL_TREE_BATCH_REBUILD_RATIO >= t->num_items;
+}
+
+static uint64_t avl_tree_merge_insert(avl_tree *t, void **sorted, uint64_t m)
+{
+	avl_tree_node **nodes;
+	avl_tree_node *node;
+	uint64_t n = t->num_items;
+	uint64_t inserted = 0;
+	uint64_t out = 0;
+	uint64_t i;
+	uint64_t j;
+	int64_t res;
+
+	nodes = (avl_tree_node **) malloc((n + m) * sizeof(avl_tree_node *));
+	if (!nodes)
+		return 0;
+
+	// The old nodes go at the back, so that merging writes in front of
+	// them without overtaking the ones not yet read.
+	avl_tree_flatten(t, nodes + m);
+
+	i = m;
+	j = 0;
+
+	while (j < m) {
+		if (i < n + m) {
+			res = t->compare_items(sorted[j], nodes[i]->item);
+			if (res > 0) {
+				nodes[out++] = nodes[i++];
+				continue;
+			}
+			if (!res) { // item collision - new item not inserted
+				++j;
+				continue;
+			}
+		}
+
+		node = avl_tree_alloc_node(t, sorted[j++]);
+		if (!node)
+			break;
+
+		nodes[out++] = node;
+		++inserted;
+	}
+
+	while (i < n + m)
+		nodes[out++] = nodes[i++];
+
+	t->root = avl_tree_link_nodes(t, nodes, out);
+	t->num_items = out;
+
+	free(nodes);
+	return inserted;
+}
+
+static uint64_t avl_tree_merge_remove(avl_tree *t, void **sorted, uint64_t m)
+{
+	avl_tree_node **nodes;
+	uint64_t n = t->num_items;
+	uint64_t out = 0;
+	uint64_t i = 0;
+	uint64_t j = 0;
+	int64_t res;
+
+	nodes = (avl_tree_node **) malloc(n * sizeof(avl_tree_node *));
+	if (!nodes)
+		return 0;
+
+	avl_tree_flatten(t, nodes);
+
+	while (i < n) {
+		res = j < m ? t->compare_items(sorted[j], nodes[i]->item) : 1;
+		if (res < 0) {
+			++j;
+		} else if (res > 0) {
+			nodes[out++] = nodes[i++];
+		} else {
+			avl_tree_release_node(t, nodes[i++]);
+			++j;
+		}
+	}
+
+	t->root = avl_tree_link_nodes(t, nodes, out);
+	t->num_items = out;
+
+	free(nodes);
+	return n - out;
+}
+
+// Build the batch with t's allocator, in t's mode, and take its union
+// with t. The union keeps t's copy of an item both hold.
+static uint64_t avl_tree_union_insert(avl_tree *t, void **sorted, uint64_t m)
+{
+	avl_tree batch;
+	uint64_t n = t->num_items;
+	int ok;
+
+	avl_tree_init(&batch,
+		      t->use_slab ? NULL : t->allocate_node,
+		      t->use_slab ? NULL : t->free_node,
+		      t->compare_items,
+		      NULL,
+		      NULL);
+	avl_tree_set_node_size(&batch, t->node_size);
+	avl_tree_set_augment(&batch, t->augment);
+
+	ok = (!t->order_statistics || avl_tree_enable_order_statistics(&batch)) &&
+	     avl_tree_build_sorted(&batch, sorted, m) &&
+	     avl_tree_union(t, &batch);
+
+	avl_tree_destroy(&batch);
+	return ok ? t->num_items - n : 0;
+}
+
+// The batch's nodes never join t, so they come from a slab of their own
+// and go all together.
+static uint64_t avl_tree_difference_remove(avl_tree *t, void **sorted, uint64_t m)
+{
+	avl_tree batch;
+	uint64_t n = t->num_items;
+
+	avl_tree_init(&batch, NULL, NULL, t->compare_items, NULL, NULL);
+
+	if (avl_tree_build_sorted(&batch, sorted, m))
+		avl_tree_difference(t, &batch);
+
+	avl_tree_destroy(&batch);
+	return n - t->num_items;
+}
+
+uint64_t avl_tree_insert_batch(avl_tree *t, void **items, uint64_t n)
+{
+	void **sorted;
+	uint64_t inserted = 0;
+	uint64_t i;
+
+	if (!n)
+		return 0;
+
+	sorted = avl_tree_sort_batch(t, items, n);
+	if (!sorted)
+		return 0;
+
+	n = avl_tree_unique_batch(t, sorted, n);
+
+	if (avl_tree_batch_rebuilds(t, n)) {
+		inserted = avl_tree_merge_insert(t, sorted, n);
+	} else if (n > AVL_TREE_BATCH_LOOP_MAX) {
+		inserted = avl_tree_union_insert(t, sorted, n);
+	} else {
+		for (i = 0 ; i < n ; ++i)
+			inserted += avl_tree_insert(t, sorted[i]);
+	}
+
+	free(sorted);
+	return inserted;
+}
+
+uint64_t avl_tree_remove_batch(avl_tree *t, void **items, uint64_t n)
+{
+	void **sorted;
+	uint64_t removed = 0;
+	uint64_t i;
+
+	if (!n || !t->root)
+		return 0;
+
+	sorted = avl_tree_sort_batch(t, items, n);
+	if (!sorted)
+		return 0;
+
+	n = avl_tree_unique_batch(t, sorted, n);
+
+	if (avl_tree_batch_rebuilds(t, n)) {
+		removed = avl_tree_merge_remove(t, sorted, n);
+	} else if (n > AVL_TREE_BATCH_LOOP_MAX) {
+		removed = avl_tree_difference_remove(t, sorted, n);
+	} else {
+		for (i = 0 ; i < n ; ++i)
+			removed += avl_tree_remove(t, sorted[i]);
+	}
+
+	free(sorted);
+	return removed;
+}
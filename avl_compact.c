@@ -0,0 +1,450 @@
+/*
+** avl_compact.c : implementation of compact AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "avl.h"
+#include "avl_compact.h"
+
+// Nodes start in an array of this many slots, which doubles as needed.
+#define AVL_COMPACT_MIN_NODES 64
+
+// dir is 0 for left and 1 for right; the matching balance is -1 or +1.
+#define avl_compact_sign(__dir) ((__dir) ? 1 : -1)
+
+static inline avl_compact_node * avl_compact_node_at(avl_compact_tree *t,
+						     uint32_t index)
+{
+	return &t->nodes[index];
+}
+
+static inline uint32_t avl_compact_child(avl_compact_node *node, int dir)
+{
+	return AVL_COMPACT_INDEX(dir ? node->right : node->left);
+}
+
+// Replace a child link, keeping the balance bit.
+static inline void avl_compact_set_child(avl_compact_node *node, int dir,
+					 uint32_t index)
+{
+	if (dir)
+		node->right = (node->right & AVL_COMPACT_HEAVY) | index;
+	else
+		node->left = (node->left & AVL_COMPACT_HEAVY) | index;
+}
+
+// height(right) - height(left): -1, 0 or 1.
+static inline int avl_compact_balance(avl_compact_node *node)
+{
+	return (int) (node->right >> 31) - (int) (node->left >> 31);
+}
+
+static inline void avl_compact_set_balance(avl_compact_node *node, int balance)
+{
+	node->left = AVL_COMPACT_INDEX(node->left) |
+		     (balance < 0 ? AVL_COMPACT_HEAVY : 0);
+	node->right = AVL_COMPACT_INDEX(node->right) |
+		      (balance > 0 ? AVL_COMPACT_HEAVY : 0);
+}
+
+/*
+// Rotate the child on side dir up into index's place; the caller fixes
+// the balance bits. With dir == 0 this is avl_tree_ror_node(), with
+// dir == 1 avl_tree_rol_node().
+*/
+static inline uint32_t avl_compact_rotate(avl_compact_tree *t,
+					  uint32_t index, int dir)
+{
+	avl_compact_node *node = avl_compact_node_at(t, index);
+	uint32_t child = avl_compact_child(node, dir);
+	avl_compact_node *child_node = avl_compact_node_at(t, child);
+
+	avl_compact_set_child(node, dir, avl_compact_child(child_node, !dir));
+	avl_compact_set_child(child_node, !dir, index);
+
+	return child;
+}
+
+// Point the link that led to path[depth] at index.
+static inline void avl_compact_relink(avl_compact_tree *t,
+				      uint32_t *path, uint8_t *dir,
+				      int depth, uint32_t index)
+{
+	if (depth)
+		avl_compact_set_child(avl_compact_node_at(t, path[depth - 1]),
+				      dir[depth - 1], index);
+	else
+		t->root = index;
+}
+
+static uint32_t avl_compact_alloc(avl_compact_tree *t, void *item)
+{
+	avl_compact_node *node;
+	uint32_t index;
+
+	if (t->free_list) {
+		index = t->free_list;
+		t->free_list = avl_compact_node_at(t, index)->left;
+	} else {
+		if (t->used >= t->capacity) {
+			uint64_t capacity = t->capacity ?
+				(uint64_t) t->capacity * 2 : AVL_COMPACT_MIN_NODES;
+			avl_compact_node *nodes;
+
+			if (capacity > (uint64_t) AVL_COMPACT_MAX_NODES + 1)
+				capacity = (uint64_t) AVL_COMPACT_MAX_NODES + 1;
+			if (capacity <= t->used)
+				return AVL_COMPACT_NULL;
+
+			nodes = (avl_compact_node *)
+				realloc(t->nodes, capacity * sizeof(avl_compact_node));
+			if (!nodes)
+				return AVL_COMPACT_NULL;
+
+			t->nodes = nodes;
+			t->capacity = (uint32_t) capacity;
+		}
+		index = t->used++;
+	}
+
+	node = avl_compact_node_at(t, index);
+	node->item = item;
+	node->left = AVL_COMPACT_NULL;
+	node->right = AVL_COMPACT_NULL;
+
+	return index;
+}
+
+static void avl_compact_free(avl_compact_tree *t, uint32_t index)
+{
+	avl_compact_node_at(t, index)->left = t->free_list;
+	t->free_list = index;
+}
+
+void avl_compact_tree_init(avl_compact_tree *t,
+			   int64_t (*compare_items)(void * , void * ))
+{
+	t->nodes = NULL;
+	t->capacity = 0;
+	t->used = 1; // slot 0 is AVL_COMPACT_NULL
+	t->free_list = AVL_COMPACT_NULL;
+	t->root = AVL_COMPACT_NULL;
+	t->num_items = 0;
+	t->compare_items = compare_items;
+}
+
+void avl_compact_tree_destroy(avl_compact_tree *t)
+{
+	free(t->nodes);
+	avl_compact_tree_init(t, t->compare_items);
+}
+
+int avl_compact_tree_insert(avl_compact_tree *t, void *item)
+{
+	uint32_t path[AVL_TREE_MAX_HEIGHT];
+	uint8_t dir[AVL_TREE_MAX_HEIGHT];
+	avl_compact_node *node;
+	avl_compact_node *child_node;
+	uint32_t index;
+	uint32_t child;
+	int64_t res;
+	int depth = 0;
+
+	index = t->root;
+
+	while (index) {
+		node = avl_compact_node_at(t, index);
+
+		res = t->compare_items(item, node->item);
+
+		if (!res) // item collision - new item not inserted
+			return 0;
+
+		path[depth] = index;
+		dir[depth] = res > 0;
+		++depth;
+
+		index = avl_compact_child(node, res > 0);
+	}
+
+	// may move the node array
+	index = avl_compact_alloc(t, item);
+	if (!index)
+		return 0;
+
+	avl_compact_relink(t, path, dir, depth, index);
+	++t->num_items;
+
+	// Retrace: the subtree on side d of each node on the path grew.
+	while (depth > 0) {
+		int d;
+		int s;
+		int balance;
+
+		--depth;
+		index = path[depth];
+		node = avl_compact_node_at(t, index);
+		d = dir[depth];
+		s = avl_compact_sign(d);
+
+		balance = avl_compact_balance(node);
+
+		if (!balance) {
+			// node grew; keep going.
+			avl_compact_set_balance(node, s);
+			continue;
+		}
+
+		if (balance == -s) {
+			// node's shorter side caught up.
+			avl_compact_set_balance(node, 0);
+			break;
+		}
+
+		// node is two taller on side d.
+		child = avl_compact_child(node, d);
+		child_node = avl_compact_node_at(t, child);
+
+		if (avl_compact_balance(child_node) == s) {
+			// Left Left / Right Right Case
+			index = avl_compact_rotate(t, index, d);
+			avl_compact_set_balance(node, 0);
+			avl_compact_set_balance(child_node, 0);
+		} else {
+			// Left Right / Right Left Case
+			avl_compact_node *grandchild_node =
+				avl_compact_node_at(t, avl_compact_child(child_node, !d));
+			int grandchild_balance = avl_compact_balance(grandchild_node);
+
+			avl_compact_set_child(node, d, avl_compact_rotate(t, child, !d));
+			index = avl_compact_rotate(t, index, d);
+
+			avl_compact_set_balance(node, grandchild_balance == s ? -s : 0);
+			avl_compact_set_balance(child_node, grandchild_balance == -s ? s : 0);
+			avl_compact_set_balance(grandchild_node, 0);
+		}
+
+		// a rotation after an insert restores the original height.
+		avl_compact_relink(t, path, dir, depth, index);
+		break;
+	}
+
+	return 1;
+}
+
+int avl_compact_tree_remove(avl_compact_tree *t, void *item)
+{
+	uint32_t path[AVL_TREE_MAX_HEIGHT];
+	uint8_t dir[AVL_TREE_MAX_HEIGHT];
+	avl_compact_node *node;
+	avl_compact_node *child_node;
+	uint32_t index;
+	uint32_t child;
+	int64_t res;
+	int depth = 0;
+
+	index = t->root;
+
+	while (index) {
+		node = avl_compact_node_at(t, index);
+
+		res = t->compare_items(item, node->item);
+
+		if (!res)
+			break;
+
+		path[depth] = index;
+		dir[depth] = res > 0;
+		++depth;
+
+		index = avl_compact_child(node, res > 0);
+	}
+
+	if (!index)
+		return 0;
+
+	node = avl_compact_node_at(t, index);
+
+	if (!avl_compact_child(node, 0) || !avl_compact_child(node, 1)) {
+		// one or both children empty.
+		avl_compact_relink(t, path, dir, depth,
+				   avl_compact_child(node, !avl_compact_child(node, 0)));
+	} else {
+		// both children present.
+		// unlink the successor and put it in node's place.
+		avl_compact_node *successor_node;
+		uint32_t successor;
+		int node_depth = depth;
+
+		path[depth] = index;
+		dir[depth] = 1;
+		++depth;
+
+		successor = avl_compact_child(node, 1);
+		successor_node = avl_compact_node_at(t, successor);
+
+		while (avl_compact_child(successor_node, 0)) {
+			path[depth] = successor;
+			dir[depth] = 0;
+			++depth;
+			successor = avl_compact_child(successor_node, 0);
+			successor_node = avl_compact_node_at(t, successor);
+		}
+
+		avl_compact_relink(t, path, dir, depth,
+				   avl_compact_child(successor_node, 1));
+
+		// takes over node's children and balance
+		successor_node->left = node->left;
+		successor_node->right = node->right;
+
+		path[node_depth] = successor;
+		avl_compact_relink(t, path, dir, node_depth, successor);
+	}
+
+	avl_compact_free(t, index);
+	--t->num_items;
+
+	// Retrace: the subtree on side d of each node on the path shrank.
+	while (depth > 0) {
+		int d;
+		int s;
+		int balance;
+		int child_balance;
+
+		--depth;
+		index = path[depth];
+		node = avl_compact_node_at(t, index);
+		d = dir[depth];
+		s = avl_compact_sign(d);
+
+		balance = avl_compact_balance(node);
+
+		if (balance == s) {
+			// node shrank; keep going.
+			avl_compact_set_balance(node, 0);
+			continue;
+		}
+
+		if (!balance) {
+			// node keeps its height.
+			avl_compact_set_balance(node, -s);
+			break;
+		}
+
+		// node is two taller on the other side.
+		child = avl_compact_child(node, !d);
+		child_node = avl_compact_node_at(t, child);
+		child_balance = avl_compact_balance(child_node);
+
+		if (!child_balance) {
+			// single rotation; the height is unchanged.
+			index = avl_compact_rotate(t, index, !d);
+			avl_compact_set_balance(node, -s);
+			avl_compact_set_balance(child_node, s);
+			avl_compact_relink(t, path, dir, depth, index);
+			break;
+		}
+
+		if (child_balance == -s) {
+			// single rotation; the subtree shrank.
+			index = avl_compact_rotate(t, index, !d);
+			avl_compact_set_balance(node, 0);
+			avl_compact_set_balance(child_node, 0);
+		} else {
+			// double rotation; the subtree shrank.
+			avl_compact_node *grandchild_node =
+				avl_compact_node_at(t, avl_compact_child(child_node, d));
+			int grandchild_balance = avl_compact_balance(grandchild_node);
+
+			avl_compact_set_child(node, !d, avl_compact_rotate(t, child, d));
+			index = avl_compact_rotate(t, index, !d);
+
+			avl_compact_set_balance(node, grandchild_balance == -s ? s : 0);
+			avl_compact_set_balance(child_node, grandchild_balance == s ? -s : 0);
+			avl_compact_set_balance(grandchild_node, 0);
+		}
+
+		avl_compact_relink(t, path, dir, depth, index);
+	}
+
+	return 1;
+}
+
+uint64_t avl_compact_tree_num_items(avl_compact_tree *t)
+{
+	return t->num_items;
+}
+
+avl_compact_node * avl_compact_tree_find(avl_compact_tree *t, void *item)
+{
+	avl_compact_node *node;
+	uint32_t index;
+	int64_t res;
+
+	index = t->root;
+
+	while (index) {
+		node = avl_compact_node_at(t, index);
+
+		res = t->compare_items(item, node->item);
+
+		if (res < 0) {
+			index = AVL_COMPACT_INDEX(node->left);
+		} else if (res > 0) {
+			index = AVL_COMPACT_INDEX(node->right);
+		} else {
+			return node;
+		}
+
+	}
+
+	return NULL;
+}
+
+void avl_compact_tree_in_order(avl_compact_tree *t,
+			       void (*visitor)(avl_compact_node *node, void *context),
+			       void *context)
+{
+	uint32_t stack[AVL_TREE_MAX_HEIGHT];
+	uint32_t index = t->root;
+	int depth = 0;
+
+	while (index || depth) {
+		while (index) {
+			stack[depth++] = index;
+			index = avl_compact_child(avl_compact_node_at(t, index), 0);
+		}
+		index = stack[--depth];
+		visitor(avl_compact_node_at(t, index), context);
+		index = avl_compact_child(avl_compact_node_at(t, index), 1);
+	}
+}
+
+int32_t avl_compact_tree_height(avl_compact_tree *t)
+{
+	uint32_t index = t->root;
+	int32_t height = 0;
+
+	// follow the taller side down to a leaf
+	while (index) {
+		avl_compact_node *node = avl_compact_node_at(t, index);
+		++height;
+		index = avl_compact_child(node, avl_compact_balance(node) > 0);
+	}
+
+	return height;
+}
@@ -0,0 +1,79 @@
+/*
+** avl_compact.h : definitions for compact AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#ifndef __AVL_COMPACT_H__
+#define __AVL_COMPACT_H__
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+** A compact tree keeps its nodes in one array and links them by 31-bit
+** index, so a node is 16 bytes instead of the 32 of an avl_tree_node.
+** Instead of a height, each node keeps a 2-bit balance factor in the top
+** bits of its child indices: the top bit of left is set when the left
+** subtree is the taller one, and the top bit of right when the right is.
+**
+** Index 0 is never handed out and stands for "no node". The array grows
+** with realloc(), so node pointers are only good until the next insert;
+** indices stay good until the node is removed.
+*/
+#define AVL_COMPACT_NULL      0
+#define AVL_COMPACT_HEAVY     0x80000000u
+#define AVL_COMPACT_INDEX(__link) ((__link) & ~AVL_COMPACT_HEAVY)
+#define AVL_COMPACT_MAX_NODES 0x7fffffffu
+
+typedef struct _avl_compact_node {
+	void *item;
+	uint32_t left;
+	uint32_t right;
+} avl_compact_node;
+
+typedef struct _avl_compact_tree {
+	avl_compact_node *nodes;
+	uint32_t capacity;
+	uint32_t used;      // array slots handed out so far, counting slot 0
+	uint32_t free_list; // removed nodes, linked through left
+	uint32_t root;
+	uint64_t num_items;
+	int64_t (*compare_items)(void * , void * );
+} avl_compact_tree;
+
+void avl_compact_tree_init(avl_compact_tree *t,
+			   int64_t (*compare_items)(void * , void * ));
+
+// Frees the node array; the tree is empty and usable afterwards.
+void avl_compact_tree_destroy(avl_compact_tree *t);
+
+// 0 if insertion failed
+int avl_compact_tree_insert(avl_compact_tree *t, void *item);
+
+// 0 if removal failed
+int avl_compact_tree_remove(avl_compact_tree *t, void *item);
+
+uint64_t avl_compact_tree_num_items(avl_compact_tree *t);
+
+// NULL if not found
+avl_compact_node * avl_compact_tree_find(avl_compact_tree *t, void *item);
+
+void avl_compact_tree_in_order(avl_compact_tree *t,
+			       void (*visitor)(avl_compact_node *node, void *context),
+			       void *context);
+
+int32_t avl_compact_tree_height(avl_compact_tree *t);
+
+#endif // __AVL_COMPACT_H__
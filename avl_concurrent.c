@@ -0,0 +1,343 @@
+/*
+** avl_concurrent.c : implementation of thread-safe AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <stdlib.h>
+#include <sched.h>
+
+#include "avl_concurrent.h"
+#include "avl_util.h"
+
+// Lock-free attempts before a lookup falls back to the read lock.
+#define AVL_CONCURRENT_RETRIES 8
+
+// Removed nodes wait in limbo until there are this many.
+#define AVL_CONCURRENT_LIMBO 256
+
+// The underlying avl_tree allocates and frees through the callbacks
+// below, which need to know the tree. Only a writer calls them, holding
+// the lock, so the tree is passed in a thread-local.
+static __thread avl_concurrent_tree *avl_concurrent_writer;
+
+static __thread int avl_concurrent_slot_index = -1;
+static int avl_concurrent_next_slot;
+
+// A lookup may reach a new node as soon as the insert links it in, and
+// calls compare_items on its item before the sequence number can tell it
+// to retry. So the node's item and links are filled in here; the tree's
+// atomic_links make the store that links the node, which avl_tree_insert()
+// makes after this returns, a release. Lookups follow links with acquire
+// loads, so they see the filled-in node on any CPU.
+static avl_tree_node * avl_concurrent_allocate_node(void *item)
+{
+	avl_concurrent_tree *ct = avl_concurrent_writer;
+	avl_tree_node *node;
+
+	if (ct->use_slab)
+		node = avl_slab_alloc(&ct->slab, item);
+	else
+		node = ct->allocate_node(item);
+
+	if (node) {
+		node->item = item;
+		node->left = NULL;
+		node->right = NULL;
+	}
+
+	return node;
+}
+
+static void avl_concurrent_free_now(avl_concurrent_tree *ct, avl_tree_node *node)
+{
+	if (ct->use_slab)
+		avl_slab_free(&ct->slab, node);
+	else
+		ct->free_node(node);
+}
+
+// Wait until no lookup that might have seen the nodes in limbo is still
+// running, then free them.
+static void avl_concurrent_reclaim(avl_concurrent_tree *ct)
+{
+	uint64_t old = __atomic_fetch_add(&ct->epoch, 1, __ATOMIC_SEQ_CST);
+	uint64_t i;
+
+	for (i = 0 ; i < AVL_CONCURRENT_SLOTS ; ++i) {
+		while (__atomic_load_n(&ct->slots[i].readers[old & 1], __ATOMIC_SEQ_CST))
+			sched_yield();
+	}
+
+	for (i = 0 ; i < ct->limbo_count ; ++i)
+		avl_concurrent_free_now(ct, ct->limbo[i]);
+	ct->limbo_count = 0;
+}
+
+static void avl_concurrent_free_node(avl_tree_node *node)
+{
+	avl_concurrent_tree *ct = avl_concurrent_writer;
+
+	if (ct->limbo_count == ct->limbo_capacity) {
+		uint64_t capacity = ct->limbo_capacity ? ct->limbo_capacity * 2 : 16;
+		avl_tree_node **limbo = (avl_tree_node **)
+			realloc(ct->limbo, capacity * sizeof(avl_tree_node *));
+
+		if (!limbo) {
+			// no room to defer: wait for the lookups now
+			avl_concurrent_reclaim(ct);
+			avl_concurrent_free_now(ct, node);
+			return;
+		}
+
+		ct->limbo = limbo;
+		ct->limbo_capacity = capacity;
+	}
+
+	ct->limbo[ct->limbo_count++] = node;
+}
+
+void avl_concurrent_tree_init(avl_concurrent_tree *ct,
+			      avl_tree_node * (*allocate_node)(void *item),
+			      void (*free_node)(avl_tree_node * ),
+			      int64_t (*compare_items)(void * , void * ))
+{
+	int i;
+
+	avl_tree_init(&ct->tree,
+		      avl_concurrent_allocate_node,
+		      avl_concurrent_free_node,
+		      compare_items,
+		      NULL,
+		      NULL);
+	ct->tree.atomic_links = 1;
+	pthread_rwlock_init(&ct->lock, NULL);
+	ct->seq = 0;
+	ct->epoch = 0;
+	ct->allocate_node = allocate_node;
+	ct->free_node = free_node;
+	ct->use_slab = !allocate_node || !free_node;
+	avl_slab_init(&ct->slab);
+	ct->limbo = NULL;
+	ct->limbo_count = 0;
+	ct->limbo_capacity = 0;
+
+	for (i = 0 ; i < AVL_CONCURRENT_SLOTS ; ++i) {
+		ct->slots[i].readers[0] = 0;
+		ct->slots[i].readers[1] = 0;
+	}
+}
+
+void avl_concurrent_tree_destroy(avl_concurrent_tree *ct)
+{
+	uint64_t i;
+
+	for (i = 0 ; i < ct->limbo_count ; ++i)
+		avl_concurrent_free_now(ct, ct->limbo[i]);
+	free(ct->limbo);
+	ct->limbo = NULL;
+	ct->limbo_count = 0;
+	ct->limbo_capacity = 0;
+
+	if (ct->use_slab) {
+		avl_slab_destroy(&ct->slab);
+		ct->tree.root = NULL;
+		ct->tree.num_items = 0;
+	} else {
+		// nobody is looking: free the nodes directly
+		ct->tree.free_node = ct->free_node;
+		avl_tree_destroy(&ct->tree);
+		ct->tree.free_node = avl_concurrent_free_node;
+	}
+
+	pthread_rwlock_destroy(&ct->lock);
+}
+
+static void avl_concurrent_write_begin(avl_concurrent_tree *ct)
+{
+	pthread_rwlock_wrlock(&ct->lock);
+	avl_concurrent_writer = ct;
+	__atomic_store_n(&ct->seq, ct->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void avl_concurrent_write_end(avl_concurrent_tree *ct)
+{
+	__atomic_store_n(&ct->seq, ct->seq + 1, __ATOMIC_RELEASE);
+	if (ct->limbo_count >= AVL_CONCURRENT_LIMBO)
+		avl_concurrent_reclaim(ct);
+	avl_concurrent_writer = NULL;
+	pthread_rwlock_unlock(&ct->lock);
+}
+
+int avl_concurrent_tree_insert(avl_concurrent_tree *ct, void *item)
+{
+	int res;
+
+	avl_concurrent_write_begin(ct);
+	res = avl_tree_insert(&ct->tree, item);
+	avl_concurrent_write_end(ct);
+
+	return res;
+}
+
+int avl_concurrent_tree_remove(avl_concurrent_tree *ct, void *item)
+{
+	int res;
+
+	avl_concurrent_write_begin(ct);
+	res = avl_tree_remove(&ct->tree, item);
+	avl_concurrent_write_end(ct);
+
+	return res;
+}
+
+static avl_concurrent_slot * avl_concurrent_slot_of_thread(avl_concurrent_tree *ct)
+{
+	if (avl_concurrent_slot_index < 0)
+		avl_concurrent_slot_index =
+			__atomic_fetch_add(&avl_concurrent_next_slot, 1, __ATOMIC_RELAXED) %
+			AVL_CONCURRENT_SLOTS;
+	return &ct->slots[avl_concurrent_slot_index];
+}
+
+// Announce a lookup in the current epoch; returns the counter to drop
+// when it is over.
+static uint64_t * avl_concurrent_enter(avl_concurrent_tree *ct)
+{
+	avl_concurrent_slot *slot = avl_concurrent_slot_of_thread(ct);
+	uint64_t *readers;
+	uint64_t epoch;
+
+	for (;;) {
+		epoch = __atomic_load_n(&ct->epoch, __ATOMIC_SEQ_CST);
+		readers = &slot->readers[epoch & 1];
+		__atomic_fetch_add(readers, 1, __ATOMIC_SEQ_CST);
+		if (__atomic_load_n(&ct->epoch, __ATOMIC_SEQ_CST) == epoch)
+			return readers;
+		// a reclaim started in between; it may not have seen us
+		__atomic_fetch_sub(readers, 1, __ATOMIC_SEQ_CST);
+	}
+}
+
+static void avl_concurrent_leave(uint64_t *readers)
+{
+	__atomic_fetch_sub(readers, 1, __ATOMIC_RELEASE);
+}
+
+/*
+** One lock-free descent. Returns -1 if a writer was at work, in which case
+** the nodes that were read may have been in any state: the step limit
+** keeps a half-done rotation from sending the descent round in a circle.
+**
+** The descent runs alongside the writer by design; the sequence number
+** decides whether what it read is used. A link may be stale or mid-rotation, but
+** it always leads to a filled-in node (see avl_concurrent_allocate_node())
+** that epochs keep from being freed, so compare_items only ever sees real
+** items. Every link the writer changes is stored with release ordering and
+** loaded here with acquire ordering, so none of this is a data race.
+*/
+static int avl_concurrent_find_optimistic(avl_concurrent_tree *ct, void *item, void **found)
+{
+	avl_tree_node *node;
+	void *node_item = NULL;
+	uint64_t seq;
+	int64_t res = 1;
+	int steps;
+
+	seq = __atomic_load_n(&ct->seq, __ATOMIC_ACQUIRE);
+	if (seq & 1)
+		return -1;
+
+	node = __atomic_load_n(&ct->tree.root, __ATOMIC_ACQUIRE);
+
+	for (steps = 0 ; node && steps < AVL_TREE_MAX_HEIGHT ; ++steps) {
+		node_item = __atomic_load_n(&node->item, __ATOMIC_RELAXED);
+		res = ct->tree.compare_items(item, node_item);
+		if (!res)
+			break;
+		node = res < 0 ? __atomic_load_n(&node->left, __ATOMIC_ACQUIRE) :
+				 __atomic_load_n(&node->right, __ATOMIC_ACQUIRE);
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&ct->seq, __ATOMIC_RELAXED) != seq)
+		return -1;
+
+	if (!node)
+		return 0;
+
+	if (found)
+		*found = node_item;
+	return 1;
+}
+
+int avl_concurrent_tree_find(avl_concurrent_tree *ct, void *item, void **found)
+{
+	avl_tree_node *node;
+	uint64_t *readers;
+	int res = -1;
+	int i;
+
+	readers = avl_concurrent_enter(ct);
+	for (i = 0 ; i < AVL_CONCURRENT_RETRIES && res < 0 ; ++i)
+		res = avl_concurrent_find_optimistic(ct, item, found);
+	avl_concurrent_leave(readers);
+
+	if (res >= 0)
+		return res;
+
+	pthread_rwlock_rdlock(&ct->lock);
+	node = avl_tree_find(&ct->tree, item);
+	if (node && found)
+		*found = node->item;
+	pthread_rwlock_unlock(&ct->lock);
+
+	return node != NULL;
+}
+
+// A single word, read while a writer may be changing it.
+__attribute__((no_sanitize_thread))
+uint64_t avl_concurrent_tree_num_items(avl_concurrent_tree *ct)
+{
+	return __atomic_load_n(&ct->tree.num_items, __ATOMIC_RELAXED);
+}
+
+void avl_concurrent_tree_pre_order(avl_concurrent_tree *ct,
+				   void (*visitor)(avl_tree_node *node, void *context),
+				   void *context)
+{
+	pthread_rwlock_rdlock(&ct->lock);
+	avl_tree_pre_order(&ct->tree, visitor, context);
+	pthread_rwlock_unlock(&ct->lock);
+}
+
+void avl_concurrent_tree_in_order(avl_concurrent_tree *ct,
+				  void (*visitor)(avl_tree_node *node, void *context),
+				  void *context)
+{
+	pthread_rwlock_rdlock(&ct->lock);
+	avl_tree_in_order(&ct->tree, visitor, context);
+	pthread_rwlock_unlock(&ct->lock);
+}
+
+void avl_concurrent_tree_post_order(avl_concurrent_tree *ct,
+				    void (*visitor)(avl_tree_node *node, void *context),
+				    void *context)
+{
+	pthread_rwlock_rdlock(&ct->lock);
+	avl_tree_post_order(&ct->tree, visitor, context);
+	pthread_rwlock_unlock(&ct->lock);
+}
@@ -0,0 +1,110 @@
+/*
+** avl_concurrent.h : definitions for thread-safe AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#ifndef __AVL_CONCURRENT_H__
+#define __AVL_CONCURRENT_H__
+#include <stdint.h>
+#include <pthread.h>
+
+#include "avl.h"
+
+/*
+** An avl_tree that any number of threads may use at once.
+**
+** Lookups take no lock. A lookup notes the tree's sequence number, which
+** is odd while a writer is at work, descends, and succeeds only if the
+** sequence number has not changed in the meantime; after a few failed
+** attempts it takes the lock in read mode instead.
+**
+** A node that a lookup may still be looking at cannot be freed at once.
+** Removed nodes are kept until every lookup that started before the
+** removal has finished (epoch-based reclamation), and freed in groups.
+** Items therefore stay reachable for comparisons until free_node is
+** called on their node, which is the place to free an item if the tree
+** owns it.
+**
+** A lookup may compare against a node the moment it is linked in, so new
+** nodes are filled in before they are published. The writer stores every
+** link with release ordering and lookups follow links with acquire loads.
+** This holds on weakly ordered CPUs as well as on x86.
+**
+** Insertions and removals serialize on a reader-writer lock, taken in
+** write mode. Traversals take it in read mode, so they see a fixed tree
+** and may run alongside each other and alongside lookups.
+*/
+
+// Lookups are counted in slots, spread over threads, so that they do
+// not all contend for one cache line.
+#define AVL_CONCURRENT_SLOTS 64
+
+typedef struct _avl_concurrent_slot {
+	uint64_t readers[2]; // lookups in progress, by epoch parity
+	char pad[64 - 2 * sizeof(uint64_t)];
+} __attribute__((aligned(64))) avl_concurrent_slot;
+
+typedef struct _avl_concurrent_tree {
+	avl_tree tree;
+	pthread_rwlock_t lock;
+	uint64_t seq;
+	uint64_t epoch;
+	avl_tree_node * (*allocate_node)(void *item);
+	void (*free_node)(avl_tree_node * );
+	int use_slab;
+	avl_slab slab;
+	avl_tree_node **limbo; // removed, not yet freed
+	uint64_t limbo_count;
+	uint64_t limbo_capacity;
+	avl_concurrent_slot slots[AVL_CONCURRENT_SLOTS];
+} avl_concurrent_tree;
+
+// Pass NULL for both allocate_node and free_node to use a built-in slab;
+// if only one of them is NULL, the slab is used and the other is ignored.
+void avl_concurrent_tree_init(avl_concurrent_tree *ct,
+			      avl_tree_node * (*allocate_node)(void *item),
+			      void (*free_node)(avl_tree_node * ),
+			      int64_t (*compare_items)(void * , void * ));
+
+// No other thread may be using the tree.
+void avl_concurrent_tree_destroy(avl_concurrent_tree *ct);
+
+// 0 if insertion failed
+int avl_concurrent_tree_insert(avl_concurrent_tree *ct, void *item);
+
+// 0 if removal failed
+int avl_concurrent_tree_remove(avl_concurrent_tree *ct, void *item);
+
+// 0 if not found. Otherwise, the stored item equal to item is put in
+// *found, if found is not NULL.
+int avl_concurrent_tree_find(avl_concurrent_tree *ct, void *item, void **found);
+
+uint64_t avl_concurrent_tree_num_items(avl_concurrent_tree *ct);
+
+// The visitor must not insert into or remove from the tree.
+void avl_concurrent_tree_pre_order(avl_concurrent_tree *ct,
+				   void (*visitor)(avl_tree_node *node, void *context),
+				   void *context);
+
+void avl_concurrent_tree_in_order(avl_concurrent_tree *ct,
+				  void (*visitor)(avl_tree_node *node, void *context),
+				  void *context);
+
+void avl_concurrent_tree_post_order(avl_concurrent_tree *ct,
+				    void (*visitor)(avl_tree_node *node, void *context),
+				    void *context);
+
+#endif // __AVL_CONCURRENT_H__
@@ -0,0 +1,125 @@
+/*
+** avl_foreach.h : inline traversal of AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#ifndef __AVL_FOREACH_H__
+#define __AVL_FOREACH_H__
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "avl.h"
+
+/*
+** Loops over the nodes of a tree with the body compiled in place, where
+** avl_tree_in_order() and friends call a visitor through a pointer:
+**
+**	avl_tree_node *node;
+**	int64_t sum = 0;
+**
+**	AVL_FOREACH_IN_ORDER(&t, node)
+**		sum += (int64_t) node->item;
+**
+** node must be a plain identifier; it names the loop's hidden state.
+** The pending nodes are kept in an array of AVL_TREE_MAX_HEIGHT entries
+** on the stack. A node's children are read before the body runs, so the
+** body may free the node; otherwise the tree must not change during the
+** loop. break leaves the loop as usual.
+*/
+typedef struct _avl_tree_walk {
+	avl_tree_node *next; // where to go down from next, or NULL to pop
+	int depth;
+	avl_tree_node *path[AVL_TREE_MAX_HEIGHT];
+} avl_tree_walk;
+
+static inline avl_tree_walk * avl_tree_walk_begin(avl_tree_walk *w, avl_tree *t)
+{
+	w->next = t->root;
+	w->depth = 0;
+	return w;
+}
+
+static inline avl_tree_node * avl_tree_walk_pre_order(avl_tree_walk *w)
+{
+	avl_tree_node *node = w->next;
+
+	if (!node) {
+		if (!w->depth)
+			return NULL;
+		node = w->path[--w->depth];
+	}
+
+	// path holds right subtrees still to be walked
+	if (node->left) {
+		if (node->right)
+			w->path[w->depth++] = node->right;
+		w->next = node->left;
+	} else {
+		w->next = node->right;
+	}
+
+	return node;
+}
+
+static inline avl_tree_node * avl_tree_walk_in_order(avl_tree_walk *w)
+{
+	avl_tree_node *node = w->next;
+
+	while (node) {
+		w->path[w->depth++] = node;
+		node = node->left;
+	}
+
+	if (!w->depth)
+		return NULL;
+
+	node = w->path[--w->depth];
+	w->next = node->right;
+	return node;
+}
+
+static inline avl_tree_node * avl_tree_walk_post_order(avl_tree_walk *w)
+{
+	avl_tree_node *node = w->next;
+
+	// down to the first node in post order
+	while (node) {
+		w->path[w->depth++] = node;
+		node = node->left ? node->left : node->right;
+	}
+
+	if (!w->depth)
+		return NULL;
+
+	// after a left child comes its sibling's subtree, otherwise the parent
+	node = w->path[--w->depth];
+	w->next = NULL;
+	if (w->depth && w->path[w->depth - 1]->left == node)
+		w->next = w->path[w->depth - 1]->right;
+
+	return node;
+}
+
+#define AVL_FOREACH(__t, __node, __order)                                   \
+	for (avl_tree_walk __avl_walk_##__node,                             \
+	     *__avl_w_##__node = avl_tree_walk_begin(&__avl_walk_##__node, (__t)); \
+	     ((__node) = avl_tree_walk_##__order(__avl_w_##__node)) != NULL ; )
+
+#define AVL_FOREACH_PRE_ORDER(__t, __node)  AVL_FOREACH(__t, __node, pre_order)
+#define AVL_FOREACH_IN_ORDER(__t, __node)   AVL_FOREACH(__t, __node, in_order)
+#define AVL_FOREACH_POST_ORDER(__t, __node) AVL_FOREACH(__t, __node, post_order)
+
+#endif // __AVL_FOREACH_H__
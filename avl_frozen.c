@@ -0,0 +1,158 @@
+/*
+** avl_frozen.c : implementation of frozen AVL Tree snapshots
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "avl.h"
+#include "avl_frozen.h"
+
+// Items per cache line. Position k * AVL_FROZEN_PREFETCH_STRIDE starts the
+// line holding k's descendants three levels down.
+#define AVL_FROZEN_CACHE_LINE      64
+#define AVL_FROZEN_PREFETCH_STRIDE (AVL_FROZEN_CACHE_LINE / sizeof(void *))
+
+int avl_tree_freeze(avl_tree *t, avl_frozen *f)
+{
+	avl_tree_node *stack[AVL_TREE_MAX_HEIGHT];
+	avl_tree_node *node = t->root;
+	uint64_t pos;
+	void *items = NULL;
+	int depth = 0;
+
+	f->items = NULL;
+	f->num_items = t->num_items;
+	f->compare_items = t->compare_items;
+
+	// Align position 0, so that each run of AVL_FROZEN_PREFETCH_STRIDE
+	// siblings-of-siblings shares one cache line.
+	if (posix_memalign(&items, AVL_FROZEN_CACHE_LINE,
+			   (t->num_items + 1) * sizeof(void *)))
+		return 0;
+
+	f->items = (void **) items;
+	f->items[0] = NULL;
+
+	// Walk the tree and the Eytzinger positions in order, together.
+	pos = avl_frozen_first(f);
+
+	while (node || depth) {
+		while (node) {
+			stack[depth++] = node;
+			node = node->left;
+		}
+		node = stack[--depth];
+
+		f->items[pos] = node->item;
+		pos = avl_frozen_next(f, pos);
+
+		node = node->right;
+	}
+
+	return 1;
+}
+
+void avl_frozen_destroy(avl_frozen *f)
+{
+	free(f->items);
+	f->items = NULL;
+	f->num_items = 0;
+}
+
+uint64_t avl_frozen_lower_bound(avl_frozen *f, void *item)
+{
+	uint64_t n = f->num_items;
+	uint64_t k = 1;
+
+	while (k <= n) {
+		__builtin_prefetch(f->items + k * AVL_FROZEN_PREFETCH_STRIDE);
+		// go right when the item here is less than the one sought
+		k = 2 * k + (f->compare_items(f->items[k], item) < 0);
+	}
+
+	// Undo the trailing right turns, and the left turn before them:
+	// that left turn was taken at the answer.
+	k >>= __builtin_ffsll(~k);
+
+	return k;
+}
+
+uint64_t avl_frozen_find(avl_frozen *f, void *item)
+{
+	uint64_t pos = avl_frozen_lower_bound(f, item);
+
+	if (pos && !f->compare_items(item, f->items[pos]))
+		return pos;
+
+	return 0;
+}
+
+uint64_t avl_frozen_first(avl_frozen *f)
+{
+	uint64_t k = 1;
+
+	if (!f->num_items)
+		return 0;
+
+	while (2 * k <= f->num_items)
+		k = 2 * k;
+
+	return k;
+}
+
+uint64_t avl_frozen_last(avl_frozen *f)
+{
+	uint64_t k = 1;
+
+	if (!f->num_items)
+		return 0;
+
+	while (2 * k + 1 <= f->num_items)
+		k = 2 * k + 1;
+
+	return k;
+}
+
+uint64_t avl_frozen_next(avl_frozen *f, uint64_t pos)
+{
+	if (2 * pos + 1 <= f->num_items) {
+		// leftmost position of the right subtree
+		pos = 2 * pos + 1;
+		while (2 * pos <= f->num_items)
+			pos = 2 * pos;
+		return pos;
+	}
+
+	// climb while coming from a right child, then once more
+	while (pos & 1)
+		pos >>= 1;
+	return pos >> 1;
+}
+
+uint64_t avl_frozen_prev(avl_frozen *f, uint64_t pos)
+{
+	if (2 * pos <= f->num_items) {
+		// rightmost position of the left subtree
+		pos = 2 * pos;
+		while (2 * pos + 1 <= f->num_items)
+			pos = 2 * pos + 1;
+		return pos;
+	}
+
+	// climb while coming from a left child, then once more
+	while (pos && !(pos & 1))
+		pos >>= 1;
+	return pos >> 1;
+}
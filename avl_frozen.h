@@ -0,0 +1,128 @@
+/*
+** avl_frozen.h : definitions for frozen AVL Tree snapshots
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#ifndef __AVL_FROZEN_H__
+#define __AVL_FROZEN_H__
+#include <stdint.h>
+
+#include "avl.h"
+
+/*
+** A frozen snapshot is an immutable copy of a tree's items in one array,
+** laid out in Eytzinger (breadth-first) order: the children of position
+** k are at 2k and 2k+1, and position 1 is the root. A search walks down
+** the array without branching on the comparison and prefetches the cache
+** line holding the node's descendants several levels ahead.
+**
+** Positions run from 1 to num_items; position 0 means "none".
+** The snapshot does not reference the tree it was made from.
+*/
+typedef struct _avl_frozen {
+	void **items;
+	uint64_t num_items;
+	int64_t (*compare_items)(void * , void * );
+} avl_frozen;
+
+// 0 if out of memory
+int avl_tree_freeze(avl_tree *t, avl_frozen *f);
+
+void avl_frozen_destroy(avl_frozen *f);
+
+static inline void * avl_frozen_item(avl_frozen *f, uint64_t pos)
+{
+	return f->items[pos];
+}
+
+// Position of the item equal to item, 0 if not found.
+uint64_t avl_frozen_find(avl_frozen *f, void *item);
+
+// Position of the smallest item that is not less than item, 0 if none.
+uint64_t avl_frozen_lower_bound(avl_frozen *f, void *item);
+
+// In-order iteration; each returns 0 past the end.
+uint64_t avl_frozen_first(avl_frozen *f);
+uint64_t avl_frozen_last(avl_frozen *f);
+uint64_t avl_frozen_next(avl_frozen *f, uint64_t pos);
+uint64_t avl_frozen_prev(avl_frozen *f, uint64_t pos);
+
+/*
+** Frozen integer keys: a tree's items exported with an int64_t key each,
+** laid out as an implicit B-tree of AVL_FROZEN_KEYS_BLOCK keys per node
+** (one cache line). Node k's children are nodes k * (B + 1) + 1 through
+** k * (B + 1) + B + 1. A search compares the probe against a whole node at
+** once with SIMD, so it takes one step per node rather than per key.
+**
+** The SIMD code is picked at run time from what the CPU supports
+** (AVX2, SSE4.2 or plain C), so one build runs on any x86-64 machine.
+**
+** Slots index both keys and items; AVL_FROZEN_KEYS_NONE means "none".
+*/
+#define AVL_FROZEN_KEYS_BLOCK 8
+#define AVL_FROZEN_KEYS_NONE  UINT64_MAX
+
+typedef enum _avl_frozen_keys_isa {
+	AVL_FROZEN_KEYS_SCALAR = 0,
+	AVL_FROZEN_KEYS_SSE42,
+	AVL_FROZEN_KEYS_AVX2,
+	AVL_FROZEN_KEYS_BEST  // whatever this CPU supports best
+} avl_frozen_keys_isa;
+
+typedef struct _avl_frozen_keys {
+	int64_t *keys;      // num_blocks * AVL_FROZEN_KEYS_BLOCK, padded at the end
+	void **items;
+	uint64_t num_items;
+	uint64_t num_blocks;
+	uint64_t last;      // slot of the largest key
+	int32_t height;     // nodes on the longest root-to-leaf path
+	avl_frozen_keys_isa isa;
+} avl_frozen_keys;
+
+// key_of maps an item to its key; NULL when the items are the keys.
+// 0 if out of memory
+int avl_tree_freeze_keys(avl_tree *t, avl_frozen_keys *k,
+			 int64_t (*key_of)(void *item));
+
+void avl_frozen_keys_destroy(avl_frozen_keys *k);
+
+// Choose the search code. 0 if this CPU cannot run it.
+int avl_frozen_keys_use(avl_frozen_keys *k, avl_frozen_keys_isa isa);
+
+static inline int64_t avl_frozen_keys_key(avl_frozen_keys *k, uint64_t slot)
+{
+	return k->keys[slot];
+}
+
+static inline void * avl_frozen_keys_item(avl_frozen_keys *k, uint64_t slot)
+{
+	return k->items[slot];
+}
+
+// Slot of the smallest key not less than key.
+uint64_t avl_frozen_keys_lower_bound(avl_frozen_keys *k, int64_t key);
+
+// Slot of key.
+uint64_t avl_frozen_keys_find(avl_frozen_keys *k, int64_t key);
+
+// Looks up n keys, storing the slot of each (or AVL_FROZEN_KEYS_NONE) in
+// slots. The searches advance together, so that their cache misses overlap.
+void avl_frozen_keys_find_batch(avl_frozen_keys *k,
+				const int64_t *keys,
+				uint64_t n,
+				uint64_t *slots);
+
+#endif // __AVL_FROZEN_H__
@@ -0,0 +1,362 @@
+/*
+** avl_frozen_keys.c : implementation of frozen AVL Tree integer keys
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "avl.h"
+#include "avl_frozen.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define AVL_FROZEN_KEYS_X86 1
+#endif
+
+#define AVL_FROZEN_KEYS_CACHE_LINE 64
+
+// Searches that a batch lookup advances together.
+#define AVL_FROZEN_KEYS_GROUP 16
+
+static inline uint64_t avl_frozen_keys_child(uint64_t block, unsigned i)
+{
+	return block * (AVL_FROZEN_KEYS_BLOCK + 1) + i + 1;
+}
+
+/*
+// The rank of key within a block: how many of the block's keys are less
+// than it. That is also which child to descend to.
+*/
+static inline unsigned avl_frozen_keys_rank_scalar(const int64_t *block,
+						   int64_t key)
+{
+	unsigned rank = 0;
+	unsigned i;
+
+	for (i = 0 ; i < AVL_FROZEN_KEYS_BLOCK ; ++i)
+		rank += block[i] < key;
+
+	return rank;
+}
+
+#ifdef AVL_FROZEN_KEYS_X86
+static inline __attribute__((target("sse4.2,popcnt")))
+unsigned avl_frozen_keys_rank_sse42(const int64_t *block, int64_t key)
+{
+	const __m128i *b = (const __m128i *) block;
+	__m128i k = _mm_set1_epi64x(key);
+	unsigned mask;
+
+	mask = _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k, _mm_load_si128(b))));
+	mask |= _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k, _mm_load_si128(b + 1)))) << 2;
+	mask |= _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k, _mm_load_si128(b + 2)))) << 4;
+	mask |= _mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(k, _mm_load_si128(b + 3)))) << 6;
+
+	return __builtin_popcount(mask);
+}
+
+static inline __attribute__((target("avx2,popcnt")))
+unsigned avl_frozen_keys_rank_avx2(const int64_t *block, int64_t key)
+{
+	const __m256i *b = (const __m256i *) block;
+	__m256i k = _mm256_set1_epi64x(key);
+	unsigned mask;
+
+	mask = _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k, _mm256_load_si256(b))));
+	mask |= _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(k, _mm256_load_si256(b + 1)))) << 4;
+
+	return __builtin_popcount(mask);
+}
+#endif // AVL_FROZEN_KEYS_X86
+
+// The padding after the largest key holds INT64_MAX. A search that ends
+// on padding found nothing.
+static inline uint64_t avl_frozen_keys_real(avl_frozen_keys *k, uint64_t slot)
+{
+	if (slot == AVL_FROZEN_KEYS_NONE ||
+	    (k->keys[slot] == INT64_MAX && slot != k->last))
+		return AVL_FROZEN_KEYS_NONE;
+	return slot;
+}
+
+/*
+// The search loops, once per instruction set, so that each can inline
+// its own rank function.
+*/
+#define AVL_FROZEN_KEYS_SEARCH(__isa, __target)                               \
+static __target uint64_t                                                      \
+avl_frozen_keys_lower_bound_##__isa(avl_frozen_keys *k, int64_t key)         \
+{                                                                             \
+	uint64_t block = 0;                                                   \
+	uint64_t slot = AVL_FROZEN_KEYS_NONE;                                 \
+                                                                              \
+	while (block < k->num_blocks) {                                       \
+		unsigned rank = avl_frozen_keys_rank_##__isa(                 \
+			k->keys + block * AVL_FROZEN_KEYS_BLOCK, key);        \
+		if (rank < AVL_FROZEN_KEYS_BLOCK)                             \
+			slot = block * AVL_FROZEN_KEYS_BLOCK + rank;          \
+		block = avl_frozen_keys_child(block, rank);                   \
+	}                                                                     \
+                                                                              \
+	return avl_frozen_keys_real(k, slot);                                 \
+}                                                                             \
+                                                                              \
+static __target void                                                          \
+avl_frozen_keys_find_batch_##__isa(avl_frozen_keys *k,                        \
+				   const int64_t *keys,                       \
+				   uint64_t n,                                \
+				   uint64_t *slots)                           \
+{                                                                             \
+	uint64_t block[AVL_FROZEN_KEYS_GROUP];                                \
+	uint64_t slot[AVL_FROZEN_KEYS_GROUP];                                 \
+	uint64_t base;                                                        \
+                                                                              \
+	for (base = 0 ; base < n ; base += AVL_FROZEN_KEYS_GROUP) {           \
+		uint64_t m = n - base;                                        \
+		uint64_t j;                                                   \
+		int32_t level;                                                \
+                                                                              \
+		if (m > AVL_FROZEN_KEYS_GROUP)                                \
+			m = AVL_FROZEN_KEYS_GROUP;                            \
+                                                                              \
+		for (j = 0 ; j < m ; ++j) {                                   \
+			block[j] = 0;                                         \
+			slot[j] = AVL_FROZEN_KEYS_NONE;                       \
+		}                                                             \
+                                                                              \
+		/* one level of every search, then the next level */         \
+		for (level = 0 ; level < k->height ; ++level) {               \
+			for (j = 0 ; j < m ; ++j) {                           \
+				unsigned rank;                                \
+                                                                              \
+				if (block[j] >= k->num_blocks)                \
+					continue;                             \
+                                                                              \
+				rank = avl_frozen_keys_rank_##__isa(          \
+					k->keys + block[j] * AVL_FROZEN_KEYS_BLOCK, \
+					keys[base + j]);                      \
+				if (rank < AVL_FROZEN_KEYS_BLOCK)             \
+					slot[j] = block[j] * AVL_FROZEN_KEYS_BLOCK + rank; \
+				block[j] = avl_frozen_keys_child(block[j], rank); \
+				__builtin_prefetch(k->keys +                  \
+					block[j] * AVL_FROZEN_KEYS_BLOCK);    \
+			}                                                     \
+		}                                                             \
+                                                                              \
+		for (j = 0 ; j < m ; ++j) {                                   \
+			uint64_t s = avl_frozen_keys_real(k, slot[j]);        \
+			if (s != AVL_FROZEN_KEYS_NONE &&                      \
+			    k->keys[s] != keys[base + j])                     \
+				s = AVL_FROZEN_KEYS_NONE;                     \
+			slots[base + j] = s;                                  \
+		}                                                             \
+	}                                                                     \
+}
+
+AVL_FROZEN_KEYS_SEARCH(scalar, )
+#ifdef AVL_FROZEN_KEYS_X86
+AVL_FROZEN_KEYS_SEARCH(sse42, __attribute__((target("sse4.2,popcnt"))))
+AVL_FROZEN_KEYS_SEARCH(avx2, __attribute__((target("avx2,popcnt"))))
+#endif // AVL_FROZEN_KEYS_X86
+
+int avl_frozen_keys_use(avl_frozen_keys *k, avl_frozen_keys_isa isa)
+{
+#ifdef AVL_FROZEN_KEYS_X86
+	int has_sse42;
+	int has_avx2;
+
+	__builtin_cpu_init();
+	has_sse42 = __builtin_cpu_supports("sse4.2") &&
+		    __builtin_cpu_supports("popcnt");
+	has_avx2 = has_sse42 && __builtin_cpu_supports("avx2");
+
+	if (isa == AVL_FROZEN_KEYS_BEST)
+		isa = has_avx2 ? AVL_FROZEN_KEYS_AVX2 :
+		      has_sse42 ? AVL_FROZEN_KEYS_SSE42 : AVL_FROZEN_KEYS_SCALAR;
+
+	if ((isa == AVL_FROZEN_KEYS_SSE42 && !has_sse42) ||
+	    (isa == AVL_FROZEN_KEYS_AVX2 && !has_avx2))
+		return 0;
+#else
+	if (isa == AVL_FROZEN_KEYS_BEST)
+		isa = AVL_FROZEN_KEYS_SCALAR;
+
+	if (isa != AVL_FROZEN_KEYS_SCALAR)
+		return 0;
+#endif // AVL_FROZEN_KEYS_X86
+
+	k->isa = isa;
+	return 1;
+}
+
+typedef struct _avl_frozen_keys_cursor {
+	avl_tree_node *stack[AVL_TREE_MAX_HEIGHT];
+	avl_tree_node *node;
+	int depth;
+	int64_t (*key_of)(void *item);
+} avl_frozen_keys_cursor;
+
+// The tree's nodes, in order; NULL past the end.
+static avl_tree_node * avl_frozen_keys_next_node(avl_frozen_keys_cursor *c)
+{
+	avl_tree_node *node;
+
+	while (c->node) {
+		c->stack[c->depth++] = c->node;
+		c->node = c->node->left;
+	}
+
+	if (!c->depth)
+		return NULL;
+
+	node = c->stack[--c->depth];
+	c->node = node->right;
+
+	return node;
+}
+
+// Fill the subtree of blocks under block, in order.
+static void avl_frozen_keys_fill(avl_frozen_keys *k,
+				 avl_frozen_keys_cursor *c,
+				 uint64_t block)
+{
+	unsigned i;
+
+	if (block >= k->num_blocks)
+		return;
+
+	for (i = 0 ; i < AVL_FROZEN_KEYS_BLOCK ; ++i) {
+		uint64_t slot = block * AVL_FROZEN_KEYS_BLOCK + i;
+		avl_tree_node *node;
+
+		avl_frozen_keys_fill(k, c, avl_frozen_keys_child(block, i));
+
+		node = avl_frozen_keys_next_node(c);
+		if (node) {
+			k->keys[slot] = c->key_of ?
+				c->key_of(node->item) : (int64_t) node->item;
+			k->items[slot] = node->item;
+			k->last = slot;
+		} else {
+			k->keys[slot] = INT64_MAX;
+			k->items[slot] = NULL;
+		}
+	}
+
+	avl_frozen_keys_fill(k, c, avl_frozen_keys_child(block, AVL_FROZEN_KEYS_BLOCK));
+}
+
+int avl_tree_freeze_keys(avl_tree *t, avl_frozen_keys *k,
+			 int64_t (*key_of)(void *item))
+{
+	avl_frozen_keys_cursor c;
+	uint64_t num_slots;
+	uint64_t level_blocks;
+	uint64_t blocks;
+	void *keys = NULL;
+
+	k->num_items = t->num_items;
+	k->num_blocks = (t->num_items + AVL_FROZEN_KEYS_BLOCK - 1) /
+			AVL_FROZEN_KEYS_BLOCK;
+	k->last = AVL_FROZEN_KEYS_NONE;
+	k->keys = NULL;
+	k->items = NULL;
+
+	// levels of the implicit B-tree
+	k->height = 0;
+	for (blocks = 0, level_blocks = 1 ;
+	     blocks < k->num_blocks ;
+	     level_blocks *= AVL_FROZEN_KEYS_BLOCK + 1) {
+		blocks += level_blocks;
+		++k->height;
+	}
+
+	num_slots = k->num_blocks * AVL_FROZEN_KEYS_BLOCK;
+
+	if (posix_memalign(&keys, AVL_FROZEN_KEYS_CACHE_LINE,
+			   (num_slots ? num_slots : 1) * sizeof(int64_t)))
+		return 0;
+
+	k->keys = (int64_t *) keys;
+	k->items = (void **) malloc((num_slots ? num_slots : 1) * sizeof(void *));
+	if (!k->items) {
+		avl_frozen_keys_destroy(k);
+		return 0;
+	}
+
+	c.node = t->root;
+	c.depth = 0;
+	c.key_of = key_of;
+	avl_frozen_keys_fill(k, &c, 0);
+
+	avl_frozen_keys_use(k, AVL_FROZEN_KEYS_BEST);
+
+	return 1;
+}
+
+void avl_frozen_keys_destroy(avl_frozen_keys *k)
+{
+	free(k->keys);
+	free(k->items);
+	k->keys = NULL;
+	k->items = NULL;
+	k->num_items = 0;
+	k->num_blocks = 0;
+	k->last = AVL_FROZEN_KEYS_NONE;
+	k->height = 0;
+}
+
+uint64_t avl_frozen_keys_lower_bound(avl_frozen_keys *k, int64_t key)
+{
+	switch (k->isa) {
+#ifdef AVL_FROZEN_KEYS_X86
+	case AVL_FROZEN_KEYS_AVX2:
+		return avl_frozen_keys_lower_bound_avx2(k, key);
+	case AVL_FROZEN_KEYS_SSE42:
+		return avl_frozen_keys_lower_bound_sse42(k, key);
+#endif // AVL_FROZEN_KEYS_X86
+	default:
+		return avl_frozen_keys_lower_bound_scalar(k, key);
+	}
+}
+
+uint64_t avl_frozen_keys_find(avl_frozen_keys *k, int64_t key)
+{
+	uint64_t slot = avl_frozen_keys_lower_bound(k, key);
+
+	if (slot != AVL_FROZEN_KEYS_NONE && k->keys[slot] == key)
+		return slot;
+
+	return AVL_FROZEN_KEYS_NONE;
+}
+
+void avl_frozen_keys_find_batch(avl_frozen_keys *k,
+				const int64_t *keys,
+				uint64_t n,
+				uint64_t *slots)
+{
+	switch (k->isa) {
+#ifdef AVL_FROZEN_KEYS_X86
+	case AVL_FROZEN_KEYS_AVX2:
+		avl_frozen_keys_find_batch_avx2(k, keys, n, slots);
+		break;
+	case AVL_FROZEN_KEYS_SSE42:
+		avl_frozen_keys_find_batch_sse42(k, keys, n, slots);
+		break;
+#endif // AVL_FROZEN_KEYS_X86
+	default:
+		avl_frozen_keys_find_batch_scalar(k, keys, n, slots);
+		break;
+	}
+}
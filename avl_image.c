@@ -0,0 +1,677 @@
+/*
+** avl_image.c : on-disk images and sorted streams of AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "avl_image.h"
+#include "avl_util.h"
+
+#define AVL_IMAGE_BUFFER_SIZE (64 * 1024)
+
+// FNV-1a taken a 64-bit word at a time, with a shift after each multiply
+// so that a change in a high bit reaches the low ones too.
+#define AVL_IMAGE_CHECKSUM_SEED  0xcbf29ce484222325ULL
+#define AVL_IMAGE_CHECKSUM_PRIME 0x100000001b3ULL
+
+// size is a multiple of 8.
+static uint64_t avl_image_checksum(uint64_t h, const void *data, size_t size)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	uint64_t word;
+
+	for ( ; size ; size -= 8, p += 8) {
+		memcpy(&word, p, sizeof(word));
+		h = (h ^ word) * AVL_IMAGE_CHECKSUM_PRIME;
+		h ^= h >> 29;
+	}
+
+	return h;
+}
+
+static uint32_t avl_image_node_size(uint32_t key_size)
+{
+	return sizeof(avl_image_node) + ((key_size + 7) & ~7u);
+}
+
+// 0 if writing failed
+static int avl_image_write(int fd, const void *data, size_t size)
+{
+	const unsigned char *p = (const unsigned char *) data;
+	ssize_t res;
+
+	while (size) {
+		res = write(fd, p, size);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		p += res;
+		size -= res;
+	}
+
+	return 1;
+}
+
+static inline void avl_image_store_key(void (*store_key)(void *item, void *key),
+				       void *item, void *key)
+{
+	int64_t k;
+
+	if (store_key)
+		store_key(item, key);
+	else {
+		k = (int64_t) item;
+		memcpy(key, &k, sizeof(k));
+	}
+}
+
+typedef struct _avl_image_writer {
+	int fd;
+	uint32_t key_size;
+	uint32_t node_size;
+	void (*store_key)(void *item, void *key);
+	uint32_t next;  // number of the next child to be queued
+	unsigned char *buffer;
+	size_t used;
+	size_t capacity;
+	uint64_t checksum;
+	int failed;
+} avl_image_writer;
+
+static void avl_image_flush(avl_image_writer *w)
+{
+	if (!w->failed && w->used) {
+		w->checksum = avl_image_checksum(w->checksum, w->buffer, w->used);
+		if (!avl_image_write(w->fd, w->buffer, w->used))
+			w->failed = 1;
+	}
+	w->used = 0;
+}
+
+// Level order visits the children in the order it queues them, so a
+// node's children are the next two numbers not handed out yet.
+static void avl_image_write_node(avl_tree_node *node, void *context, int level)
+{
+	avl_image_writer *w = (avl_image_writer *) context;
+	avl_image_node *out;
+
+	if (w->failed)
+		return;
+
+	if (w->capacity - w->used < w->node_size)
+		avl_image_flush(w);
+
+	out = (avl_image_node *) (w->buffer + w->used);
+	memset(out, 0, w->node_size);
+
+	out->left = node->left ? w->next++ : AVL_IMAGE_NONE;
+	out->right = node->right ? w->next++ : AVL_IMAGE_NONE;
+
+	avl_image_store_key(w->store_key, node->item, out->key);
+
+	w->used += w->node_size;
+}
+
+int avl_tree_save(avl_tree *t, int fd, uint32_t key_size,
+		  void (*store_key)(void *item, void *key))
+{
+	avl_image_header header;
+	avl_image_writer w;
+
+	if (!key_size || key_size > AVL_IMAGE_MAX_KEY_SIZE)
+		return 0;
+	if (!store_key && key_size != sizeof(int64_t))
+		return 0;
+	if (t->num_items > AVL_IMAGE_MAX_NODES)
+		return 0;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, AVL_IMAGE_MAGIC, sizeof(header.magic));
+	header.version = AVL_IMAGE_VERSION;
+	header.byte_order = AVL_IMAGE_BYTE_ORDER;
+	header.key_size = key_size;
+	header.node_size = avl_image_node_size(key_size);
+	header.height = avl_tree_height(t);
+	header.num_nodes = t->num_items;
+
+	w.fd = fd;
+	w.key_size = key_size;
+	w.node_size = header.node_size;
+	w.store_key = store_key;
+	w.next = 2;
+	w.used = 0;
+	w.capacity = AVL_IMAGE_BUFFER_SIZE;
+	if (w.capacity < w.node_size)
+		w.capacity = w.node_size;
+	w.failed = 0;
+
+	w.buffer = (unsigned char *) malloc(w.capacity);
+	if (!w.buffer)
+		return 0;
+
+	w.checksum = avl_image_checksum(AVL_IMAGE_CHECKSUM_SEED,
+					&header, sizeof(header));
+	if (!avl_image_write(fd, &header, sizeof(header)))
+		w.failed = 1;
+
+	if (!w.failed && !avl_tree_level_order(t, avl_image_write_node, &w))
+		w.failed = 1;
+
+	avl_image_flush(&w);
+	free(w.buffer);
+
+	if (w.failed)
+		return 0;
+
+	return avl_image_write(fd, &w.checksum, sizeof(w.checksum));
+}
+
+static int avl_image_header_is_valid(const avl_image_header *header,
+				     size_t size)
+{
+	if (memcmp(header->magic, AVL_IMAGE_MAGIC, sizeof(header->magic)))
+		return 0;
+	if (header->version != AVL_IMAGE_VERSION ||
+	    header->byte_order != AVL_IMAGE_BYTE_ORDER)
+		return 0;
+	if (!header->key_size || header->key_size > AVL_IMAGE_MAX_KEY_SIZE ||
+	    header->node_size != avl_image_node_size(header->key_size))
+		return 0;
+	if (header->num_nodes > AVL_IMAGE_MAX_NODES ||
+	    header->height < 0 || header->height > AVL_TREE_MAX_HEIGHT ||
+	    !header->num_nodes != !header->height)
+		return 0;
+
+	return size == sizeof(avl_image_header) +
+		       header->num_nodes * header->node_size + sizeof(uint64_t);
+}
+
+int avl_tree_load_mmap(avl_image *img, const char *path,
+		       int64_t (*compare_keys)(const void * , const void * ),
+		       int verify)
+{
+	const avl_image_header *header;
+	struct stat st;
+	uint64_t checksum;
+	size_t size;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return 0;
+
+	if (fstat(fd, &st) ||
+	    st.st_size < (off_t) (sizeof(avl_image_header) + sizeof(uint64_t))) {
+		close(fd);
+		return 0;
+	}
+	size = st.st_size;
+
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return 0;
+
+	header = (const avl_image_header *) map;
+	if (!avl_image_header_is_valid(header, size) ||
+	    (!compare_keys && header->key_size != sizeof(int64_t)))
+		goto bad_image;
+
+	if (verify) {
+		memcpy(&checksum, (const unsigned char *) map + size - sizeof(checksum),
+		       sizeof(checksum));
+		if (checksum != avl_image_checksum(AVL_IMAGE_CHECKSUM_SEED, map,
+						   size - sizeof(checksum)))
+			goto bad_image;
+	}
+
+	img->map = map;
+	img->map_size = size;
+	img->nodes = (const unsigned char *) map + sizeof(avl_image_header);
+	img->num_nodes = header->num_nodes;
+	img->key_size = header->key_size;
+	img->node_size = header->node_size;
+	img->height = header->height;
+	img->compare_keys = compare_keys;
+	return 1;
+
+bad_image:
+	munmap(map, size);
+	return 0;
+}
+
+void avl_image_close(avl_image *img)
+{
+	if (img->map)
+		munmap(img->map, img->map_size);
+	img->map = NULL;
+	img->map_size = 0;
+	img->nodes = NULL;
+	img->num_nodes = 0;
+	img->height = 0;
+}
+
+static inline int64_t avl_image_compare(avl_image *img,
+					const void *a, const void *b)
+{
+	int64_t ia;
+	int64_t ib;
+
+	if (img->compare_keys)
+		return img->compare_keys(a, b);
+
+	memcpy(&ia, a, sizeof(ia));
+	memcpy(&ib, b, sizeof(ib));
+	return (ia > ib) - (ia < ib);
+}
+
+// Every walk below takes at most height steps down and checks each node
+// number before using it, so a damaged image cannot send it outside the
+// mapping or around a cycle.
+const void * avl_image_find(avl_image *img, const void *key)
+{
+	const avl_image_node *node;
+	uint64_t n = img->num_nodes ? 1 : AVL_IMAGE_NONE;
+	int32_t steps = img->height;
+	int64_t res;
+
+	while (n != AVL_IMAGE_NONE && n <= img->num_nodes && steps-- > 0) {
+		node = avl_image_node_at(img, n);
+		res = avl_image_compare(img, key, node->key);
+		if (res < 0)
+			n = node->left;
+		else if (res > 0)
+			n = node->right;
+		else
+			return node->key;
+	}
+
+	return NULL;
+}
+
+const void * avl_image_iter_key(avl_image_iter *it)
+{
+	if (!it->depth)
+		return NULL;
+	return avl_image_node_at(it->img, it->path[it->depth - 1])->key;
+}
+
+// Pushes n and its left descendants.
+static const void * avl_image_iter_push_left(avl_image_iter *it, uint64_t n)
+{
+	avl_image *img = it->img;
+
+	while (n != AVL_IMAGE_NONE) {
+		if (n > img->num_nodes || it->depth == img->height) {
+			it->depth = 0;
+			return NULL;
+		}
+		it->path[it->depth++] = (uint32_t) n;
+		n = avl_image_node_at(img, n)->left;
+	}
+
+	return avl_image_iter_key(it);
+}
+
+const void * avl_image_iter_first(avl_image_iter *it, avl_image *img)
+{
+	it->img = img;
+	it->remaining = img->num_nodes;
+	it->depth = 0;
+	return avl_image_iter_push_left(it, img->num_nodes ? 1 : AVL_IMAGE_NONE);
+}
+
+const void * avl_image_iter_seek_lower_bound(avl_image_iter *it,
+					     avl_image *img,
+					     const void *key)
+{
+	const avl_image_node *node;
+	uint64_t n = img->num_nodes ? 1 : AVL_IMAGE_NONE;
+	int32_t steps = img->height;
+	int64_t res;
+
+	it->img = img;
+	it->remaining = img->num_nodes;
+	it->depth = 0;
+
+	while (n != AVL_IMAGE_NONE && n <= img->num_nodes && steps-- > 0) {
+		node = avl_image_node_at(img, n);
+		res = avl_image_compare(img, key, node->key);
+		if (res > 0) {
+			n = node->right;
+			continue;
+		}
+		it->path[it->depth++] = (uint32_t) n;
+		if (!res)
+			break;
+		n = node->left;
+	}
+
+	return avl_image_iter_key(it);
+}
+
+const void * avl_image_iter_next(avl_image_iter *it)
+{
+	uint64_t n;
+
+	if (!it->depth)
+		return NULL;
+
+	if (!--it->remaining) {
+		it->depth = 0;
+		return NULL;
+	}
+
+	n = it->path[--it->depth];
+	return avl_image_iter_push_left(it, avl_image_node_at(it->img, n)->right);
+}
+
+// Keys in a full batch of a stream; one at least, however large.
+static uint64_t avl_stream_batch_keys(uint32_t key_size)
+{
+	uint64_t n = AVL_STREAM_BATCH_SIZE / key_size;
+	return n ? n : 1;
+}
+
+static uint32_t avl_stream_batch_bytes(uint32_t key_size, uint64_t num_keys)
+{
+	return (num_keys * key_size + 7) & ~7ull;
+}
+
+int avl_tree_iter_export(avl_tree_iter *it, uint64_t n, int fd,
+			 uint32_t key_size,
+			 void (*store_key)(void *item, void *key))
+{
+	avl_stream_header header;
+	avl_stream_batch *batch;
+	avl_tree_node *node = avl_tree_iter_node(it);
+	unsigned char *buffer;
+	unsigned char *key;
+	uint64_t batch_keys;
+	uint64_t checksum;
+	uint64_t i;
+	int ok = 1;
+
+	if (!key_size || key_size > AVL_IMAGE_MAX_KEY_SIZE)
+		return 0;
+	if (!store_key && key_size != sizeof(int64_t))
+		return 0;
+
+	batch_keys = avl_stream_batch_keys(key_size);
+	buffer = (unsigned char *) malloc(sizeof(avl_stream_batch) +
+					  avl_stream_batch_bytes(key_size, batch_keys));
+	if (!buffer)
+		return 0;
+	batch = (avl_stream_batch *) buffer;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, AVL_STREAM_MAGIC, sizeof(header.magic));
+	header.version = AVL_STREAM_VERSION;
+	header.byte_order = AVL_IMAGE_BYTE_ORDER;
+	header.key_size = key_size;
+	header.num_items = n;
+
+	checksum = avl_image_checksum(AVL_IMAGE_CHECKSUM_SEED,
+				      &header, sizeof(header));
+	ok = avl_image_write(fd, &header, sizeof(header));
+
+	// The last pass writes the empty batch that ends the stream.
+	do {
+		batch->num_keys = n < batch_keys ? n : batch_keys;
+		batch->size = avl_stream_batch_bytes(key_size, batch->num_keys);
+		memset(buffer + sizeof(avl_stream_batch), 0, batch->size);
+
+		key = buffer + sizeof(avl_stream_batch);
+		for (i = 0 ; ok && i < batch->num_keys ; ++i, key += key_size) {
+			if (!node)
+				ok = 0;
+			else {
+				avl_image_store_key(store_key, node->item, key);
+				node = avl_tree_iter_next(it);
+			}
+		}
+
+		if (ok) {
+			checksum = avl_image_checksum(checksum, buffer,
+						      sizeof(avl_stream_batch) + batch->size);
+			ok = avl_image_write(fd, buffer,
+					     sizeof(avl_stream_batch) + batch->size);
+		}
+
+		n -= batch->num_keys;
+	} while (ok && batch->num_keys);
+
+	free(buffer);
+
+	return ok && avl_image_write(fd, &checksum, sizeof(checksum));
+}
+
+int avl_tree_export(avl_tree *t, int fd, uint32_t key_size,
+		    void (*store_key)(void *item, void *key))
+{
+	avl_tree_iter it;
+
+	avl_tree_iter_init(&it, t);
+	avl_tree_iter_first(&it);
+	return avl_tree_iter_export(&it, t->num_items, fd, key_size, store_key);
+}
+
+// 0 if reading failed or the stream ended first
+static int avl_image_read(int fd, void *data, size_t size)
+{
+	unsigned char *p = (unsigned char *) data;
+	ssize_t res;
+
+	while (size) {
+		res = read(fd, p, size);
+		if (res < 0) {
+			if (errno == EINTR)
+				continue;
+			return 0;
+		}
+		if (!res)
+			return 0;
+		p += res;
+		size -= res;
+	}
+
+	return 1;
+}
+
+typedef struct _avl_stream_reader {
+	avl_tree *t;
+	int fd;
+	uint32_t key_size;
+	uint64_t batch_keys;
+	void * (*load_item)(const void *key);
+	void (*free_item)(void *item);
+	unsigned char *buffer;
+	const unsigned char *next;  // next key of the batch in buffer
+	uint64_t keys_left;         // in the batch
+	void *prev;                 // the last item read
+	int have_prev;
+	uint64_t checksum;
+	int failed;
+} avl_stream_reader;
+
+// 0 if reading failed or the batch is damaged
+static int avl_stream_read_batch(avl_stream_reader *r, avl_stream_batch *batch)
+{
+	if (!avl_image_read(r->fd, batch, sizeof(*batch)))
+		return 0;
+	if (batch->num_keys > r->batch_keys ||
+	    batch->size != avl_stream_batch_bytes(r->key_size, batch->num_keys))
+		return 0;
+
+	r->checksum = avl_image_checksum(r->checksum, batch, sizeof(*batch));
+	if (!avl_image_read(r->fd, r->buffer, batch->size))
+		return 0;
+	r->checksum = avl_image_checksum(r->checksum, r->buffer, batch->size);
+
+	r->next = r->buffer;
+	r->keys_left = batch->num_keys;
+	return 1;
+}
+
+// 0 if there is no next item
+static int avl_stream_next_item(avl_stream_reader *r, void **item)
+{
+	avl_stream_batch batch;
+	int64_t k;
+
+	if (!r->keys_left &&
+	    (!avl_stream_read_batch(r, &batch) || !batch.num_keys))
+		return 0;
+
+	if (r->load_item) {
+		*item = r->load_item(r->next);
+		if (!*item)
+			return 0;
+	} else {
+		memcpy(&k, r->next, sizeof(k));
+		*item = (void *) k;
+	}
+	r->next += r->key_size;
+	--r->keys_left;
+
+	if (r->have_prev && r->t->compare_items(r->prev, *item) >= 0) {
+		if (r->free_item)
+			r->free_item(*item);
+		return 0;
+	}
+	r->prev = *item;
+	r->have_prev = 1;
+	return 1;
+}
+
+// Build the subtree of the next n items, rooted at the middle one, reading
+// the items in order as they are needed. NULL if n == 0 or on failure.
+static avl_tree_node * avl_stream_build_node(avl_stream_reader *r, uint64_t n)
+{
+	avl_tree_node *left;
+	avl_tree_node *right = NULL;
+	avl_tree_node *node = NULL;
+	uint64_t mid;
+	void *item;
+
+	if (!n || r->failed)
+		return NULL;
+
+	mid = n / 2;
+	left = avl_stream_build_node(r, mid);
+
+	if (!r->failed) {
+		if (!avl_stream_next_item(r, &item))
+			r->failed = 1;
+		else if (!(node = avl_tree_alloc_node(r->t, item))) {
+			if (r->free_item)
+				r->free_item(item);
+			r->failed = 1;
+		}
+	}
+
+	if (!r->failed)
+		right = avl_stream_build_node(r, n - mid - 1);
+
+	if (r->failed) {
+		avl_tree_release_subtree(r->t, left, r->free_item);
+		avl_tree_release_subtree(r->t, right, r->free_item);
+		if (node) {
+			node->left = NULL;
+			node->right = NULL;
+			avl_tree_release_subtree(r->t, node, r->free_item);
+		}
+		return NULL;
+	}
+
+	node->left = left;
+	node->right = right;
+	avl_tree_update_node(r->t, node);
+	return node;
+}
+
+int avl_tree_import(avl_tree *t, int fd,
+		    void * (*load_item)(const void *key),
+		    void (*free_item)(void *item))
+{
+	avl_stream_header header;
+	avl_stream_batch batch;
+	avl_stream_reader r;
+	avl_tree_node *root;
+	uint64_t checksum;
+
+	if (t->root)
+		return 0;
+
+	if (!avl_image_read(fd, &header, sizeof(header)))
+		return 0;
+	if (memcmp(header.magic, AVL_STREAM_MAGIC, sizeof(header.magic)) ||
+	    header.version != AVL_STREAM_VERSION ||
+	    header.byte_order != AVL_IMAGE_BYTE_ORDER)
+		return 0;
+	if (!header.key_size || header.key_size > AVL_IMAGE_MAX_KEY_SIZE ||
+	    (!load_item && header.key_size != sizeof(int64_t)))
+		return 0;
+
+	r.t = t;
+	r.fd = fd;
+	r.key_size = header.key_size;
+	r.batch_keys = avl_stream_batch_keys(header.key_size);
+	r.load_item = load_item;
+	r.free_item = free_item;
+	r.next = NULL;
+	r.keys_left = 0;
+	r.prev = NULL;
+	r.have_prev = 0;
+	r.checksum = avl_image_checksum(AVL_IMAGE_CHECKSUM_SEED,
+					&header, sizeof(header));
+	r.failed = 0;
+
+	r.buffer = (unsigned char *) malloc(avl_stream_batch_bytes(r.key_size,
+								   r.batch_keys));
+	if (!r.buffer)
+		return 0;
+
+	root = avl_stream_build_node(&r, header.num_items);
+
+	// every key used, then the empty batch and a matching checksum
+	if (!r.failed &&
+	    (r.keys_left ||
+	     !avl_stream_read_batch(&r, &batch) || batch.num_keys ||
+	     !avl_image_read(fd, &checksum, sizeof(checksum)) ||
+	     checksum != r.checksum))
+		r.failed = 1;
+
+	free(r.buffer);
+
+	if (r.failed) {
+		avl_tree_release_subtree(t, root, free_item);
+		return 0;
+	}
+
+	t->root = root;
+	t->num_items = header.num_items;
+	return 1;
+}
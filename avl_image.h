@@ -0,0 +1,185 @@
+/*
+** avl_image.h : on-disk images and sorted streams of AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#ifndef __AVL_IMAGE_H__
+#define __AVL_IMAGE_H__
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "avl.h"
+
+/*
+** An image is a tree written to a file so that it can be searched in
+** place once mapped: avl_tree_load_mmap() checks the header and hands
+** out pointers into the mapping, with no per-node allocation and nothing
+** to decode. Pages are read from the page cache as the searches touch
+** them.
+**
+** The file is a header, the nodes, and a 64-bit checksum of everything
+** before it. Each node is its two child links followed by a fixed-size
+** key, padded to a multiple of 8 bytes. Nodes are numbered from 1 in
+** level order, so the top of the tree shares the first pages; a link is
+** a node number, and 0 means "none". Nothing in the file is an address,
+** so it can be mapped anywhere. Integers are in the byte order of the
+** machine that wrote the image, which a reader of the other order
+** rejects.
+*/
+#define AVL_IMAGE_MAGIC        "AVLIMAGE"
+#define AVL_IMAGE_VERSION      1
+#define AVL_IMAGE_BYTE_ORDER   0x01020304u
+#define AVL_IMAGE_NONE         0
+#define AVL_IMAGE_MAX_NODES    0xfffffffeu
+#define AVL_IMAGE_MAX_KEY_SIZE 65536
+
+typedef struct _avl_image_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;
+	uint32_t key_size;
+	uint32_t node_size;  // 8 + key_size rounded up to a multiple of 8
+	int32_t height;
+	uint32_t reserved;
+	uint64_t num_nodes;
+} avl_image_header;
+
+typedef struct _avl_image_node {
+	uint32_t left;
+	uint32_t right;
+	unsigned char key[];
+} avl_image_node;
+
+typedef struct _avl_image {
+	void *map;
+	size_t map_size;
+	const unsigned char *nodes;
+	uint64_t num_nodes;
+	uint32_t key_size;
+	uint32_t node_size;
+	int32_t height;
+	int64_t (*compare_keys)(const void * , const void * );
+} avl_image;
+
+// Writes t to fd as an image. store_key(item, key) writes the key_size
+// bytes of item's key to key; NULL stores each item itself as an
+// int64_t, with key_size 8. Nothing is written past what fd accepts in
+// order, so fd may be a pipe.
+// 0 if writing failed, if t has more than AVL_IMAGE_MAX_NODES items or if
+// key_size is 0 or more than AVL_IMAGE_MAX_KEY_SIZE.
+int avl_tree_save(avl_tree *t, int fd, uint32_t key_size,
+		  void (*store_key)(void *item, void *key));
+
+// Maps the image at path read-only. compare_keys orders two keys; NULL
+// when the keys are int64_t. With verify set, the checksum is checked,
+// which reads the whole file once; otherwise only the header is, and a
+// damaged image gives wrong answers but never a read outside the mapping.
+// 0 if the file cannot be mapped or is not an image this code can read.
+int avl_tree_load_mmap(avl_image *img, const char *path,
+		       int64_t (*compare_keys)(const void * , const void * ),
+		       int verify);
+
+// Unmaps the image; its keys are gone afterwards.
+void avl_image_close(avl_image *img);
+
+static inline uint64_t avl_image_num_items(avl_image *img)
+{
+	return img->num_nodes;
+}
+
+static inline const avl_image_node * avl_image_node_at(avl_image *img,
+						      uint64_t n)
+{
+	return (const avl_image_node *) (img->nodes + (n - 1) * img->node_size);
+}
+
+// NULL if not found
+const void * avl_image_find(avl_image *img, const void *key);
+
+/*
+** In-order iteration over an image. The iterator holds the node numbers
+** still to be visited on the way back up, so it needs no links to parents.
+*/
+typedef struct _avl_image_iter {
+	avl_image *img;
+	uint64_t remaining;  // bounds the walk over a damaged image
+	int depth;
+	uint32_t path[AVL_TREE_MAX_HEIGHT];
+} avl_image_iter;
+
+// Each returns the key at the new position, NULL past the end.
+const void * avl_image_iter_first(avl_image_iter *it, avl_image *img);
+
+// The smallest key not less than key.
+const void * avl_image_iter_seek_lower_bound(avl_image_iter *it,
+					     avl_image *img,
+					     const void *key);
+
+const void * avl_image_iter_next(avl_image_iter *it);
+
+// NULL if past the end
+const void * avl_image_iter_key(avl_image_iter *it);
+
+/*
+** A stream is a tree's keys in order, written in batches so that neither
+** the writer nor the reader holds more than one batch at a time: a
+** header, then batches of at most AVL_STREAM_BATCH_SIZE bytes of keys,
+** each led by its number of keys and of bytes, then an empty batch and a
+** 64-bit checksum of everything before it. Unlike an image, a stream has
+** no links, so it can be read from a pipe and the reader builds a
+** perfectly balanced tree of its own in O(n), with no rebalancing.
+*/
+#define AVL_STREAM_MAGIC      "AVLSTRM"
+#define AVL_STREAM_VERSION    1
+#define AVL_STREAM_BATCH_SIZE (64 * 1024)
+
+typedef struct _avl_stream_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t byte_order;  // AVL_IMAGE_BYTE_ORDER as written
+	uint32_t key_size;
+	uint32_t reserved;
+	uint64_t num_items;
+} avl_stream_header;
+
+typedef struct _avl_stream_batch {
+	uint32_t num_keys;
+	uint32_t size;  // bytes of keys that follow, padded to a multiple of 8
+} avl_stream_batch;
+
+// Writes the n items from it's position on to fd as a stream, leaving it
+// past the last of them. Keys are stored as by avl_tree_save().
+// 0 if fewer than n items follow, if writing failed or if key_size is 0
+// or more than AVL_IMAGE_MAX_KEY_SIZE.
+int avl_tree_iter_export(avl_tree_iter *it, uint64_t n, int fd,
+			 uint32_t key_size,
+			 void (*store_key)(void *item, void *key));
+
+// Writes all of t to fd as a stream.
+int avl_tree_export(avl_tree *t, int fd, uint32_t key_size,
+		    void (*store_key)(void *item, void *key));
+
+// Reads a stream from fd into t, which must be empty. load_item(key)
+// makes the item for a key, NULL if out of memory; NULL when the items
+// are the keys, as int64_t. The items must come in increasing order.
+// 0 if t is not empty, if reading failed, if the stream is damaged or out
+// of order, or if out of memory; t is then left empty, and every item
+// load_item made is handed to free_item, unless that is NULL.
+int avl_tree_import(avl_tree *t, int fd,
+		    void * (*load_item)(const void *key),
+		    void (*free_item)(void *item));
+
+#endif // __AVL_IMAGE_H__
@@ -19,128 +19,148 @@
 #include "avl.h"
 #include "avl_util.h"
 
-static avl_tree_node * avl_tree_insert_node(avl_tree *t,
-					    void *item,
-					    avl_tree_node *node,
-					    int *inserted)
+int avl_tree_insert(avl_tree *t, void *item)
 {
-	int64_t res;
+	avl_tree_node **path[AVL_TREE_MAX_HEIGHT];
+	int8_t dir[AVL_TREE_MAX_HEIGHT];
+	avl_tree_node **link;
+	avl_tree_node *node;
+	int32_t height;
 	int32_t balance;
+	int64_t res;
+	int depth = 0;
 
-	if (!node) {
-		node = t->allocate_node(item);
-		if (node) {
-			*inserted = 1;
-			node->height = 1;
-		}
-		return node;
-	}
+	// Descend, remembering each link that was followed and its direction.
+	link = &t->root;
 
-	res = t->compare_items(item, node->item);
-
-	if (res < 0)
-		node->left = avl_tree_insert_node(t, item, node->left, inserted);
-	else if (res > 0)
-		node->right = avl_tree_insert_node(t, item, node->right, inserted);
-	else // item collision - new item not inserted
-		return node;
-
-	node->height = 1 + avl_tree_max(avl_tree_height_node(node->left),
-					avl_tree_height_node(node->right));
-
-	balance = avl_tree_balance_node(node);
-
-	/*
-	// Left Left Case
-	// - node == z.
-	// - item was inserted under x.
-	// - fix by rotating z right.
-	//
-	//        z                y
-	//       / \             /   \
-	//      y  T4           x     z
-	//     / \             / \   / \
-	//    x   T3          T1 T2 T3 T4
-	//   / \
-	// T1   T2
-	*/
-	if (balance > 1) {
-		res = t->compare_items(item, node->left->item);
-		if (res < 0)
-			return avl_tree_ror_node(node);
-	}
+	while (*link) {
+		node = *link;
 
-	/*
-	// Right Right Case
-	// - node == z.
-	// - item was inserted under x.
-	// - fix by rotating z left.
-	//
-	//    z                    y
-	//   / \                 /   \
-	// T1   y               z     x
-	//     / \             / \   / \
-	//   T2   x           T1 T2 T3 T4
-	//       / \
-	//     T3   T4
-	*/
-	if (balance < -1) {
-		res = t->compare_items(item, node->right->item);
-		if (res > 0)
-			return avl_tree_rol_node(node);
+		res = t->compare_items(item, node->item);
+
+		if (!res) // item collision - new item not inserted
+			return 0;
+
+		path[depth] = link;
+		dir[depth] = res < 0 ? -1 : 1;
+		++depth;
+
+		link = res < 0 ? &node->left : &node->right;
 	}
 
-	/*
-	// Left Right Case
-	// - node == z.
-	// - item was inserted under x.
-	// - fix by rotating y left, then z right.
-	//
-	//     z            z            x
-	//    / \          / \         /   \
-	//   y  T4        x  T4       y     z
-	//  / \          / \         / \   / \
-	// T1  x        y  T3       T1 T2 T3 T4
-	//    / \      / \
-	//   T2 T3    T1 T2
-	//
-	*/
-	if (balance > 1) {
-		res = t->compare_items(item, node->left->item);
-		if (res > 0) {
-			node->left = avl_tree_rol_node(node->left);
-			return avl_tree_ror_node(node);
+	node = avl_tree_alloc_node(t, item);
+	if (!node)
+		return 0;
+
+	node->left = NULL;
+	node->right = NULL;
+	node->height = 1;
+
+	avl_tree_set_link(t, link, node);
+	++t->num_items;
+
+	if (t->augment)
+		t->augment(node);
+
+	// Retrace toward the root. Once a subtree's height is unchanged
+	// (or a rotation has restored it), no ancestor can be out of balance.
+	while (depth > 0) {
+		--depth;
+		link = path[depth];
+		node = *link;
+
+		height = node->height;
+		avl_tree_update_node(t, node);
+
+		balance = avl_tree_balance_node(node);
+
+		/*
+		// Left Left Case
+		// - node == z.
+		// - item was inserted under x.
+		// - fix by rotating z right.
+		//
+		//        z                y
+		//       / \             /   \
+		//      y  T4           x     z
+		//     / \             / \   / \
+		//    x   T3          T1 T2 T3 T4
+		//   / \
+		// T1   T2
+		//
+		// Left Right Case
+		// - node == z.
+		// - item was inserted under x.
+		// - fix by rotating y left, then z right.
+		//
+		//     z            z            x
+		//    / \          / \         /   \
+		//   y  T4        x  T4       y     z
+		//  / \          / \         / \   / \
+		// T1  x        y  T3       T1 T2 T3 T4
+		//    / \      / \
+		//   T2 T3    T1 T2
+		*/
+		if (balance > 1) {
+			if (dir[depth + 1] > 0)
+				avl_tree_set_link(t, &node->left,
+						  avl_tree_rol_node(t, node->left));
+			avl_tree_set_link(t, link, avl_tree_ror_node(t, node));
+			break;
 		}
-	}
 
-	/*
-	// Right Left Case
-	// - node == z.
-	// - item was inserted under x.
-	// - fix by rotating y right, then z left.
-	//
-	//     z           z              x
-	//    / \         / \           /   \
-	//  T1   y      T1   x         z     y
-	//      / \         / \       / \   / \
-	//     x   T4     T2   y     T1 T2 T3 T4
-	//    / \             / \
-	//   T2 T3           T3 T4
-	*/
-	if (balance < -1) {
-		res = t->compare_items(item, node->right->item);
-		if (res < 0) {
-			node->right = avl_tree_ror_node(node->right);
-			return avl_tree_rol_node(node);
+		/*
+		// Right Right Case
+		// - node == z.
+		// - item was inserted under x.
+		// - fix by rotating z left.
+		//
+		//    z                    y
+		//   / \                 /   \
+		// T1   y               z     x
+		//     / \             / \   / \
+		//   T2   x           T1 T2 T3 T4
+		//       / \
+		//     T3   T4
+		//
+		// Right Left Case
+		// - node == z.
+		// - item was inserted under x.
+		// - fix by rotating y right, then z left.
+		//
+		//     z           z              x
+		//    / \         / \           /   \
+		//  T1   y      T1   x         z     y
+		//      / \         / \       / \   / \
+		//     x   T4     T2   y     T1 T2 T3 T4
+		//    / \             / \
+		//   T2 T3           T3 T4
+		*/
+		if (balance < -1) {
+			if (dir[depth + 1] < 0)
+				avl_tree_set_link(t, &node->right,
+						  avl_tree_ror_node(t, node->right));
+			avl_tree_set_link(t, link, avl_tree_rol_node(t, node));
+			break;
 		}
+
+		if (node->height == height)
+			break;
 	}
 
-	return node; // no change
-}
+	// The remaining ancestors keep their heights, but their
+	// subtrees have grown by one.
+	if (t->augment) {
+		while (depth > 0) {
+			--depth;
+			avl_tree_update_node(t, *path[depth]);
+		}
+	} else if (t->order_statistics) {
+		while (depth > 0) {
+			--depth;
+			++avl_tree_counted(*path[depth])->size;
+		}
+	}
 
-int avl_tree_insert(avl_tree *t, void *item)
-{
-	int inserted = 0;
-	t->root = avl_tree_insert_node(t, item, t->root, &inserted);
-	return inserted;
+	return 1;
 }
@@ -0,0 +1,122 @@
+/*
+** avl_interval.c : interval trees built on augmented AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "avl.h"
+#include "avl_interval.h"
+
+static inline avl_interval * avl_interval_of(avl_tree_node *node)
+{
+	return (avl_interval *) node->item;
+}
+
+int64_t avl_interval_compare(void *a, void *b)
+{
+	avl_interval *ia = (avl_interval *) a;
+	avl_interval *ib = (avl_interval *) b;
+
+	if (ia->lo != ib->lo)
+		return ia->lo < ib->lo ? -1 : 1;
+	if (ia->hi != ib->hi)
+		return ia->hi < ib->hi ? -1 : 1;
+	return (ia > ib) - (ia < ib);
+}
+
+void avl_interval_augment(avl_tree_node *node)
+{
+	avl_interval *interval = avl_interval_of(node);
+	int64_t max_hi = INT64_MIN;
+
+	// An empty interval overlaps nothing, so it does not count.
+	if (interval->lo < interval->hi)
+		max_hi = interval->hi;
+
+	if (node->left && avl_interval_of(node->left)->max_hi > max_hi)
+		max_hi = avl_interval_of(node->left)->max_hi;
+	if (node->right && avl_interval_of(node->right)->max_hi > max_hi)
+		max_hi = avl_interval_of(node->right)->max_hi;
+
+	interval->max_hi = max_hi;
+}
+
+void avl_interval_tree_init(avl_tree *t,
+			    avl_tree_node * (*allocate_node)(void *item),
+			    void (*free_node)(avl_tree_node * ))
+{
+	avl_tree_init(t, allocate_node, free_node, avl_interval_compare, NULL, NULL);
+	avl_tree_set_augment(t, avl_interval_augment);
+}
+
+// lo < hi
+static inline int avl_interval_overlaps(avl_interval *interval, int64_t lo, int64_t hi)
+{
+	return interval->lo < hi && lo < interval->hi &&
+	       interval->lo < interval->hi;
+}
+
+avl_interval * avl_interval_tree_find_any(avl_tree *t, int64_t lo, int64_t hi)
+{
+	avl_tree_node *node = t->root;
+
+	if (lo >= hi)
+		return NULL;
+
+	// If the left subtree reaches past lo, an overlap is there or nowhere:
+	// were the interval that reaches furthest not to overlap, it would
+	// start at or after hi, and so would everything to its right.
+	while (node && !avl_interval_overlaps(avl_interval_of(node), lo, hi)) {
+		if (node->left && avl_interval_of(node->left)->max_hi > lo)
+			node = node->left;
+		else
+			node = node->right;
+	}
+
+	return node ? avl_interval_of(node) : NULL;
+}
+
+static void avl_interval_overlaps_node(avl_tree_node *node, int64_t lo, int64_t hi,
+				       void (*visitor)(avl_interval *interval, void *context),
+				       void *context)
+{
+	avl_interval *interval;
+
+	// Subtrees that end by lo are skipped, as are the right subtrees of
+	// nodes that start at or after hi.
+	while (node && avl_interval_of(node)->max_hi > lo) {
+		interval = avl_interval_of(node);
+
+		avl_interval_overlaps_node(node->left, lo, hi, visitor, context);
+
+		if (interval->lo >= hi)
+			break;
+
+		if (avl_interval_overlaps(interval, lo, hi))
+			visitor(interval, context);
+
+		node = node->right;
+	}
+}
+
+void avl_interval_tree_overlaps(avl_tree *t, int64_t lo, int64_t hi,
+				void (*visitor)(avl_interval *interval, void *context),
+				void *context)
+{
+	if (lo >= hi)
+		return;
+
+	avl_interval_overlaps_node(t->root, lo, hi, visitor, context);
+}
@@ -0,0 +1,63 @@
+/*
+** avl_interval.h : interval trees built on augmented AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#ifndef __AVL_INTERVAL_H__
+#define __AVL_INTERVAL_H__
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "avl.h"
+
+/*
+** An interval tree is an avl_tree whose items are avl_interval pointers,
+** ordered by lo (then hi, then address, so equal intervals can coexist).
+** avl_tree_set_augment() keeps max_hi, the greatest hi in each subtree,
+** so that subtrees which end before a query starts are skipped. Empty
+** intervals (hi <= lo) overlap nothing, and leave max_hi alone.
+** The caller owns the intervals and inserts and removes them with
+** avl_tree_insert() and avl_tree_remove() like any other item.
+**
+** It is the reference example of augmentation; a range sum or range
+** maximum follows the same pattern.
+*/
+typedef struct _avl_interval {
+	int64_t lo;
+	int64_t hi;     // exclusive: the interval is [lo, hi)
+	int64_t max_hi; // kept by avl_interval_augment(); INT64_MIN if none
+	void *data;
+} avl_interval;
+
+int64_t avl_interval_compare(void *a, void *b);
+
+void avl_interval_augment(avl_tree_node *node);
+
+void avl_interval_tree_init(avl_tree *t,
+			    avl_tree_node * (*allocate_node)(void *item),
+			    void (*free_node)(avl_tree_node * ));
+
+// Some interval that overlaps [lo, hi), in O(log n).
+// NULL if there is none.
+avl_interval * avl_interval_tree_find_any(avl_tree *t, int64_t lo, int64_t hi);
+
+// Visits every interval that overlaps [lo, hi), in order of lo, in
+// O(min(n, (k + 1) log n)) for k intervals.
+void avl_interval_tree_overlaps(avl_tree *t, int64_t lo, int64_t hi,
+				void (*visitor)(avl_interval *interval, void *context),
+				void *context);
+
+#endif // __AVL_INTERVAL_H__
@@ -0,0 +1,139 @@
+/*
+** avl_iter.c : iteration over AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "avl.h"
+
+static inline avl_tree_node * avl_tree_iter_top(avl_tree_iter *it)
+{
+	return it->depth ? it->path[it->depth - 1] : NULL;
+}
+
+// Push node and its chain of left (or right) children.
+static avl_tree_node * avl_tree_iter_descend(avl_tree_iter *it,
+					     avl_tree_node *node,
+					     int leftmost)
+{
+	while (node) {
+		it->path[it->depth++] = node;
+		node = leftmost ? node->left : node->right;
+	}
+
+	return avl_tree_iter_top(it);
+}
+
+// Descend toward item, pushing every node, and keep the path to the
+// first node that is greater than item (or not less, if inclusive).
+static avl_tree_node * avl_tree_iter_seek(avl_tree_iter *it,
+					  void *item,
+					  int inclusive)
+{
+	avl_tree_node *node = it->t->root;
+	int found = 0;
+	int64_t res;
+
+	it->depth = 0;
+
+	while (node) {
+		it->path[it->depth++] = node;
+
+		res = it->t->compare_items(item, node->item);
+
+		if (res < 0 || (!res && inclusive)) {
+			found = it->depth;
+			if (!res)
+				break;
+			node = node->left;
+		} else {
+			node = node->right;
+		}
+	}
+
+	it->depth = found;
+	return avl_tree_iter_top(it);
+}
+
+void avl_tree_iter_init(avl_tree_iter *it, avl_tree *t)
+{
+	it->t = t;
+	it->depth = 0;
+}
+
+avl_tree_node * avl_tree_iter_first(avl_tree_iter *it)
+{
+	it->depth = 0;
+	return avl_tree_iter_descend(it, it->t->root, 1);
+}
+
+avl_tree_node * avl_tree_iter_last(avl_tree_iter *it)
+{
+	it->depth = 0;
+	return avl_tree_iter_descend(it, it->t->root, 0);
+}
+
+avl_tree_node * avl_tree_iter_seek_lower_bound(avl_tree_iter *it, void *item)
+{
+	return avl_tree_iter_seek(it, item, 1);
+}
+
+avl_tree_node * avl_tree_iter_seek_upper_bound(avl_tree_iter *it, void *item)
+{
+	return avl_tree_iter_seek(it, item, 0);
+}
+
+avl_tree_node * avl_tree_iter_next(avl_tree_iter *it)
+{
+	avl_tree_node *node = avl_tree_iter_top(it);
+	avl_tree_node *child;
+
+	if (!node)
+		return NULL;
+
+	if (node->right)
+		return avl_tree_iter_descend(it, node->right, 1);
+
+	// climb until we come up from a left child
+	do {
+		child = it->path[--it->depth];
+	} while (it->depth && it->path[it->depth - 1]->right == child);
+
+	return avl_tree_iter_top(it);
+}
+
+avl_tree_node * avl_tree_iter_prev(avl_tree_iter *it)
+{
+	avl_tree_node *node = avl_tree_iter_top(it);
+	avl_tree_node *child;
+
+	if (!node)
+		return NULL;
+
+	if (node->left)
+		return avl_tree_iter_descend(it, node->left, 0);
+
+	// climb until we come up from a right child
+	do {
+		child = it->path[--it->depth];
+	} while (it->depth && it->path[it->depth - 1]->left == child);
+
+	return avl_tree_iter_top(it);
+}
+
+avl_tree_node * avl_tree_iter_node(avl_tree_iter *it)
+{
+	return avl_tree_iter_top(it);
+}
@@ -0,0 +1,597 @@
+/*
+** avl_join.c : join, split and set operations on AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <pthread.h>
+
+#include "avl.h"
+#include "avl_util.h"
+#include "avl_pool.h"
+
+/*
+** Everything here is built on join: given subtrees l and r and a node k
+** such that l < k < r, make one AVL tree of them. When the heights of
+** l and r differ by more than one, k is hung from the spine of the
+** taller tree where the heights match, and the spine is rebalanced on
+** the way back up with the rotations of avl_util.h. The cost is
+** O(|h(l) - h(r)| + 1).
+**
+** Split, union, intersection and difference follow Blelloch, Ferizovic
+** and Sun, "Just Join for Parallel Ordered Sets". The set operations
+** take O(m log(n/m + 1)) time for trees of sizes m <= n.
+*/
+
+// Rebalance node, whose subtrees are AVL trees differing in height by at
+// most two, and return the root of the result.
+static avl_tree_node * avl_tree_rebalance_node(avl_tree *t, avl_tree_node *node)
+{
+	int32_t balance;
+
+	avl_tree_update_node(t, node);
+	balance = avl_tree_balance_node(node);
+
+	if (balance > 1) {
+		if (avl_tree_balance_node(node->left) < 0)
+			node->left = avl_tree_rol_node(t, node->left);
+		return avl_tree_ror_node(t, node);
+	}
+
+	if (balance < -1) {
+		if (avl_tree_balance_node(node->right) > 0)
+			node->right = avl_tree_ror_node(t, node->right);
+		return avl_tree_rol_node(t, node);
+	}
+
+	return node;
+}
+
+// l is taller than r by two or more: hang k from l's right spine.
+static avl_tree_node * avl_tree_join_right(avl_tree *t, avl_tree_node *l,
+					   avl_tree_node *k, avl_tree_node *r)
+{
+	if (avl_tree_height_node(l) <= avl_tree_height_node(r) + 1) {
+		k->left = l;
+		k->right = r;
+		avl_tree_update_node(t, k);
+		return k;
+	}
+
+	l->right = avl_tree_join_right(t, l->right, k, r);
+	return avl_tree_rebalance_node(t, l);
+}
+
+// r is taller than l by two or more: hang k from r's left spine.
+static avl_tree_node * avl_tree_join_left(avl_tree *t, avl_tree_node *l,
+					  avl_tree_node *k, avl_tree_node *r)
+{
+	if (avl_tree_height_node(r) <= avl_tree_height_node(l) + 1) {
+		k->left = l;
+		k->right = r;
+		avl_tree_update_node(t, k);
+		return k;
+	}
+
+	r->left = avl_tree_join_left(t, l, k, r->left);
+	return avl_tree_rebalance_node(t, r);
+}
+
+static avl_tree_node * avl_tree_join_node(avl_tree *t, avl_tree_node *l,
+					  avl_tree_node *k, avl_tree_node *r)
+{
+	int32_t lh = avl_tree_height_node(l);
+	int32_t rh = avl_tree_height_node(r);
+
+	if (lh > rh + 1)
+		return avl_tree_join_right(t, l, k, r);
+	if (rh > lh + 1)
+		return avl_tree_join_left(t, l, k, r);
+
+	k->left = l;
+	k->right = r;
+	avl_tree_update_node(t, k);
+	return k;
+}
+
+// Unlink the last node of the subtree at node into *last; returns the
+// root of what remains.
+static avl_tree_node * avl_tree_split_last_node(avl_tree *t, avl_tree_node *node,
+						avl_tree_node **last)
+{
+	if (!node->right) {
+		*last = node;
+		return node->left;
+	}
+
+	node->right = avl_tree_split_last_node(t, node->right, last);
+	return avl_tree_rebalance_node(t, node);
+}
+
+// Join without a middle node: l < r.
+static avl_tree_node * avl_tree_join2_node(avl_tree *t, avl_tree_node *l,
+					   avl_tree_node *r)
+{
+	avl_tree_node *last;
+
+	if (!l)
+		return r;
+
+	l = avl_tree_split_last_node(t, l, &last);
+	return avl_tree_join_node(t, l, last, r);
+}
+
+// Split the subtree at node into the nodes less than item (*l) and those
+// greater than item (*r). Returns the node equal to item, or NULL.
+static avl_tree_node * avl_tree_split_node(avl_tree *t, avl_tree_node *node, void *item,
+					   avl_tree_node **l, avl_tree_node **r)
+{
+	avl_tree_node *found;
+	avl_tree_node *middle;
+	int64_t res;
+
+	if (!node) {
+		*l = NULL;
+		*r = NULL;
+		return NULL;
+	}
+
+	res = t->compare_items(item, node->item);
+
+	if (!res) {
+		*l = node->left;
+		*r = node->right;
+		return node;
+	}
+
+	if (res < 0) {
+		found = avl_tree_split_node(t, node->left, item, l, &middle);
+		*r = avl_tree_join_node(t, middle, node, node->right);
+	} else {
+		found = avl_tree_split_node(t, node->right, item, &middle, r);
+		*l = avl_tree_join_node(t, node->left, node, middle);
+	}
+
+	return found;
+}
+
+static uint64_t avl_tree_count_node(avl_tree *t, avl_tree_node *node)
+{
+	if (!node)
+		return 0;
+	if (t->order_statistics)
+		return avl_tree_size_node(node);
+	return 1 + avl_tree_count_node(t, node->left) +
+		   avl_tree_count_node(t, node->right);
+}
+
+static avl_tree_node * avl_tree_first_node(avl_tree_node *node)
+{
+	while (node->left)
+		node = node->left;
+	return node;
+}
+
+static avl_tree_node * avl_tree_last_node(avl_tree_node *node)
+{
+	while (node->right)
+		node = node->right;
+	return node;
+}
+
+// Nodes can only move from src to dst if both trees free them the same way.
+static int avl_tree_same_allocator(avl_tree *dst, avl_tree *src)
+{
+	if (dst->use_slab || src->use_slab)
+		return dst->use_slab && src->use_slab;
+	return dst->allocate_node == src->allocate_node &&
+	       dst->free_node == src->free_node;
+}
+
+// Hand src's nodes to dst. src is left empty.
+static void avl_tree_take_nodes(avl_tree *dst, avl_tree *src)
+{
+	if (dst->use_slab)
+		avl_slab_merge(&dst->slab, &src->slab);
+	src->root = NULL;
+	src->num_items = 0;
+}
+
+int avl_tree_join(avl_tree *t1, void *item, avl_tree *t2)
+{
+	avl_tree_node *node;
+
+	if (t1 == t2 || !avl_tree_same_allocator(t1, t2))
+		return 0;
+
+	if (t1->root &&
+	    t1->compare_items(avl_tree_last_node(t1->root)->item, item) >= 0)
+		return 0;
+	if (t2->root &&
+	    t1->compare_items(item, avl_tree_first_node(t2->root)->item) >= 0)
+		return 0;
+
+	if (t1->order_statistics && !avl_tree_enable_order_statistics(t2))
+		return 0;
+	if (t1->augment && t2->augment != t1->augment)
+		avl_tree_set_augment(t2, t1->augment);
+
+	node = avl_tree_alloc_node(t1, item);
+	if (!node)
+		return 0;
+
+	t1->root = avl_tree_join_node(t1, t1->root, node, t2->root);
+	t1->num_items += t2->num_items + 1;
+
+	avl_tree_take_nodes(t1, t2);
+	return 1;
+}
+
+int avl_tree_split(avl_tree *t, void *item, avl_tree *greater)
+{
+	avl_tree_node *found;
+	avl_tree_node *l;
+	avl_tree_node *r;
+	uint64_t moved;
+
+	if (t == greater || greater->root || t->use_slab ||
+	    !avl_tree_same_allocator(t, greater))
+		return 0;
+
+	found = avl_tree_split_node(t, t->root, item, &l, &r);
+	if (found)
+		l = avl_tree_join_node(t, l, found, NULL);
+
+	moved = avl_tree_count_node(t, r);
+
+	t->root = l;
+	t->num_items -= moved;
+
+	greater->root = r;
+	greater->num_items = moved;
+
+	// The sizes under r are only valid if t kept them.
+	if (greater->order_statistics && !t->order_statistics) {
+		greater->order_statistics = 0;
+		avl_tree_enable_order_statistics(greater);
+	}
+	if (greater->augment && greater->augment != t->augment)
+		avl_tree_set_augment(greater, greater->augment);
+
+	return 1;
+}
+
+// Releases the subtree at node and returns how many nodes it held.
+static uint64_t avl_tree_release_count_node(avl_tree *t, avl_tree_node *node)
+{
+	uint64_t n;
+
+	if (!node)
+		return 0;
+
+	n = 1 + avl_tree_release_count_node(t, node->left) +
+		avl_tree_release_count_node(t, node->right);
+
+	avl_tree_release_node(t, node);
+	return n;
+}
+
+uint64_t avl_tree_range_remove(avl_tree *t, void *lo, void *hi)
+{
+	avl_tree_node *found;
+	avl_tree_node *l;
+	avl_tree_node *middle;
+	avl_tree_node *r;
+	uint64_t removed;
+
+	if (!t->root || t->compare_items(lo, hi) >= 0)
+		return 0;
+
+	// l < lo <= found, middle < hi <= r
+	found = avl_tree_split_node(t, t->root, lo, &l, &r);
+	if (found)
+		r = avl_tree_join_node(t, NULL, found, r);
+
+	found = avl_tree_split_node(t, r, hi, &middle, &r);
+	if (found)
+		r = avl_tree_join_node(t, NULL, found, r);
+
+	t->root = avl_tree_join2_node(t, l, r);
+
+	removed = avl_tree_release_count_node(t, middle);
+	t->num_items -= removed;
+	return removed;
+}
+
+// The trees being combined, and how many nodes of each were released.
+// With a pool, the releases of slab nodes are serialized by lock.
+typedef struct _avl_tree_set_context {
+	avl_tree *t1;
+	avl_tree *t2;
+	uint64_t released1;
+	uint64_t released2;
+	avl_pool *pool;
+	pthread_mutex_t lock;
+} avl_tree_set_context;
+
+typedef avl_tree_node * (*avl_tree_set_op)(avl_tree_set_context *c,
+					   avl_tree_node *a, avl_tree_node *b);
+
+typedef struct _avl_tree_set_task {
+	avl_pool_task task;
+	avl_tree_set_context *c;
+	avl_tree_set_op op;
+	avl_tree_node *a;
+	avl_tree_node *b;
+	avl_tree_node *result;
+} avl_tree_set_task;
+
+static void avl_tree_set_task_run(avl_pool_task *task)
+{
+	avl_tree_set_task *st = (avl_tree_set_task *) task;
+	st->result = st->op(st->c, st->a, st->b);
+}
+
+static void avl_tree_set_task_init(avl_tree_set_task *st, avl_tree_set_context *c,
+				   avl_tree_set_op op, avl_tree_node *a, avl_tree_node *b)
+{
+	st->task.run = avl_tree_set_task_run;
+	st->c = c;
+	st->op = op;
+	st->a = a;
+	st->b = b;
+}
+
+// Apply op to (a_left, *l) and to (a_right, *r), the first on another
+// thread if the subproblem is big enough.
+static void avl_tree_set_children(avl_tree_set_context *c, avl_tree_set_op op,
+				  avl_tree_node *a_left, avl_tree_node **l,
+				  avl_tree_node *a_right, avl_tree_node **r)
+{
+	avl_tree_set_task left;
+
+	if (!c->pool || avl_tree_height_node(a_left) < AVL_POOL_GRAIN_HEIGHT) {
+		*l = op(c, a_left, *l);
+		*r = op(c, a_right, *r);
+		return;
+	}
+
+	avl_tree_set_task_init(&left, c, op, a_left, *l);
+	avl_pool_fork(c->pool, &left.task);
+	*r = op(c, a_right, *r);
+	avl_pool_join(c->pool, &left.task);
+	*l = left.result;
+}
+
+static void avl_tree_set_release(avl_tree_set_context *c, avl_tree *t,
+				 avl_tree_node *node)
+{
+	if (c->pool && t->use_slab) {
+		pthread_mutex_lock(&c->lock);
+		avl_tree_release_node(t, node);
+		pthread_mutex_unlock(&c->lock);
+	} else {
+		avl_tree_release_node(t, node);
+	}
+}
+
+static void avl_tree_set_release_subtree(avl_tree_set_context *c, avl_tree *t,
+					 avl_tree_node *node)
+{
+	if (!node)
+		return;
+
+	avl_tree_set_release_subtree(c, t, node->left);
+	avl_tree_set_release_subtree(c, t, node->right);
+
+	avl_tree_set_release(c, t, node);
+}
+
+static void avl_tree_set_count(uint64_t *released, uint64_t n)
+{
+	__atomic_fetch_add(released, n, __ATOMIC_RELAXED);
+}
+
+// A slab tree's discarded nodes are not released one by one: the whole
+// slab is destroyed once the operation is done.
+static void avl_tree_discard_t2_subtree(avl_tree_set_context *c, avl_tree_node *node)
+{
+	if (!c->t2->use_slab)
+		avl_tree_set_release_subtree(c, c->t2, node);
+}
+
+static void avl_tree_discard_t2_node(avl_tree_set_context *c, avl_tree_node *node)
+{
+	if (!c->t2->use_slab)
+		avl_tree_set_release(c, c->t2, node);
+}
+
+static avl_tree_node * avl_tree_union_node(avl_tree_set_context *c,
+					   avl_tree_node *a, avl_tree_node *b)
+{
+	avl_tree_node *found;
+	avl_tree_node *l;
+	avl_tree_node *r;
+
+	if (!a)
+		return b;
+	if (!b)
+		return a;
+
+	// t2's nodes go to t1, so the duplicate is released even from a slab
+	found = avl_tree_split_node(c->t1, b, a->item, &l, &r);
+	if (found) {
+		avl_tree_set_release(c, c->t2, found);
+		avl_tree_set_count(&c->released2, 1);
+	}
+
+	avl_tree_set_children(c, avl_tree_union_node, a->left, &l, a->right, &r);
+
+	return avl_tree_join_node(c->t1, l, a, r);
+}
+
+static avl_tree_node * avl_tree_intersection_node(avl_tree_set_context *c,
+						  avl_tree_node *a, avl_tree_node *b)
+{
+	avl_tree_node *found;
+	avl_tree_node *l;
+	avl_tree_node *r;
+
+	if (!a || !b) {
+		avl_tree_set_count(&c->released1, avl_tree_count_node(c->t1, a));
+		avl_tree_set_release_subtree(c, c->t1, a);
+		avl_tree_discard_t2_subtree(c, b);
+		return NULL;
+	}
+
+	// b's pieces stay t2's, so they are split in t2's mode
+	found = avl_tree_split_node(c->t2, b, a->item, &l, &r);
+
+	avl_tree_set_children(c, avl_tree_intersection_node, a->left, &l, a->right, &r);
+
+	if (found) {
+		avl_tree_discard_t2_node(c, found);
+		return avl_tree_join_node(c->t1, l, a, r);
+	}
+
+	avl_tree_set_release(c, c->t1, a);
+	avl_tree_set_count(&c->released1, 1);
+	return avl_tree_join2_node(c->t1, l, r);
+}
+
+static avl_tree_node * avl_tree_difference_node(avl_tree_set_context *c,
+						avl_tree_node *a, avl_tree_node *b)
+{
+	avl_tree_node *found;
+	avl_tree_node *l;
+	avl_tree_node *r;
+
+	if (!a || !b) {
+		avl_tree_discard_t2_subtree(c, b);
+		return a;
+	}
+
+	found = avl_tree_split_node(c->t2, b, a->item, &l, &r);
+
+	avl_tree_set_children(c, avl_tree_difference_node, a->left, &l, a->right, &r);
+
+	if (found) {
+		avl_tree_discard_t2_node(c, found);
+		avl_tree_set_release(c, c->t1, a);
+		avl_tree_set_count(&c->released1, 1);
+		return avl_tree_join2_node(c->t1, l, r);
+	}
+
+	return avl_tree_join_node(c->t1, l, a, r);
+}
+
+// Run op over the roots of t1 and t2, leaving the result in t1.
+static void avl_tree_set_apply(avl_tree_set_context *c, avl_pool *p,
+			       avl_tree *t1, avl_tree *t2, avl_tree_set_op op)
+{
+	avl_tree_set_task root;
+
+	c->t1 = t1;
+	c->t2 = t2;
+	c->released1 = 0;
+	c->released2 = 0;
+	c->pool = p;
+
+	if (!p) {
+		t1->root = op(c, t1->root, t2->root);
+		return;
+	}
+
+	pthread_mutex_init(&c->lock, NULL);
+	avl_tree_set_task_init(&root, c, op, t1->root, t2->root);
+	avl_pool_run(p, &root.task);
+	t1->root = root.result;
+	pthread_mutex_destroy(&c->lock);
+}
+
+// t2 has given up all of its nodes, one way or another.
+static void avl_tree_set_done(avl_tree_set_context *c)
+{
+	avl_tree *t2 = c->t2;
+
+	if (t2->use_slab)
+		avl_slab_destroy(&t2->slab);
+	t2->root = NULL;
+	t2->num_items = 0;
+}
+
+int avl_tree_union_parallel(avl_pool *p, avl_tree *t1, avl_tree *t2)
+{
+	avl_tree_set_context c;
+
+	if (t1 == t2)
+		return 1;
+	if (!avl_tree_same_allocator(t1, t2))
+		return 0;
+
+	if (t1->order_statistics && !avl_tree_enable_order_statistics(t2))
+		return 0;
+	if (t1->augment && t2->augment != t1->augment)
+		avl_tree_set_augment(t2, t1->augment);
+
+	avl_tree_set_apply(&c, p, t1, t2, avl_tree_union_node);
+	t1->num_items += t2->num_items - c.released2;
+
+	avl_tree_take_nodes(t1, t2);
+	return 1;
+}
+
+void avl_tree_intersection_parallel(avl_pool *p, avl_tree *t1, avl_tree *t2)
+{
+	avl_tree_set_context c;
+
+	if (t1 == t2)
+		return;
+
+	avl_tree_set_apply(&c, p, t1, t2, avl_tree_intersection_node);
+	t1->num_items -= c.released1;
+
+	avl_tree_set_done(&c);
+}
+
+void avl_tree_difference_parallel(avl_pool *p, avl_tree *t1, avl_tree *t2)
+{
+	avl_tree_set_context c;
+
+	if (t1 == t2) {
+		avl_tree_destroy_parallel(p, t1);
+		return;
+	}
+
+	avl_tree_set_apply(&c, p, t1, t2, avl_tree_difference_node);
+	t1->num_items -= c.released1;
+
+	avl_tree_set_done(&c);
+}
+
+int avl_tree_union(avl_tree *t1, avl_tree *t2)
+{
+	return avl_tree_union_parallel(NULL, t1, t2);
+}
+
+void avl_tree_intersection(avl_tree *t1, avl_tree *t2)
+{
+	avl_tree_intersection_parallel(NULL, t1, t2);
+}
+
+void avl_tree_difference(avl_tree *t1, avl_tree *t2)
+{
+	avl_tree_difference_parallel(NULL, t1, t2);
+}
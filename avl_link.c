@@ -0,0 +1,255 @@
+/*
+** avl_link.c : implementation of intrusive AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "avl.h"
+#include "avl_util.h"
+#include "avl_link.h"
+
+static inline int32_t avl_link_height(avl_link *link)
+{
+	if (!link)
+		return 0;
+	return link->height;
+}
+
+static inline int32_t avl_link_balance(avl_link *link)
+{
+	return avl_link_height(link->left) - avl_link_height(link->right);
+}
+
+static inline void avl_link_update(avl_link *link)
+{
+	link->height = avl_tree_max(avl_link_height(link->left),
+				    avl_link_height(link->right)) + 1;
+}
+
+static inline avl_link * avl_link_ror(avl_link *link)
+{
+	avl_link *links_left = link->left;
+
+	link->left = links_left->right;
+	links_left->right = link;
+
+	avl_link_update(link);
+	avl_link_update(links_left);
+	return links_left;
+}
+
+static inline avl_link * avl_link_rol(avl_link *link)
+{
+	avl_link *links_right = link->right;
+
+	link->right = links_right->left;
+	links_right->left = link;
+
+	avl_link_update(link);
+	avl_link_update(links_right);
+	return links_right;
+}
+
+// Restore the balance of the subtree at *slot; returns its new root.
+static inline avl_link * avl_link_rebalance(avl_link **slot)
+{
+	avl_link *link = *slot;
+	int32_t balance;
+
+	avl_link_update(link);
+
+	balance = avl_link_balance(link);
+
+	if (balance > 1) {
+		if (avl_link_balance(link->left) < 0)
+			link->left = avl_link_rol(link->left);
+		link = *slot = avl_link_ror(link);
+	} else if (balance < -1) {
+		if (avl_link_balance(link->right) > 0)
+			link->right = avl_link_ror(link->right);
+		link = *slot = avl_link_rol(link);
+	}
+
+	return link;
+}
+
+void avl_root_init(avl_root *root)
+{
+	root->link = NULL;
+	root->num_items = 0;
+}
+
+int avl_link_insert(avl_root *root, avl_link *link,
+		    const void *key, avl_link_compare compare)
+{
+	avl_link **path[AVL_TREE_MAX_HEIGHT];
+	avl_link **slot;
+	avl_link *node;
+	int32_t height;
+	int64_t res;
+	int depth = 0;
+
+	slot = &root->link;
+
+	while (*slot) {
+		node = *slot;
+
+		res = compare(key, node);
+
+		if (!res)
+			return 0;
+
+		path[depth++] = slot;
+
+		slot = res < 0 ? &node->left : &node->right;
+	}
+
+	link->left = NULL;
+	link->right = NULL;
+	link->height = 1;
+
+	*slot = link;
+	++root->num_items;
+
+	// After an insert, a rotation always restores the subtree's
+	// original height, so the retrace ends with it.
+	while (depth > 0) {
+		--depth;
+		node = *path[depth];
+		height = node->height;
+
+		if (avl_link_rebalance(path[depth])->height == height)
+			break;
+	}
+
+	return 1;
+}
+
+avl_link * avl_link_find(avl_root *root,
+			 const void *key, avl_link_compare compare)
+{
+	avl_link *node;
+	int64_t res;
+
+	node = root->link;
+
+	while (node) {
+
+		res = compare(key, node);
+
+		if (res < 0) {
+			node = node->left;
+		} else if (res > 0) {
+			node = node->right;
+		} else {
+			return node;
+		}
+
+	}
+
+	return NULL;
+}
+
+avl_link * avl_link_remove(avl_root *root,
+			   const void *key, avl_link_compare compare)
+{
+	avl_link **path[AVL_TREE_MAX_HEIGHT];
+	avl_link **slot;
+	avl_link *node;
+	int32_t height;
+	int64_t res;
+	int depth = 0;
+
+	slot = &root->link;
+
+	while (*slot) {
+		node = *slot;
+
+		res = compare(key, node);
+
+		if (!res)
+			break;
+
+		path[depth++] = slot;
+
+		slot = res < 0 ? &node->left : &node->right;
+	}
+
+	node = *slot;
+	if (!node)
+		return NULL;
+
+	if (!node->left || !node->right) {
+		*slot = node->left ? node->left : node->right;
+	} else {
+		// put the successor in node's place.
+		avl_link *successor;
+		int node_depth = depth;
+
+		path[depth++] = slot;
+		slot = &node->right;
+
+		while ((*slot)->left) {
+			path[depth++] = slot;
+			slot = &(*slot)->left;
+		}
+
+		successor = *slot;
+		*slot = successor->right;
+
+		successor->left = node->left;
+		successor->right = node->right;
+		successor->height = node->height;
+
+		*path[node_depth] = successor;
+		if (node_depth + 1 < depth)
+			path[node_depth + 1] = &successor->right;
+	}
+
+	--root->num_items;
+
+	while (depth > 0) {
+		--depth;
+		height = (*path[depth])->height;
+
+		if (avl_link_rebalance(path[depth])->height == height)
+			break;
+	}
+
+	node->left = NULL;
+	node->right = NULL;
+	node->height = 0;
+
+	return node;
+}
+
+void avl_link_in_order(avl_root *root,
+		       void (*visitor)(avl_link *link, void *context),
+		       void *context)
+{
+	avl_link *stack[AVL_TREE_MAX_HEIGHT];
+	avl_link *node = root->link;
+	int depth = 0;
+
+	while (node || depth) {
+		while (node) {
+			stack[depth++] = node;
+			node = node->left;
+		}
+		node = stack[--depth];
+		visitor(node, context);
+		node = node->right;
+	}
+}
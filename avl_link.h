@@ -0,0 +1,83 @@
+/*
+** avl_link.h : definitions for intrusive AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#ifndef __AVL_LINK_H__
+#define __AVL_LINK_H__
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+** The caller embeds an avl_link in each of its own objects and gets the
+** object back from a link with avl_entry(). The tree never allocates:
+** inserting links the caller's object in, removing unlinks it.
+**
+**	struct my_object {
+**		int64_t key;
+**		avl_link link;
+**	};
+**
+**	int64_t my_compare(const void *key, const avl_link *link)
+**	{
+**		int64_t a = *(const int64_t *) key;
+**		int64_t b = avl_entry(link, struct my_object, link)->key;
+**		return (a > b) - (a < b);
+**	}
+**
+**	avl_link_insert(&root, &obj->link, &obj->key, my_compare);
+**
+** Since the structures are public, a caller can also write its own search
+** loop over left/right with the comparison inlined.
+*/
+typedef struct _avl_link {
+	struct _avl_link *left;
+	struct _avl_link *right;
+	int32_t height;
+} avl_link;
+
+typedef struct _avl_root {
+	avl_link *link;
+	uint64_t num_items;
+} avl_root;
+
+#define avl_entry(__ptr, __type, __member) \
+	((__type *) ((char *) (__ptr) - offsetof(__type, __member)))
+
+// Orders a key against the object that contains link.
+typedef int64_t (*avl_link_compare)(const void *key, const avl_link *link);
+
+void avl_root_init(avl_root *root);
+
+// 0 if insertion failed (an object with an equal key is present).
+// key is the key of the object that contains link.
+int avl_link_insert(avl_root *root, avl_link *link,
+		    const void *key, avl_link_compare compare);
+
+// NULL if not found
+avl_link * avl_link_find(avl_root *root,
+			 const void *key, avl_link_compare compare);
+
+// Unlinks the object with an equal key and returns its link.
+// NULL if not found
+avl_link * avl_link_remove(avl_root *root,
+			   const void *key, avl_link_compare compare);
+
+void avl_link_in_order(avl_root *root,
+		       void (*visitor)(avl_link *link, void *context),
+		       void *context);
+
+#endif // __AVL_LINK_H__
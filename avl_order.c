@@ -0,0 +1,143 @@
+/*
+** avl_order.c : implementation of AVL Tree order statistics
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "avl.h"
+#include "avl_util.h"
+
+static uint64_t avl_tree_compute_size_node(avl_tree_node *node)
+{
+	if (!node)
+		return 0;
+	avl_tree_counted(node)->size = 1 + avl_tree_compute_size_node(node->left) +
+					   avl_tree_compute_size_node(node->right);
+	return avl_tree_counted(node)->size;
+}
+
+// Copy the subtree at node into s, in order, and return the copy's root.
+// s has room reserved for every node, so no allocation fails.
+static avl_tree_node * avl_tree_copy_node(avl_slab *s, avl_tree_node *node)
+{
+	avl_tree_node *left;
+	avl_tree_node *copy;
+
+	if (!node)
+		return NULL;
+
+	left = avl_tree_copy_node(s, node->left);
+	copy = avl_slab_alloc(s, node->item);
+	copy->left = left;
+	copy->right = avl_tree_copy_node(s, node->right);
+	copy->height = node->height;
+	return copy;
+}
+
+int avl_tree_enable_order_statistics(avl_tree *t)
+{
+	avl_slab counted;
+
+	if (t->order_statistics)
+		return 1;
+
+	if (!t->use_slab && t->node_size < sizeof(avl_tree_counted_node))
+		return 0;
+
+	if (t->use_slab && t->slab.node_size < sizeof(avl_tree_counted_node)) {
+		avl_slab_init_size(&counted, sizeof(avl_tree_counted_node));
+		if (t->num_items && !avl_slab_reserve(&counted, t->num_items))
+			return 0;
+		t->root = avl_tree_copy_node(&counted, t->root);
+		avl_slab_destroy(&t->slab);
+		t->slab = counted;
+	}
+
+	avl_tree_compute_size_node(t->root);
+	t->order_statistics = 1;
+	return 1;
+}
+
+avl_tree_node * avl_tree_select(avl_tree *t, uint64_t k)
+{
+	avl_tree_node *node;
+	uint64_t left_size;
+
+	if (!t->order_statistics || k >= t->num_items)
+		return NULL;
+
+	node = t->root;
+
+	while (node) {
+
+		left_size = avl_tree_size_node(node->left);
+
+		if (k < left_size) {
+			node = node->left;
+		} else if (k > left_size) {
+			k -= left_size + 1;
+			node = node->right;
+		} else {
+			return node;
+		}
+
+	}
+
+	return NULL;
+}
+
+uint64_t avl_tree_rank(avl_tree *t, void *item)
+{
+	avl_tree_node *node;
+	uint64_t rank = 0;
+	int64_t res;
+
+	if (!t->order_statistics)
+		return 0;
+
+	node = t->root;
+
+	while (node) {
+
+		res = t->compare_items(item, node->item);
+
+		if (res < 0) {
+			node = node->left;
+		} else if (res > 0) {
+			rank += avl_tree_size_node(node->left) + 1;
+			node = node->right;
+		} else {
+			rank += avl_tree_size_node(node->left);
+			break;
+		}
+
+	}
+
+	return rank;
+}
+
+uint64_t avl_tree_count_range(avl_tree *t, void *lo, void *hi)
+{
+	uint64_t lo_rank;
+	uint64_t hi_rank;
+
+	if (!t->order_statistics || t->compare_items(lo, hi) >= 0)
+		return 0;
+
+	lo_rank = avl_tree_rank(t, lo);
+	hi_rank = avl_tree_rank(t, hi);
+
+	return hi_rank - lo_rank;
+}
@@ -0,0 +1,462 @@
+/*
+** avl_persistent.c : implementation of persistent AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "avl_persistent.h"
+
+/*
+** The functions that change a subtree take over the caller's reference
+** to its root and hand back a reference to the new root. Before a node
+** is changed it is made private with avl_persistent_own(): kept if the
+** reference being held is the only one, copied otherwise.
+**
+** If memory runs out before the change is made, the subtree is handed
+** back unchanged and *failed is set; the nodes copied on the way down are
+** faithful copies, so the version stays valid.
+**
+** Once the change is made, memory can no longer run out: the rotations
+** that rebalance the path copy their shared nodes from the tree's spares,
+** and an insertion or removal reserves enough of those before it starts.
+** A rotation copies at most two nodes, and there is at most one rotation
+** for each node on the path.
+*/
+
+static inline int32_t avl_persistent_height_node(avl_persistent_node *node)
+{
+	if (!node)
+		return 0;
+	return node->height;
+}
+
+static inline int32_t avl_persistent_balance_node(avl_persistent_node *node)
+{
+	return avl_persistent_height_node(node->left) -
+	       avl_persistent_height_node(node->right);
+}
+
+static inline void avl_persistent_update_node(avl_persistent_node *node)
+{
+	int32_t l = avl_persistent_height_node(node->left);
+	int32_t r = avl_persistent_height_node(node->right);
+	node->height = (l > r ? l : r) + 1;
+}
+
+static inline void avl_persistent_ref(avl_persistent_node *node)
+{
+	if (node)
+		__atomic_fetch_add(&node->refs, 1, __ATOMIC_RELAXED);
+}
+
+static avl_persistent_node * avl_persistent_malloc_node(void *item)
+{
+	avl_persistent_node *node;
+
+	node = (avl_persistent_node *) malloc(sizeof(avl_persistent_node));
+	if (node)
+		node->item = item;
+	return node;
+}
+
+static void avl_persistent_free_node(avl_persistent_node *node)
+{
+	free(node);
+}
+
+static void avl_persistent_unref(avl_persistent_tree *t, avl_persistent_node *node)
+{
+	while (node) {
+		avl_persistent_node *right;
+
+		if (__atomic_sub_fetch(&node->refs, 1, __ATOMIC_ACQ_REL))
+			return;
+
+		// last reference: free node and let go of its children
+		avl_persistent_unref(t, node->left);
+		right = node->right;
+		t->free_node(node);
+		node = right;
+	}
+}
+
+static avl_persistent_node * avl_persistent_alloc(avl_persistent_tree *t, void *item)
+{
+	avl_persistent_node *node;
+
+	node = t->allocate_node(item);
+	if (!node)
+		return NULL;
+
+	node->item = item;
+	node->left = NULL;
+	node->right = NULL;
+	node->height = 1;
+	node->refs = 1;
+
+	return node;
+}
+
+// Make sure t has at least n spare nodes. 0 if out of memory.
+static int avl_persistent_reserve(avl_persistent_tree *t, uint64_t n)
+{
+	avl_persistent_node *node;
+
+	while (t->num_spare < n) {
+		node = t->allocate_node(NULL);
+		if (!node)
+			return 0;
+		node->left = t->spare;
+		t->spare = node;
+		++t->num_spare;
+	}
+
+	return 1;
+}
+
+// Make copy a private copy of node, which the caller's reference to node
+// is then moved to.
+static avl_persistent_node * avl_persistent_copy(avl_persistent_tree *t,
+						 avl_persistent_node *node,
+						 avl_persistent_node *copy)
+{
+	copy->item = node->item;
+	copy->left = node->left;
+	copy->right = node->right;
+	copy->height = node->height;
+	copy->refs = 1;
+	avl_persistent_ref(copy->left);
+	avl_persistent_ref(copy->right);
+
+	avl_persistent_unref(t, node);
+	return copy;
+}
+
+// A node that only the caller's reference reaches, with node's contents.
+// NULL if out of memory (the caller's reference to node is then kept).
+static avl_persistent_node * avl_persistent_own(avl_persistent_tree *t,
+						avl_persistent_node *node)
+{
+	avl_persistent_node *copy;
+
+	if (__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 1)
+		return node;
+
+	copy = t->allocate_node(node->item);
+	if (!copy)
+		return NULL;
+
+	return avl_persistent_copy(t, node, copy);
+}
+
+// The same for a rotation, which cannot fail: a copy comes from the
+// spares reserved for it.
+static avl_persistent_node * avl_persistent_own_spare(avl_persistent_tree *t,
+						      avl_persistent_node *node)
+{
+	avl_persistent_node *copy;
+
+	if (__atomic_load_n(&node->refs, __ATOMIC_ACQUIRE) == 1)
+		return node;
+
+	copy = t->spare;
+	t->spare = copy->left;
+	--t->num_spare;
+
+	return avl_persistent_copy(t, node, copy);
+}
+
+// node is private. Its children are swapped about, so the child that
+// rises is made private first.
+static avl_persistent_node * avl_persistent_ror_node(avl_persistent_tree *t,
+						     avl_persistent_node *node)
+{
+	avl_persistent_node *nodes_left = avl_persistent_own_spare(t, node->left);
+
+	node->left = nodes_left->right;
+	nodes_left->right = node;
+
+	avl_persistent_update_node(node);
+	avl_persistent_update_node(nodes_left);
+	return nodes_left;
+}
+
+static avl_persistent_node * avl_persistent_rol_node(avl_persistent_tree *t,
+						     avl_persistent_node *node)
+{
+	avl_persistent_node *nodes_right = avl_persistent_own_spare(t, node->right);
+
+	node->right = nodes_right->left;
+	nodes_right->left = node;
+
+	avl_persistent_update_node(node);
+	avl_persistent_update_node(nodes_right);
+	return nodes_right;
+}
+
+// node is private and its subtrees differ in height by at most two.
+// Uses at most two of t's spares.
+static avl_persistent_node * avl_persistent_rebalance_node(avl_persistent_tree *t,
+							   avl_persistent_node *node)
+{
+	int32_t balance;
+
+	avl_persistent_update_node(node);
+	balance = avl_persistent_balance_node(node);
+
+	if (balance > 1) {
+		if (avl_persistent_balance_node(node->left) < 0) {
+			node->left = avl_persistent_own_spare(t, node->left);
+			node->left = avl_persistent_rol_node(t, node->left);
+		}
+		return avl_persistent_ror_node(t, node);
+	}
+
+	if (balance < -1) {
+		if (avl_persistent_balance_node(node->right) > 0) {
+			node->right = avl_persistent_own_spare(t, node->right);
+			node->right = avl_persistent_ror_node(t, node->right);
+		}
+		return avl_persistent_rol_node(t, node);
+	}
+
+	return node;
+}
+
+static avl_persistent_node * avl_persistent_insert_node(avl_persistent_tree *t,
+							avl_persistent_node *node,
+							void *item, int *failed)
+{
+	avl_persistent_node *n;
+
+	if (!node) {
+		n = avl_persistent_alloc(t, item);
+		if (!n)
+			*failed = 1;
+		return n;
+	}
+
+	n = avl_persistent_own(t, node);
+	if (!n) {
+		*failed = 1;
+		return node;
+	}
+
+	if (t->compare_items(item, n->item) < 0)
+		n->left = avl_persistent_insert_node(t, n->left, item, failed);
+	else
+		n->right = avl_persistent_insert_node(t, n->right, item, failed);
+
+	return avl_persistent_rebalance_node(t, n);
+}
+
+// Take the first item of the subtree at node into *item and unlink it.
+static avl_persistent_node * avl_persistent_remove_first_node(avl_persistent_tree *t,
+							      avl_persistent_node *node,
+							      void **item, int *failed)
+{
+	avl_persistent_node *n;
+	avl_persistent_node *right;
+
+	if (!node->left) {
+		*item = node->item;
+		right = node->right;
+		avl_persistent_ref(right);
+		avl_persistent_unref(t, node);
+		return right;
+	}
+
+	n = avl_persistent_own(t, node);
+	if (!n) {
+		*failed = 1;
+		return node;
+	}
+
+	n->left = avl_persistent_remove_first_node(t, n->left, item, failed);
+	if (*failed)
+		return n;
+	return avl_persistent_rebalance_node(t, n);
+}
+
+// item is known to be in the subtree.
+static avl_persistent_node * avl_persistent_remove_node(avl_persistent_tree *t,
+							avl_persistent_node *node,
+							void *item, int *failed)
+{
+	avl_persistent_node *n;
+	avl_persistent_node *child;
+	void *first;
+	int64_t res;
+
+	res = t->compare_items(item, node->item);
+
+	if (!res && (!node->left || !node->right)) {
+		child = node->left ? node->left : node->right;
+		avl_persistent_ref(child);
+		avl_persistent_unref(t, node);
+		return child;
+	}
+
+	n = avl_persistent_own(t, node);
+	if (!n) {
+		*failed = 1;
+		return node;
+	}
+
+	if (res < 0) {
+		n->left = avl_persistent_remove_node(t, n->left, item, failed);
+	} else if (res > 0) {
+		n->right = avl_persistent_remove_node(t, n->right, item, failed);
+	} else {
+		// n is a private node: its item can be replaced by its successor's
+		n->right = avl_persistent_remove_first_node(t, n->right, &first, failed);
+		if (!*failed)
+			n->item = first;
+	}
+
+	if (*failed)
+		return n;
+	return avl_persistent_rebalance_node(t, n);
+}
+
+void avl_persistent_tree_init(avl_persistent_tree *t,
+			      int64_t (*compare_items)(void * , void * ))
+{
+	t->root = NULL;
+	t->num_items = 0;
+	t->compare_items = compare_items;
+	t->allocate_node = avl_persistent_malloc_node;
+	t->free_node = avl_persistent_free_node;
+	t->spare = NULL;
+	t->num_spare = 0;
+}
+
+void avl_persistent_tree_set_allocator(avl_persistent_tree *t,
+				       avl_persistent_node * (*allocate_node)(void *item),
+				       void (*free_node)(avl_persistent_node *node))
+{
+	t->allocate_node = allocate_node;
+	t->free_node = free_node;
+}
+
+void avl_persistent_tree_destroy(avl_persistent_tree *t)
+{
+	avl_persistent_node *next;
+
+	avl_persistent_unref(t, t->root);
+	t->root = NULL;
+	t->num_items = 0;
+
+	while (t->spare) {
+		next = t->spare->left;
+		t->free_node(t->spare);
+		t->spare = next;
+	}
+	t->num_spare = 0;
+}
+
+void avl_persistent_tree_snapshot(avl_persistent_tree *t,
+				  avl_persistent_tree *snapshot)
+{
+	avl_persistent_ref(t->root);
+	snapshot->root = t->root;
+	snapshot->num_items = t->num_items;
+	snapshot->compare_items = t->compare_items;
+	snapshot->allocate_node = t->allocate_node;
+	snapshot->free_node = t->free_node;
+	snapshot->spare = NULL;
+	snapshot->num_spare = 0;
+}
+
+int avl_persistent_tree_insert(avl_persistent_tree *t, void *item)
+{
+	int failed = 0;
+
+	// Nothing is copied for an item that is already present.
+	if (avl_persistent_tree_find(t, item))
+		return 0;
+
+	if (!avl_persistent_reserve(t, 2 * (uint64_t) avl_persistent_height_node(t->root)))
+		return 0;
+
+	t->root = avl_persistent_insert_node(t, t->root, item, &failed);
+	if (failed)
+		return 0;
+
+	++t->num_items;
+	return 1;
+}
+
+int avl_persistent_tree_remove(avl_persistent_tree *t, void *item)
+{
+	int failed = 0;
+
+	if (!avl_persistent_tree_find(t, item))
+		return 0;
+
+	if (!avl_persistent_reserve(t, 2 * (uint64_t) avl_persistent_height_node(t->root)))
+		return 0;
+
+	t->root = avl_persistent_remove_node(t, t->root, item, &failed);
+	if (failed)
+		return 0;
+
+	--t->num_items;
+	return 1;
+}
+
+uint64_t avl_persistent_tree_num_items(avl_persistent_tree *t)
+{
+	return t->num_items;
+}
+
+avl_persistent_node * avl_persistent_tree_find(avl_persistent_tree *t, void *item)
+{
+	avl_persistent_node *node = t->root;
+	int64_t res;
+
+	while (node) {
+		res = t->compare_items(item, node->item);
+		if (!res)
+			return node;
+		node = res < 0 ? node->left : node->right;
+	}
+
+	return NULL;
+}
+
+static void avl_persistent_in_order_node(avl_persistent_node *node,
+					 void (*visitor)(avl_persistent_node *node, void *context),
+					 void *context)
+{
+	if (!node)
+		return;
+
+	avl_persistent_in_order_node(node->left, visitor, context);
+	visitor(node, context);
+	avl_persistent_in_order_node(node->right, visitor, context);
+}
+
+void avl_persistent_tree_in_order(avl_persistent_tree *t,
+				  void (*visitor)(avl_persistent_node *node, void *context),
+				  void *context)
+{
+	avl_persistent_in_order_node(t->root, visitor, context);
+}
+
+int32_t avl_persistent_tree_height(avl_persistent_tree *t)
+{
+	return avl_persistent_height_node(t->root);
+}
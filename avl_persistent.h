@@ -0,0 +1,92 @@
+/*
+** avl_persistent.h : definitions for persistent AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#ifndef __AVL_PERSISTENT_H__
+#define __AVL_PERSISTENT_H__
+#include <stdlib.h>
+#include <stdint.h>
+
+/*
+** A persistent tree is a version of a set of items. Versions share
+** nodes: avl_persistent_tree_snapshot() makes a new version in O(1) by
+** sharing the root, and an insertion or removal copies only the shared
+** nodes on the path it changes, O(log n) of them, leaving every other
+** version as it was. A node that no version shares any more is changed
+** in place.
+**
+** Each node counts the versions and parent nodes that point to it, and
+** is freed when the last of them lets go. A version also keeps a few
+** spare nodes, two for each level of the tree, so that an insertion or
+** removal whose memory runs out fails before it changes anything. The counts are atomic, so
+** versions that share nodes may be used and destroyed on different
+** threads; a single version is not thread safe.
+*/
+typedef struct _avl_persistent_node {
+	void *item;
+	struct _avl_persistent_node *left;
+	struct _avl_persistent_node *right;
+	int32_t height;
+	uint32_t refs;
+} avl_persistent_node;
+
+typedef struct _avl_persistent_tree {
+	avl_persistent_node *root;
+	uint64_t num_items;
+	int64_t (*compare_items)(void * , void * );
+	avl_persistent_node * (*allocate_node)(void *item);
+	void (*free_node)(avl_persistent_node *node);
+	avl_persistent_node *spare; // linked through the left pointers
+	uint64_t num_spare;
+} avl_persistent_tree;
+
+void avl_persistent_tree_init(avl_persistent_tree *t,
+			      int64_t (*compare_items)(void * , void * ));
+
+// Nodes come from malloc() unless allocate_node and free_node are set
+// here, before t holds any. Snapshots of t use the same allocator.
+void avl_persistent_tree_set_allocator(avl_persistent_tree *t,
+				       avl_persistent_node * (*allocate_node)(void *item),
+				       void (*free_node)(avl_persistent_node *node));
+
+// Lets go of this version; the tree is empty and usable afterwards.
+void avl_persistent_tree_destroy(avl_persistent_tree *t);
+
+// Makes snapshot a new version with the items of t, in O(1).
+// snapshot must not hold a version already (initialized or destroyed).
+void avl_persistent_tree_snapshot(avl_persistent_tree *t,
+				  avl_persistent_tree *snapshot);
+
+// 0 if insertion failed; t then holds the same items as before and is
+// still balanced
+int avl_persistent_tree_insert(avl_persistent_tree *t, void *item);
+
+// 0 if removal failed, with t as for a failed insertion
+int avl_persistent_tree_remove(avl_persistent_tree *t, void *item);
+
+uint64_t avl_persistent_tree_num_items(avl_persistent_tree *t);
+
+// NULL if not found
+avl_persistent_node * avl_persistent_tree_find(avl_persistent_tree *t, void *item);
+
+void avl_persistent_tree_in_order(avl_persistent_tree *t,
+				  void (*visitor)(avl_persistent_node *node, void *context),
+				  void *context);
+
+int32_t avl_persistent_tree_height(avl_persistent_tree *t);
+
+#endif // __AVL_PERSISTENT_H__
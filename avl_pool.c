@@ -0,0 +1,292 @@
+/*
+** avl_pool.c : implementation of the AVL Tree thread pool
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "avl_pool.h"
+
+// Forks nest no deeper than the recursion of the operations, which is
+// bounded by tree heights. A task that does not fit runs on the spot.
+#define AVL_POOL_DEQUE_SIZE 256
+
+typedef struct _avl_pool_worker {
+	pthread_mutex_t lock;
+	avl_pool_task *tasks[AVL_POOL_DEQUE_SIZE];
+	uint32_t top;    // oldest task, taken by thieves
+	uint32_t bottom; // one past the newest task, pushed and popped by the owner
+	uint64_t random; // victim selection
+	pthread_t thread;
+	avl_pool *pool;
+} avl_pool_worker;
+
+struct _avl_pool {
+	int num_threads;
+	avl_pool_worker *workers; // workers[0] is whoever calls avl_pool_run()
+	pthread_mutex_t run_lock; // one operation at a time
+	pthread_mutex_t lock;     // guards running and shutdown
+	pthread_cond_t wake;
+	int running;
+	int shutdown;
+};
+
+static __thread avl_pool_worker *avl_pool_self;
+
+static void avl_pool_run_task(avl_pool_task *task)
+{
+	task->run(task);
+	__atomic_store_n(&task->done, 1, __ATOMIC_RELEASE);
+}
+
+static int avl_pool_push(avl_pool_worker *w, avl_pool_task *task)
+{
+	int pushed = 0;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->bottom - w->top < AVL_POOL_DEQUE_SIZE) {
+		w->tasks[w->bottom++ % AVL_POOL_DEQUE_SIZE] = task;
+		pushed = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return pushed;
+}
+
+// Take back task, if it is still the newest one and nobody stole it.
+static int avl_pool_pop(avl_pool_worker *w, avl_pool_task *task)
+{
+	int popped = 0;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->bottom != w->top &&
+	    w->tasks[(w->bottom - 1) % AVL_POOL_DEQUE_SIZE] == task) {
+		--w->bottom;
+		popped = 1;
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return popped;
+}
+
+static avl_pool_task * avl_pool_steal_from(avl_pool_worker *victim)
+{
+	avl_pool_task *task = NULL;
+
+	pthread_mutex_lock(&victim->lock);
+	if (victim->bottom != victim->top)
+		task = victim->tasks[victim->top++ % AVL_POOL_DEQUE_SIZE];
+	pthread_mutex_unlock(&victim->lock);
+
+	return task;
+}
+
+// Try each other worker once, starting at a random one.
+static avl_pool_task * avl_pool_steal(avl_pool_worker *w)
+{
+	avl_pool *p = w->pool;
+	avl_pool_task *task;
+	int start;
+	int i;
+
+	w->random ^= w->random << 13;
+	w->random ^= w->random >> 7;
+	w->random ^= w->random << 17;
+	start = (int) (w->random % (uint64_t) p->num_threads);
+
+	for (i = 0 ; i < p->num_threads ; ++i) {
+		avl_pool_worker *victim = &p->workers[(start + i) % p->num_threads];
+		if (victim == w)
+			continue;
+		task = avl_pool_steal_from(victim);
+		if (task)
+			return task;
+	}
+
+	return NULL;
+}
+
+static void * avl_pool_thread(void *arg)
+{
+	avl_pool_worker *w = (avl_pool_worker *) arg;
+	avl_pool *p = w->pool;
+	avl_pool_task *task;
+
+	avl_pool_self = w;
+
+	pthread_mutex_lock(&p->lock);
+	for (;;) {
+		while (!p->running && !p->shutdown)
+			pthread_cond_wait(&p->wake, &p->lock);
+		if (p->shutdown)
+			break;
+		pthread_mutex_unlock(&p->lock);
+
+		while (__atomic_load_n(&p->running, __ATOMIC_ACQUIRE)) {
+			task = avl_pool_steal(w);
+			if (task)
+				avl_pool_run_task(task);
+			else
+				sched_yield();
+		}
+
+		pthread_mutex_lock(&p->lock);
+	}
+	pthread_mutex_unlock(&p->lock);
+
+	return NULL;
+}
+
+static void avl_pool_init_worker(avl_pool *p, avl_pool_worker *w, int index)
+{
+	pthread_mutex_init(&w->lock, NULL);
+	w->top = 0;
+	w->bottom = 0;
+	w->random = 0x9e3779b97f4a7c15ULL * (uint64_t) (index + 1);
+	w->pool = p;
+}
+
+avl_pool * avl_pool_create(int num_threads)
+{
+	avl_pool *p;
+	int i;
+
+	if (num_threads < 1)
+		return NULL;
+
+	p = (avl_pool *) malloc(sizeof(avl_pool));
+	if (!p)
+		return NULL;
+
+	p->workers = (avl_pool_worker *) malloc(num_threads * sizeof(avl_pool_worker));
+	if (!p->workers) {
+		free(p);
+		return NULL;
+	}
+
+	p->num_threads = num_threads;
+	pthread_mutex_init(&p->run_lock, NULL);
+	pthread_mutex_init(&p->lock, NULL);
+	pthread_cond_init(&p->wake, NULL);
+	p->running = 0;
+	p->shutdown = 0;
+
+	for (i = 0 ; i < num_threads ; ++i)
+		avl_pool_init_worker(p, &p->workers[i], i);
+
+	for (i = 1 ; i < num_threads ; ++i) {
+		if (pthread_create(&p->workers[i].thread, NULL,
+				   avl_pool_thread, &p->workers[i])) {
+			// run with the threads that did start
+			p->num_threads = i;
+			break;
+		}
+	}
+
+	return p;
+}
+
+void avl_pool_destroy(avl_pool *p)
+{
+	int i;
+
+	pthread_mutex_lock(&p->lock);
+	p->shutdown = 1;
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+
+	for (i = 1 ; i < p->num_threads ; ++i)
+		pthread_join(p->workers[i].thread, NULL);
+
+	for (i = 0 ; i < p->num_threads ; ++i)
+		pthread_mutex_destroy(&p->workers[i].lock);
+
+	pthread_cond_destroy(&p->wake);
+	pthread_mutex_destroy(&p->lock);
+	pthread_mutex_destroy(&p->run_lock);
+
+	free(p->workers);
+	free(p);
+}
+
+int avl_pool_num_threads(avl_pool *p)
+{
+	return p->num_threads;
+}
+
+void avl_pool_run(avl_pool *p, avl_pool_task *task)
+{
+	avl_pool_worker *saved = avl_pool_self;
+
+	// Already on this pool: the task is just part of the current operation.
+	if (saved && saved->pool == p) {
+		avl_pool_run_task(task);
+		return;
+	}
+
+	pthread_mutex_lock(&p->run_lock);
+	avl_pool_self = &p->workers[0];
+
+	pthread_mutex_lock(&p->lock);
+	__atomic_store_n(&p->running, 1, __ATOMIC_RELEASE);
+	pthread_cond_broadcast(&p->wake);
+	pthread_mutex_unlock(&p->lock);
+
+	avl_pool_run_task(task);
+
+	// Every forked task has been joined, so none is left to steal.
+	pthread_mutex_lock(&p->lock);
+	__atomic_store_n(&p->running, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&p->lock);
+
+	avl_pool_self = saved;
+	pthread_mutex_unlock(&p->run_lock);
+}
+
+void avl_pool_fork(avl_pool *p, avl_pool_task *task)
+{
+	avl_pool_worker *w = avl_pool_self;
+
+	task->done = 0;
+
+	if (!w || w->pool != p || !avl_pool_push(w, task))
+		avl_pool_run_task(task);
+}
+
+void avl_pool_join(avl_pool *p, avl_pool_task *task)
+{
+	avl_pool_worker *w = avl_pool_self;
+	avl_pool_task *other;
+
+	if (__atomic_load_n(&task->done, __ATOMIC_ACQUIRE))
+		return;
+
+	if (avl_pool_pop(w, task)) {
+		avl_pool_run_task(task);
+		return;
+	}
+
+	// Stolen: help with other work until the thief is done.
+	while (!__atomic_load_n(&task->done, __ATOMIC_ACQUIRE)) {
+		other = avl_pool_steal(w);
+		if (other)
+			avl_pool_run_task(other);
+		else
+			sched_yield();
+	}
+}
@@ -0,0 +1,86 @@
+/*
+** avl_pool.h : definitions for the AVL Tree thread pool
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#ifndef __AVL_POOL_H__
+#define __AVL_POOL_H__
+#include <stdint.h>
+
+#include "avl.h"
+
+/*
+** A small work-stealing pool for the divide-and-conquer operations below.
+** Each thread keeps a deque of forked subproblems; it works on its own
+** newest one and, when it runs dry, steals the oldest one of another
+** thread. Subproblems below a grain size run sequentially.
+**
+** The calling thread takes part in each operation, so a pool of
+** num_threads starts num_threads - 1 threads. A pool runs one operation
+** at a time; concurrent callers take turns.
+**
+** Every function below accepts a NULL pool and then runs sequentially.
+** With a pool, the tree's allocate_node and free_node callbacks are
+** called from several threads at once and must be thread safe (the
+** built-in slab is).
+*/
+typedef struct _avl_pool avl_pool;
+
+// NULL if the pool could not be created
+avl_pool * avl_pool_create(int num_threads);
+
+// Stops and joins the pool's threads.
+void avl_pool_destroy(avl_pool *p);
+
+int avl_pool_num_threads(avl_pool *p);
+
+// avl_tree_build_sorted()
+int avl_tree_build_sorted_parallel(avl_pool *p, avl_tree *t, void **items, uint64_t n);
+
+// avl_tree_union(), avl_tree_intersection() and avl_tree_difference()
+int avl_tree_union_parallel(avl_pool *p, avl_tree *t1, avl_tree *t2);
+
+void avl_tree_intersection_parallel(avl_pool *p, avl_tree *t1, avl_tree *t2);
+
+void avl_tree_difference_parallel(avl_pool *p, avl_tree *t1, avl_tree *t2);
+
+// avl_tree_destroy()
+void avl_tree_destroy_parallel(avl_pool *p, avl_tree *t);
+
+/*
+** Used by the implementation: fork/join over the pool.
+**
+** Within a task that is running on the pool, avl_pool_fork() offers a
+** subtask to the other threads and avl_pool_join() waits for it,
+** running it on the spot if nobody took it. Subtasks must be joined in
+** the reverse of the order they were forked in.
+*/
+typedef struct _avl_pool_task {
+	void (*run)(struct _avl_pool_task *task);
+	int done;
+} avl_pool_task;
+
+// Subtrees shorter than this are not worth handing to another thread.
+#define AVL_POOL_GRAIN_HEIGHT 12
+
+// Runs task on the pool and returns once it is done.
+void avl_pool_run(avl_pool *p, avl_pool_task *task);
+
+void avl_pool_fork(avl_pool *p, avl_pool_task *task);
+
+void avl_pool_join(avl_pool *p, avl_pool_task *task);
+
+#endif // __AVL_POOL_H__
@@ -19,91 +19,118 @@
 #include "avl.h"
 #include "avl_util.h"
 
-static avl_tree_node * avl_tree_remove_node(avl_tree *t,
-					    void *item,
-					    avl_tree_node *node,
-					    int *removed)
+int avl_tree_remove(avl_tree *t, void *item)
 {
-	int64_t res;
+	avl_tree_node **path[AVL_TREE_MAX_HEIGHT];
+	avl_tree_node **link;
+	avl_tree_node *node;
+	int32_t height;
 	int32_t balance;
+	int64_t res;
+	int depth = 0;
 
-	if (!node)
-		return node;
-
-	res = t->compare_items(item, node->item);
-
-	if (res < 0)
-		node->left = avl_tree_remove_node(t, item, node->left, removed);
-	else if (res > 0)
-		node->right = avl_tree_remove_node(t, item, node->right, removed);
-	else {
-
-		if (!node->left || !node->right) {
-			// one or both children empty.
-			avl_tree_node *trash = node->left ? node->left : node->right;
-
-			if (!trash) {
-				// no children
-				trash = node;
-				node = NULL;
-			} else // copy the contents of the non-empty child
-				*node = *trash;
+	// Descend, remembering each link that was followed.
+	link = &t->root;
 
-			*removed = 1;
-			t->free_node(trash);
+	while (*link) {
+		node = *link;
 
-		} else {
-			// both children present.
-			// find the successor's value, place it in node,
-			// and continue to delete the successor.
-			avl_tree_node *successor = avl_tree_successor_node(node);
+		res = t->compare_items(item, node->item);
 
-			node->item = successor->item;
+		if (!res)
+			break;
 
-			node->right = avl_tree_remove_node(t, successor->item, node->right, removed);
-		}
+		path[depth++] = link;
 
+		link = res < 0 ? &node->left : &node->right;
 	}
 
+	node = *link;
 	if (!node)
-		return node;
+		return 0;
+
+	if (!node->left || !node->right) {
+		// one or both children empty.
+		// splice the non-empty child (if any) into node's place.
+		avl_tree_set_link(t, link, node->left ? node->left : node->right);
+	} else {
+		// both children present.
+		// unlink the successor and put it in node's place.
+		avl_tree_node *successor;
+		int node_depth = depth;
+
+		path[depth++] = link;
+		link = &node->right;
+
+		while ((*link)->left) {
+			path[depth++] = link;
+			link = &(*link)->left;
+		}
 
-	// update the height of the current node
-	node->height = avl_tree_max(avl_tree_height_node(node->left),
-				    avl_tree_height_node(node->right)) + 1;
+		successor = *link;
+		avl_tree_set_link(t, link, successor->right);
 
-	balance = avl_tree_balance_node(node);
+		avl_tree_set_link(t, &successor->left, node->left);
+		avl_tree_set_link(t, &successor->right, node->right);
+		successor->height = node->height;
+		if (t->order_statistics)
+			avl_tree_counted(successor)->size = avl_tree_size_node(node);
 
-	if (balance > 1) {
-		int32_t left_balance = avl_tree_balance_node(node->left);
+		avl_tree_set_link(t, path[node_depth], successor);
+		if (node_depth + 1 < depth)
+			path[node_depth + 1] = &successor->right;
+	}
 
-		// Left Left Case
-		if (left_balance >= 0)
-			return avl_tree_ror_node(node);
-		else { // Left Right Case
-			node->left = avl_tree_rol_node(node->left);
-			return avl_tree_ror_node(node);
+	avl_tree_release_node(t, node);
+	--t->num_items;
+
+	// Retrace toward the root. Once a subtree's height is unchanged,
+	// no ancestor can be out of balance.
+	while (depth > 0) {
+		--depth;
+		link = path[depth];
+		node = *link;
+
+		height = node->height;
+		avl_tree_update_node(t, node);
+
+		balance = avl_tree_balance_node(node);
+
+		if (balance > 1) {
+			// Left Right Case
+			if (avl_tree_balance_node(node->left) < 0)
+				avl_tree_set_link(t, &node->left,
+						  avl_tree_rol_node(t, node->left));
+			// Left Left Case
+			node = avl_tree_ror_node(t, node);
+			avl_tree_set_link(t, link, node);
+		} else if (balance < -1) {
+			// Right Left Case
+			if (avl_tree_balance_node(node->right) > 0)
+				avl_tree_set_link(t, &node->right,
+						  avl_tree_ror_node(t, node->right));
+			// Right Right Case
+			node = avl_tree_rol_node(t, node);
+			avl_tree_set_link(t, link, node);
 		}
-	}
 
-	if (balance < -1) {
-		int32_t right_balance = avl_tree_balance_node(node->right);
+		if (node->height == height)
+			break;
+	}
 
-		// Right Right Case
-		if (right_balance <= 0)
-			return avl_tree_rol_node(node);
-		else { // Right Left Case
-			node->right = avl_tree_ror_node(node->right);
-			return avl_tree_rol_node(node);
+	// The remaining ancestors keep their heights, but their
+	// subtrees have shrunk by one.
+	if (t->augment) {
+		while (depth > 0) {
+			--depth;
+			avl_tree_update_node(t, *path[depth]);
+		}
+	} else if (t->order_statistics) {
+		while (depth > 0) {
+			--depth;
+			--avl_tree_counted(*path[depth])->size;
 		}
 	}
 
-	return node;
-}
-
-int avl_tree_remove(avl_tree *t, void *item)
-{
-	int removed = 0;
-	t->root = avl_tree_remove_node(t, item, t->root, &removed);
-	return removed;
+	return 1;
 }
@@ -0,0 +1,148 @@
+/*
+** avl_slab.c : implementation of the AVL Tree node slab allocator
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include "avl.h"
+#include "avl_util.h"
+
+// Chunks start small so that small trees stay small, and double in
+// size up to a limit.
+#define AVL_SLAB_MIN_CHUNK_NODES 64
+#define AVL_SLAB_MAX_CHUNK_NODES 65536
+
+void avl_slab_init(avl_slab *s)
+{
+	avl_slab_init_size(s, sizeof(avl_tree_node));
+}
+
+void avl_slab_init_size(avl_slab *s, uint64_t node_size)
+{
+	s->chunks = NULL;
+	s->chunk_used = 0;
+	s->node_size = node_size;
+	s->free_list = NULL;
+}
+
+static avl_slab_chunk * avl_slab_add_chunk(avl_slab *s, uint64_t min_nodes)
+{
+	avl_slab_chunk *chunk;
+	uint64_t num_nodes = AVL_SLAB_MIN_CHUNK_NODES;
+
+	if (s->chunks) {
+		num_nodes = s->chunks->num_nodes * 2;
+		if (num_nodes > AVL_SLAB_MAX_CHUNK_NODES)
+			num_nodes = AVL_SLAB_MAX_CHUNK_NODES;
+	}
+
+	if (num_nodes < min_nodes)
+		num_nodes = min_nodes;
+
+	chunk = (avl_slab_chunk *)
+		malloc(sizeof(avl_slab_chunk) + num_nodes * s->node_size);
+	if (!chunk)
+		return NULL;
+
+	chunk->next = s->chunks;
+	chunk->num_nodes = num_nodes;
+
+	s->chunks = chunk;
+	s->chunk_used = 0;
+
+	return chunk;
+}
+
+avl_tree_node * avl_slab_alloc(avl_slab *s, void *item)
+{
+	avl_tree_node *node;
+
+	if (s->free_list) {
+		node = s->free_list;
+		s->free_list = node->left;
+	} else {
+		if (!s->chunks || s->chunk_used == s->chunks->num_nodes) {
+			if (!avl_slab_add_chunk(s, 1))
+				return NULL;
+		}
+		node = avl_slab_node_at(s, s->chunks, s->chunk_used++);
+	}
+
+	node->item = item;
+	node->left = NULL;
+	node->right = NULL;
+
+	return node;
+}
+
+void avl_slab_free(avl_slab *s, avl_tree_node *node)
+{
+	node->left = s->free_list;
+	s->free_list = node;
+}
+
+int avl_slab_reserve(avl_slab *s, uint64_t num_nodes)
+{
+	if (s->chunks && s->chunks->num_nodes - s->chunk_used >= num_nodes)
+		return 1;
+	return avl_slab_add_chunk(s, num_nodes) != NULL;
+}
+
+void avl_slab_merge(avl_slab *dst, avl_slab *src)
+{
+	avl_slab_chunk *last;
+	avl_tree_node *node;
+
+	if (!src->chunks)
+		return;
+
+	avl_tree_assert(src->node_size >= dst->node_size);
+
+	if (!dst->chunks) {
+		// dst carves up src's chunk from now on, at src's node size
+		*dst = *src;
+		avl_slab_init_size(src, src->node_size);
+		return;
+	}
+
+	// src's chunks go behind dst's first chunk, which stays the one
+	// being carved up.
+	for (last = src->chunks ; last->next ; last = last->next)
+		;
+	last->next = dst->chunks->next;
+	dst->chunks->next = src->chunks;
+
+	if (src->free_list) {
+		for (node = src->free_list ; node->left ; node = node->left)
+			;
+		node->left = dst->free_list;
+		dst->free_list = src->free_list;
+	}
+
+	avl_slab_init_size(src, src->node_size);
+}
+
+void avl_slab_destroy(avl_slab *s)
+{
+	avl_slab_chunk *chunk = s->chunks;
+
+	while (chunk) {
+		avl_slab_chunk *trash = chunk;
+		chunk = chunk->next;
+		free(trash);
+	}
+
+	avl_slab_init_size(s, s->node_size);
+}
@@ -0,0 +1,297 @@
+/*
+** avl_typed.h : key-specialized AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#ifndef __AVL_TYPED_H__
+#define __AVL_TYPED_H__
+#include <stdlib.h>
+#include <stdint.h>
+
+#include "avl.h"
+
+/*
+** AVL_TYPED_TREE_DEFINE(name, key_type, less) generates a tree whose nodes
+** hold a key_type key inline and which orders keys with the expression
+** less(a, b). Everything is static inline, so the comparison is compiled
+** into the search loops instead of being called through a pointer.
+**
+**	AVL_TYPED_TREE_DEFINE(u32_tree, uint32_t, AVL_TYPED_LESS)
+**
+** defines the types u32_tree and u32_tree_node, and:
+**
+**	void u32_tree_init(u32_tree *t);
+**	void u32_tree_destroy(u32_tree *t);
+**	int u32_tree_insert(u32_tree *t, uint32_t key);    // 0 if failed
+**	int u32_tree_remove(u32_tree *t, uint32_t key);    // 0 if failed
+**	u32_tree_node * u32_tree_find(u32_tree *t, uint32_t key);
+**	uint64_t u32_tree_num_items(u32_tree *t);
+**	int32_t u32_tree_height(u32_tree *t);
+**
+** Nodes come from AVL_TYPED_MALLOC and go back to AVL_TYPED_FREE, which
+** may be defined before including this file.
+**
+** avl_int64_tree, keyed by int64_t, is defined below.
+*/
+
+#ifndef AVL_TYPED_MALLOC
+#define AVL_TYPED_MALLOC(__size) malloc(__size)
+#endif
+
+#ifndef AVL_TYPED_FREE
+#define AVL_TYPED_FREE(__ptr) free(__ptr)
+#endif
+
+// Direct comparison; correct over the whole range of the key type
+// (unlike a subtraction, which can overflow).
+#define AVL_TYPED_LESS(__a, __b) ((__a) < (__b))
+
+#define AVL_TYPED_TREE_DEFINE(name, key_type, less)                           \
+                                                                              \
+typedef struct name##_node {                                                  \
+	key_type key;                                                         \
+	struct name##_node *left;                                             \
+	struct name##_node *right;                                            \
+	int32_t height;                                                       \
+} name##_node;                                                                \
+                                                                              \
+typedef struct name {                                                         \
+	name##_node *root;                                                    \
+	uint64_t num_items;                                                   \
+} name;                                                                       \
+                                                                              \
+static inline int32_t name##_height_node(name##_node *node)                   \
+{                                                                             \
+	return node ? node->height : 0;                                       \
+}                                                                             \
+                                                                              \
+static inline int32_t name##_balance_node(name##_node *node)                  \
+{                                                                             \
+	return name##_height_node(node->left) -                               \
+	       name##_height_node(node->right);                               \
+}                                                                             \
+                                                                              \
+static inline void name##_update_node(name##_node *node)                      \
+{                                                                             \
+	int32_t l = name##_height_node(node->left);                           \
+	int32_t r = name##_height_node(node->right);                          \
+	node->height = (l > r ? l : r) + 1;                                   \
+}                                                                             \
+                                                                              \
+static inline name##_node * name##_ror_node(name##_node *node)                \
+{                                                                             \
+	name##_node *nodes_left = node->left;                                 \
+	node->left = nodes_left->right;                                       \
+	nodes_left->right = node;                                             \
+	name##_update_node(node);                                             \
+	name##_update_node(nodes_left);                                       \
+	return nodes_left;                                                    \
+}                                                                             \
+                                                                              \
+static inline name##_node * name##_rol_node(name##_node *node)                \
+{                                                                             \
+	name##_node *nodes_right = node->right;                               \
+	node->right = nodes_right->left;                                      \
+	nodes_right->left = node;                                             \
+	name##_update_node(node);                                             \
+	name##_update_node(nodes_right);                                      \
+	return nodes_right;                                                   \
+}                                                                             \
+                                                                              \
+/* Restore the balance of the subtree at *link; returns its new root. */     \
+static inline name##_node * name##_rebalance_node(name##_node **link)         \
+{                                                                             \
+	name##_node *node = *link;                                            \
+	int32_t balance;                                                      \
+                                                                              \
+	name##_update_node(node);                                             \
+	balance = name##_balance_node(node);                                  \
+                                                                              \
+	if (balance > 1) {                                                    \
+		if (name##_balance_node(node->left) < 0)                      \
+			node->left = name##_rol_node(node->left);             \
+		node = *link = name##_ror_node(node);                         \
+	} else if (balance < -1) {                                            \
+		if (name##_balance_node(node->right) > 0)                     \
+			node->right = name##_ror_node(node->right);           \
+		node = *link = name##_rol_node(node);                         \
+	}                                                                     \
+                                                                              \
+	return node;                                                          \
+}                                                                             \
+                                                                              \
+static inline void name##_init(name *t)                                       \
+{                                                                             \
+	t->root = NULL;                                                       \
+	t->num_items = 0;                                                     \
+}                                                                             \
+                                                                              \
+/* Rotate left children up until none is left; no stack needed. */          \
+static inline void name##_destroy(name *t)                                    \
+{                                                                             \
+	name##_node *node = t->root;                                          \
+                                                                              \
+	while (node) {                                                        \
+		name##_node *next;                                            \
+		if (node->left) {                                             \
+			next = node->left;                                    \
+			node->left = next->right;                             \
+			next->right = node;                                   \
+		} else {                                                      \
+			next = node->right;                                   \
+			AVL_TYPED_FREE(node);                                 \
+		}                                                             \
+		node = next;                                                  \
+	}                                                                     \
+                                                                              \
+	t->root = NULL;                                                       \
+	t->num_items = 0;                                                     \
+}                                                                             \
+                                                                              \
+static inline name##_node * name##_find(name *t, key_type key)                \
+{                                                                             \
+	name##_node *node = t->root;                                          \
+                                                                              \
+	while (node) {                                                        \
+		if (less(key, node->key))                                     \
+			node = node->left;                                    \
+		else if (less(node->key, key))                                \
+			node = node->right;                                   \
+		else                                                          \
+			return node;                                          \
+	}                                                                     \
+                                                                              \
+	return NULL;                                                          \
+}                                                                             \
+                                                                              \
+static inline int name##_insert(name *t, key_type key)                        \
+{                                                                             \
+	name##_node **path[AVL_TREE_MAX_HEIGHT];                              \
+	name##_node **link = &t->root;                                        \
+	name##_node *node;                                                    \
+	int32_t height;                                                       \
+	int depth = 0;                                                        \
+                                                                              \
+	while (*link) {                                                       \
+		node = *link;                                                 \
+		path[depth++] = link;                                         \
+		if (less(key, node->key))                                     \
+			link = &node->left;                                   \
+		else if (less(node->key, key))                                \
+			link = &node->right;                                  \
+		else                                                          \
+			return 0;                                             \
+	}                                                                     \
+                                                                              \
+	node = (name##_node *) AVL_TYPED_MALLOC(sizeof(name##_node));         \
+	if (!node)                                                            \
+		return 0;                                                     \
+                                                                              \
+	node->key = key;                                                      \
+	node->left = NULL;                                                    \
+	node->right = NULL;                                                   \
+	node->height = 1;                                                     \
+                                                                              \
+	*link = node;                                                         \
+	++t->num_items;                                                       \
+                                                                              \
+	while (depth > 0) {                                                   \
+		--depth;                                                      \
+		height = (*path[depth])->height;                              \
+		if (name##_rebalance_node(path[depth])->height == height)     \
+			break;                                                \
+	}                                                                     \
+                                                                              \
+	return 1;                                                             \
+}                                                                             \
+                                                                              \
+static inline int name##_remove(name *t, key_type key)                        \
+{                                                                             \
+	name##_node **path[AVL_TREE_MAX_HEIGHT];                              \
+	name##_node **link = &t->root;                                        \
+	name##_node *node;                                                    \
+	int32_t height;                                                       \
+	int depth = 0;                                                        \
+                                                                              \
+	while (*link) {                                                       \
+		node = *link;                                                 \
+		if (less(key, node->key)) {                                   \
+			path[depth++] = link;                                 \
+			link = &node->left;                                   \
+		} else if (less(node->key, key)) {                            \
+			path[depth++] = link;                                 \
+			link = &node->right;                                  \
+		} else                                                        \
+			break;                                                \
+	}                                                                     \
+                                                                              \
+	node = *link;                                                         \
+	if (!node)                                                            \
+		return 0;                                                     \
+                                                                              \
+	if (!node->left || !node->right) {                                    \
+		*link = node->left ? node->left : node->right;                \
+	} else {                                                              \
+		/* put the successor in node's place. */                      \
+		name##_node *successor;                                       \
+		int node_depth = depth;                                       \
+                                                                              \
+		path[depth++] = link;                                         \
+		link = &node->right;                                          \
+                                                                              \
+		while ((*link)->left) {                                       \
+			path[depth++] = link;                                 \
+			link = &(*link)->left;                                \
+		}                                                             \
+                                                                              \
+		successor = *link;                                            \
+		*link = successor->right;                                     \
+                                                                              \
+		successor->left = node->left;                                 \
+		successor->right = node->right;                               \
+		successor->height = node->height;                             \
+                                                                              \
+		*path[node_depth] = successor;                                \
+		if (node_depth + 1 < depth)                                   \
+			path[node_depth + 1] = &successor->right;             \
+	}                                                                     \
+                                                                              \
+	AVL_TYPED_FREE(node);                                                 \
+	--t->num_items;                                                       \
+                                                                              \
+	while (depth > 0) {                                                   \
+		--depth;                                                      \
+		height = (*path[depth])->height;                              \
+		if (name##_rebalance_node(path[depth])->height == height)     \
+			break;                                                \
+	}                                                                     \
+                                                                              \
+	return 1;                                                             \
+}                                                                             \
+                                                                              \
+static inline uint64_t name##_num_items(name *t)                              \
+{                                                                             \
+	return t->num_items;                                                  \
+}                                                                             \
+                                                                              \
+static inline int32_t name##_height(name *t)                                  \
+{                                                                             \
+	return name##_height_node(t->root);                                   \
+}
+
+AVL_TYPED_TREE_DEFINE(avl_int64_tree, int64_t, AVL_TYPED_LESS)
+
+#endif // __AVL_TYPED_H__
@@ -55,7 +55,89 @@ static inline int32_t avl_tree_balance_node(avl_tree_node *node)
 	       avl_tree_height_node(node->right);
 }
 
-static inline avl_tree_node * avl_tree_ror_node(avl_tree_node *node)
+// Node i of a slab chunk.
+static inline avl_tree_node * avl_slab_node_at(avl_slab *s, avl_slab_chunk *chunk,
+					       uint64_t i)
+{
+	return (avl_tree_node *) ((char *) chunk->nodes + i * s->node_size);
+}
+
+static inline avl_tree_counted_node * avl_tree_counted(avl_tree_node *node)
+{
+	return (avl_tree_counted_node *) node;
+}
+
+static inline avl_tree_node * avl_tree_alloc_node(avl_tree *t, void *item)
+{
+	avl_tree_node *node;
+
+	if (t->use_slab)
+		node = avl_slab_alloc(&t->slab, item);
+	else
+		node = t->allocate_node(item);
+
+	if (node && t->order_statistics)
+		avl_tree_counted(node)->size = 1;
+	return node;
+}
+
+static inline void avl_tree_release_node(avl_tree *t, avl_tree_node *node)
+{
+	if (t->use_slab)
+		avl_slab_free(&t->slab, node);
+	else
+		t->free_node(node);
+}
+
+// Releases every node of the subtree at node, children first. Each item
+// goes to free_item before its node is released, unless that is NULL.
+static inline void avl_tree_release_subtree(avl_tree *t, avl_tree_node *node,
+					    void (*free_item)(void *item))
+{
+	if (!node)
+		return;
+
+	avl_tree_release_subtree(t, node->left, free_item);
+	avl_tree_release_subtree(t, node->right, free_item);
+
+	if (free_item)
+		free_item(node->item);
+	avl_tree_release_node(t, node);
+}
+
+// Only for the nodes of a tree in order statistics mode.
+static inline uint64_t avl_tree_size_node(avl_tree_node *node)
+{
+	if (!node)
+		return 0;
+	return avl_tree_counted(node)->size;
+}
+
+// Point *link at node. Lock-free lookups follow the links of a concurrent
+// tree while its writer changes them, so there the store is a release,
+// which also publishes a new node's item and links.
+static inline void avl_tree_set_link(avl_tree *t, avl_tree_node **link,
+				     avl_tree_node *node)
+{
+	if (t->atomic_links)
+		__atomic_store_n(link, node, __ATOMIC_RELEASE);
+	else
+		*link = node;
+}
+
+// Recompute the data that node derives from its children.
+static inline void avl_tree_update_node(avl_tree *t, avl_tree_node *node)
+{
+	node->height = avl_tree_max(avl_tree_height_node(node->left),
+				    avl_tree_height_node(node->right)) + 1;
+	if (t->order_statistics)
+		avl_tree_counted(node)->size = avl_tree_size_node(node->left) +
+					       avl_tree_size_node(node->right) + 1;
+	if (t->augment)
+		t->augment(node);
+}
+
+static inline avl_tree_node * avl_tree_ror_node(avl_tree *t, avl_tree_node *node)
 {
 /*
 //             node
@@ -73,17 +155,15 @@ static inline avl_tree_node * avl_tree_ror_node(avl_tree_node *node)
 	avl_tree_node *nodes_left = node->left;
 	avl_tree_node *nodes_left_right = nodes_left->right;
 
-	nodes_left->right = node;
-	node->left = nodes_left_right;
+	avl_tree_set_link(t, &nodes_left->right, node);
+	avl_tree_set_link(t, &node->left, nodes_left_right);
 
-	node->height = avl_tree_max(avl_tree_height_node(node->left),
-				    avl_tree_height_node(node->right)) + 1;
-	nodes_left->height = avl_tree_max(avl_tree_height_node(nodes_left->left),
-					  avl_tree_height_node(nodes_left->right)) + 1;
+	avl_tree_update_node(t, node);
+	avl_tree_update_node(t, nodes_left);
 	return nodes_left;
 }
 
-static inline avl_tree_node * avl_tree_rol_node(avl_tree_node *node)
+static inline avl_tree_node * avl_tree_rol_node(avl_tree *t, avl_tree_node *node)
 {
 /*
 //             node
@@ -101,13 +181,11 @@ static inline avl_tree_node * avl_tree_rol_node(avl_tree_node *node)
 	avl_tree_node *nodes_right = node->right;
 	avl_tree_node *nodes_right_left = nodes_right->left;
 
-	nodes_right->left = node;
-	node->right = nodes_right_left;
+	avl_tree_set_link(t, &nodes_right->left, node);
+	avl_tree_set_link(t, &node->right, nodes_right_left);
 
-	node->height = avl_tree_max(avl_tree_height_node(node->left),
-				    avl_tree_height_node(node->right)) + 1;
-	nodes_right->height = avl_tree_max(avl_tree_height_node(nodes_right->left),
-					   avl_tree_height_node(nodes_right->right)) + 1;
+	avl_tree_update_node(t, node);
+	avl_tree_update_node(t, nodes_right);
 	return nodes_right;
 }
 
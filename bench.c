@@ -0,0 +1,2093 @@
+/*
+** bench.c : benchmarks for AVL Trees
+** Copyright (C) 2018  Tim Whisonant
+**
+** This program is free software; you can redistribute it and/or
+** modify it under the terms of the GNU General Public License
+** as published by the Free Software Foundation; either version 2
+** of the License, or (at your option) any later version.
+**
+** This program is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with this program; if not, write to the Free Software
+** Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "avl.h"
+#include "avl_util.h"
+#include "avl_link.h"
+#include "avl_typed.h"
+#include "avl_compact.h"
+#include "avl_frozen.h"
+#include "avl_pool.h"
+#include "avl_concurrent.h"
+#include "avl_persistent.h"
+#include "avl_foreach.h"
+#include "avl_interval.h"
+#include "avl_image.h"
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static double ns_per(uint64_t start, uint64_t end, uint64_t ops)
+{
+	return ops ? (double) (end - start) / (double) ops : 0.0;
+}
+
+static avl_tree_node * bench_allocate_node(void *item)
+{
+	avl_tree_node *node = (avl_tree_node *)
+				malloc(sizeof(avl_tree_node));
+	if (node) {
+		node->item = item;
+		node->left = NULL;
+		node->right = NULL;
+	}
+
+	return node;
+}
+
+static void bench_free_node(avl_tree_node *node)
+{
+	free(node);
+}
+
+static int64_t bench_int_compare(void *a, void *b)
+{
+	int64_t ia = (int64_t) a;
+	int64_t ib = (int64_t) b;
+	return (ia > ib) - (ia < ib);
+}
+
+static uint64_t bench_compare_count;
+
+static int64_t bench_counting_compare(void *a, void *b)
+{
+	++bench_compare_count;
+	return bench_int_compare(a, b);
+}
+
+static void bench_tree_init(avl_tree *t)
+{
+	avl_tree_init(t,
+		      bench_allocate_node,
+		      bench_free_node,
+		      bench_int_compare,
+		      NULL,
+		      NULL);
+}
+
+static uint64_t bench_random(uint64_t *state)
+{
+	// xorshift64*
+	uint64_t x = *state;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return x * 0x2545F4914F6CDD1DULL;
+}
+
+// The keys 0 .. n-1 in a random order.
+static int64_t * shuffled_keys(uint64_t n, uint64_t seed)
+{
+	int64_t *keys = (int64_t *) malloc(n * sizeof(int64_t));
+	uint64_t state = seed | 1;
+	uint64_t i;
+
+	for (i = 0 ; i < n ; ++i)
+		keys[i] = (int64_t) i;
+
+	for (i = n ; i > 1 ; --i) {
+		uint64_t j = bench_random(&state) % i;
+		int64_t temp = keys[i - 1];
+		keys[i - 1] = keys[j];
+		keys[j] = temp;
+	}
+
+	return keys;
+}
+
+/*
+** Reference implementations: the recursive insert and remove that
+** avl_tree_insert() and avl_tree_remove() used to be built on.
+*/
+static avl_tree_node * ref_insert_node(avl_tree *t,
+				       void *item,
+				       avl_tree_node *node,
+				       int *inserted)
+{
+	int64_t res;
+	int32_t balance;
+
+	if (!node) {
+		node = t->allocate_node(item);
+		if (node) {
+			*inserted = 1;
+			node->height = 1;
+		}
+		return node;
+	}
+
+	res = t->compare_items(item, node->item);
+
+	if (res < 0)
+		node->left = ref_insert_node(t, item, node->left, inserted);
+	else if (res > 0)
+		node->right = ref_insert_node(t, item, node->right, inserted);
+	else
+		return node;
+
+	avl_tree_update_node(t, node);
+
+	balance = avl_tree_balance_node(node);
+
+	if (balance > 1) {
+		res = t->compare_items(item, node->left->item);
+		if (res < 0)
+			return avl_tree_ror_node(t, node);
+	}
+
+	if (balance < -1) {
+		res = t->compare_items(item, node->right->item);
+		if (res > 0)
+			return avl_tree_rol_node(t, node);
+	}
+
+	if (balance > 1) {
+		res = t->compare_items(item, node->left->item);
+		if (res > 0) {
+			node->left = avl_tree_rol_node(t, node->left);
+			return avl_tree_ror_node(t, node);
+		}
+	}
+
+	if (balance < -1) {
+		res = t->compare_items(item, node->right->item);
+		if (res < 0) {
+			node->right = avl_tree_ror_node(t, node->right);
+			return avl_tree_rol_node(t, node);
+		}
+	}
+
+	return node;
+}
+
+static int ref_insert(avl_tree *t, void *item)
+{
+	int inserted = 0;
+	t->root = ref_insert_node(t, item, t->root, &inserted);
+	t->num_items += inserted;
+	return inserted;
+}
+
+static avl_tree_node * ref_remove_node(avl_tree *t,
+				       void *item,
+				       avl_tree_node *node,
+				       int *removed)
+{
+	int64_t res;
+	int32_t balance;
+
+	if (!node)
+		return node;
+
+	res = t->compare_items(item, node->item);
+
+	if (res < 0)
+		node->left = ref_remove_node(t, item, node->left, removed);
+	else if (res > 0)
+		node->right = ref_remove_node(t, item, node->right, removed);
+	else {
+
+		if (!node->left || !node->right) {
+			avl_tree_node *trash = node->left ? node->left : node->right;
+
+			if (!trash) {
+				trash = node;
+				node = NULL;
+			} else
+				*node = *trash;
+
+			*removed = 1;
+			t->free_node(trash);
+
+		} else {
+			avl_tree_node *successor = avl_tree_successor_node(node);
+
+			node->item = successor->item;
+
+			node->right = ref_remove_node(t, successor->item, node->right, removed);
+		}
+
+	}
+
+	if (!node)
+		return node;
+
+	avl_tree_update_node(t, node);
+
+	balance = avl_tree_balance_node(node);
+
+	if (balance > 1) {
+		if (avl_tree_balance_node(node->left) >= 0)
+			return avl_tree_ror_node(t, node);
+		else {
+			node->left = avl_tree_rol_node(t, node->left);
+			return avl_tree_ror_node(t, node);
+		}
+	}
+
+	if (balance < -1) {
+		if (avl_tree_balance_node(node->right) <= 0)
+			return avl_tree_rol_node(t, node);
+		else {
+			node->right = avl_tree_ror_node(t, node->right);
+			return avl_tree_rol_node(t, node);
+		}
+	}
+
+	return node;
+}
+
+static int ref_remove(avl_tree *t, void *item)
+{
+	int removed = 0;
+	t->root = ref_remove_node(t, item, t->root, &removed);
+	t->num_items -= removed;
+	return removed;
+}
+
+/*
+** The level-order traversal avl_tree_level_order() used to be: one
+** allocated queue entry per node, appended by walking to the tail.
+*/
+static avl_queue_entry * ref_allocate_entry(avl_tree_node *node)
+{
+	avl_queue_entry *entry = (avl_queue_entry *)
+				 malloc(sizeof(avl_queue_entry));
+	if (entry)
+		entry->node = node;
+
+	return entry;
+}
+
+static void ref_add_queue_entry(avl_tree_node *node, avl_queue_entry **queue_head)
+{
+	avl_queue_entry *entry = ref_allocate_entry(node);
+
+	entry->next = NULL;
+
+	if (*queue_head == NULL) {
+		*queue_head = entry;
+	} else {
+		avl_queue_entry *last = *queue_head;
+
+		while (last->next)
+			last = last->next;
+
+		last->next = entry;
+	}
+}
+
+static void ref_level_order_node(avl_tree_node *node,
+				 avl_queue_entry **queue_array,
+				 int level)
+{
+	if (!node)
+		return;
+
+	ref_add_queue_entry(node, &queue_array[level]);
+
+	ref_level_order_node(node->left, queue_array, level+1);
+	ref_level_order_node(node->right, queue_array, level+1);
+}
+
+static void ref_level_order(avl_tree *t,
+			    void (*visitor)(avl_tree_node *node, void *context, int level),
+			    void *context)
+{
+	avl_queue_entry **queue_array;
+	int32_t height;
+	int32_t i;
+
+	height = avl_tree_height(t);
+
+	if (!height)
+		return;
+
+	queue_array = (avl_queue_entry **)
+			calloc(height, sizeof(avl_queue_entry *));
+
+	ref_level_order_node(t->root, queue_array, 0);
+
+	for (i = 0 ; i < height ; ++i) {
+		avl_queue_entry *entry = queue_array[i];
+
+		while (entry) {
+			avl_queue_entry *trash;
+
+			visitor(entry->node, context, i);
+
+			trash = entry;
+			entry = entry->next;
+			free(trash);
+		}
+	}
+
+	free(queue_array);
+}
+
+/*
+** The recursive walks and destroy that avl.c used to have.
+*/
+static void ref_pre_order_node(avl_tree *t,
+			       void (*visitor)(avl_tree_node *node, void *context),
+			       void *context,
+			       avl_tree_node *node)
+{
+	if (!node)
+		return;
+
+	visitor(node, context);
+
+	ref_pre_order_node(t, visitor, context, node->left);
+	ref_pre_order_node(t, visitor, context, node->right);
+}
+
+static void ref_in_order_node(avl_tree *t,
+			      void (*visitor)(avl_tree_node *node, void *context),
+			      void *context,
+			      avl_tree_node *node)
+{
+	if (!node)
+		return;
+
+	ref_in_order_node(t, visitor, context, node->left);
+
+	visitor(node, context);
+
+	ref_in_order_node(t, visitor, context, node->right);
+}
+
+static void ref_post_order_node(avl_tree *t,
+				void (*visitor)(avl_tree_node *node, void *context),
+				void *context,
+				avl_tree_node *node)
+{
+	if (!node)
+		return;
+
+	ref_post_order_node(t, visitor, context, node->left);
+
+	ref_post_order_node(t, visitor, context, node->right);
+
+	visitor(node, context);
+}
+
+static void ref_destroy_node(avl_tree *t, avl_tree_node *node)
+{
+	if (!node)
+		return;
+
+	ref_destroy_node(t, node->left);
+	ref_destroy_node(t, node->right);
+
+	t->free_node(node);
+}
+
+static const uint64_t bench_sizes[] = { 1ULL << 10, 1ULL << 16, 1ULL << 20 };
+#define NUM_BENCH_SIZES (sizeof(bench_sizes) / sizeof(bench_sizes[0]))
+
+static void time_insert_remove(const char *name,
+			       int (*insert)(avl_tree *, void *),
+			       int (*remove)(avl_tree *, void *),
+			       int64_t *insert_keys,
+			       int64_t *remove_keys,
+			       uint64_t n)
+{
+	avl_tree t;
+	uint64_t start;
+	uint64_t mid;
+	uint64_t end;
+	uint64_t i;
+
+	bench_tree_init(&t);
+
+	start = now_ns();
+	for (i = 0 ; i < n ; ++i)
+		insert(&t, (void *) insert_keys[i]);
+	mid = now_ns();
+	for (i = 0 ; i < n ; ++i)
+		remove(&t, (void *) remove_keys[i]);
+	end = now_ns();
+
+	printf("  %-10s insert %8.1f ns/op   remove %8.1f ns/op\n",
+	       name, ns_per(start, mid, n), ns_per(mid, end, n));
+
+	avl_tree_destroy(&t);
+}
+
+static void bench_insert_remove(void)
+{
+	size_t s;
+
+	printf("insert_remove: random keys, iterative vs. recursive\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *insert_keys = shuffled_keys(n, 1);
+		int64_t *remove_keys = shuffled_keys(n, 2);
+
+		printf(" n=%llu\n", (unsigned long long) n);
+		time_insert_remove("iterative", avl_tree_insert, avl_tree_remove,
+				   insert_keys, remove_keys, n);
+		time_insert_remove("recursive", ref_insert, ref_remove,
+				   insert_keys, remove_keys, n);
+
+		free(insert_keys);
+		free(remove_keys);
+	}
+}
+
+static void count_compares(const char *name,
+			   int (*insert)(avl_tree *, void *),
+			   int64_t *keys,
+			   uint64_t n)
+{
+	avl_tree t;
+	uint64_t inserts;
+	uint64_t levels;
+	uint64_t i;
+
+	bench_tree_init(&t);
+	t.compare_items = bench_counting_compare;
+
+	// count the levels each insert descends through separately,
+	// with a plain search (which costs exactly one compare per level).
+	bench_compare_count = 0;
+	inserts = 0;
+	levels = 0;
+
+	for (i = 0 ; i < n ; ++i) {
+		uint64_t before = bench_compare_count;
+		uint64_t search;
+
+		avl_tree_find(&t, (void *) keys[i]);
+		search = bench_compare_count - before;
+		bench_compare_count = before;
+
+		inserts += insert(&t, (void *) keys[i]);
+		levels += search;
+	}
+
+	printf("  %-10s %6.2f compares/insert   %6.2f levels/insert\n",
+	       name,
+	       (double) bench_compare_count / (double) inserts,
+	       (double) levels / (double) inserts);
+
+	avl_tree_destroy(&t);
+}
+
+static void bench_compares(void)
+{
+	size_t s;
+
+	printf("compares: comparator calls per insert\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *keys = shuffled_keys(n, 1);
+		uint64_t i;
+
+		printf(" n=%llu, random keys\n", (unsigned long long) n);
+		count_compares("iterative", avl_tree_insert, keys, n);
+		count_compares("recursive", ref_insert, keys, n);
+
+		for (i = 0 ; i < n ; ++i)
+			keys[i] = (int64_t) i;
+
+		printf(" n=%llu, ascending keys\n", (unsigned long long) n);
+		count_compares("iterative", avl_tree_insert, keys, n);
+		count_compares("recursive", ref_insert, keys, n);
+
+		free(keys);
+	}
+}
+
+static void time_build_destroy(const char *name,
+			       avl_tree_node * (*allocate_node)(void *item),
+			       void (*free_node)(avl_tree_node * ),
+			       int64_t *keys,
+			       uint64_t n)
+{
+	avl_tree t;
+	uint64_t start;
+	uint64_t mid;
+	uint64_t end;
+	uint64_t i;
+
+	avl_tree_init(&t, allocate_node, free_node, bench_int_compare, NULL, NULL);
+
+	start = now_ns();
+	for (i = 0 ; i < n ; ++i)
+		avl_tree_insert(&t, (void *) keys[i]);
+	mid = now_ns();
+	avl_tree_destroy(&t);
+	end = now_ns();
+
+	printf("  %-10s insert %8.1f ns/op   destroy %8.1f ns/item\n",
+	       name, ns_per(start, mid, n), ns_per(mid, end, n));
+}
+
+static void bench_slab(void)
+{
+	size_t s;
+
+	printf("slab: random keys, malloc callbacks vs. built-in slab\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *keys = shuffled_keys(n, 1);
+
+		printf(" n=%llu\n", (unsigned long long) n);
+		time_build_destroy("malloc", bench_allocate_node, bench_free_node, keys, n);
+		time_build_destroy("slab", NULL, NULL, keys, n);
+
+		free(keys);
+	}
+}
+
+static void time_sorted_load(const char *name, int bulk,
+			     avl_tree_node * (*allocate_node)(void *item),
+			     void (*free_node)(avl_tree_node * ),
+			     int64_t *probes,
+			     uint64_t n)
+{
+	avl_tree t;
+	void **items;
+	uint64_t start;
+	uint64_t mid;
+	uint64_t end;
+	uint64_t found = 0;
+	uint64_t i;
+
+	items = (void **) malloc(n * sizeof(void *));
+	for (i = 0 ; i < n ; ++i)
+		items[i] = (void *) (int64_t) i;
+
+	avl_tree_init(&t, allocate_node, free_node, bench_int_compare, NULL, NULL);
+
+	start = now_ns();
+	if (bulk) {
+		avl_tree_build_sorted(&t, items, n);
+	} else {
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&t, items[i]);
+	}
+	mid = now_ns();
+	for (i = 0 ; i < n ; ++i)
+		found += avl_tree_find(&t, (void *) probes[i]) != NULL;
+	end = now_ns();
+
+	printf("  %-14s load %8.1f ns/item   height %2d   find %8.1f ns/op\n",
+	       name, ns_per(start, mid, n), avl_tree_height(&t), ns_per(mid, end, n));
+
+	if (found != n)
+		printf("  unexpected: found %llu\n", (unsigned long long) found);
+
+	avl_tree_destroy(&t);
+	free(items);
+}
+
+static void bench_build(void)
+{
+	size_t s;
+
+	printf("build: sorted input, avl_tree_insert() loop vs. avl_tree_build_sorted()\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *probes = shuffled_keys(n, 2);
+
+		printf(" n=%llu\n", (unsigned long long) n);
+		time_sorted_load("insert/malloc", 0, bench_allocate_node, bench_free_node, probes, n);
+		time_sorted_load("build/malloc", 1, bench_allocate_node, bench_free_node, probes, n);
+		time_sorted_load("insert/slab", 0, NULL, NULL, probes, n);
+		time_sorted_load("build/slab", 1, NULL, NULL, probes, n);
+
+		free(probes);
+	}
+}
+
+static void bench_batch(void)
+{
+	static const uint64_t batch_shifts[] = { 4, 8, 12, 14, 16, 18, 20 };
+	uint64_t n = 1ULL << 20;
+	int64_t *keys = shuffled_keys(n, 1);
+	int64_t *others = shuffled_keys(n, 2);
+	size_t b;
+
+	// The tree holds even keys; batches insert odd keys and remove even
+	// ones.
+	printf("batch: n=%llu, avl_tree_insert()/remove() loop vs. insert_batch()/remove_batch()\n",
+	       (unsigned long long) n);
+
+	for (b = 0 ; b < sizeof(batch_shifts) / sizeof(batch_shifts[0]) ; ++b) {
+		uint64_t m = 1ULL << batch_shifts[b];
+		void **inserts = (void **) malloc(m * sizeof(void *));
+		void **removes = (void **) malloc(m * sizeof(void *));
+		uint64_t mode;
+		uint64_t i;
+
+		for (i = 0 ; i < m ; ++i) {
+			inserts[i] = (void *) (others[i] * 2 + 1);
+			removes[i] = (void *) (others[i] * 2);
+		}
+
+		printf(" m=%llu (m/n = 1/%llu)\n", (unsigned long long) m,
+		       (unsigned long long) (n / m));
+
+		for (mode = 0 ; mode < 2 ; ++mode) {
+			avl_tree t;
+			uint64_t start;
+			uint64_t mid;
+			uint64_t end;
+			uint64_t changed = 0;
+
+			avl_tree_init(&t, NULL, NULL, bench_int_compare, NULL, NULL);
+			for (i = 0 ; i < n ; ++i)
+				avl_tree_insert(&t, (void *) (keys[i] * 2));
+
+			start = now_ns();
+			if (mode) {
+				changed += avl_tree_insert_batch(&t, inserts, m);
+			} else {
+				for (i = 0 ; i < m ; ++i)
+					changed += avl_tree_insert(&t, inserts[i]);
+			}
+			mid = now_ns();
+			if (mode) {
+				changed += avl_tree_remove_batch(&t, removes, m);
+			} else {
+				for (i = 0 ; i < m ; ++i)
+					changed += avl_tree_remove(&t, removes[i]);
+			}
+			end = now_ns();
+
+			printf("  %-6s insert %8.1f ns/item   remove %8.1f ns/item\n",
+			       mode ? "batch" : "loop", ns_per(start, mid, m), ns_per(mid, end, m));
+
+			if (changed != 2 * m)
+				printf("  unexpected: changed %llu\n", (unsigned long long) changed);
+
+			avl_tree_destroy(&t);
+		}
+
+		free(inserts);
+		free(removes);
+	}
+
+	free(keys);
+	free(others);
+}
+
+static void bench_insert_visitor(avl_tree_node *node, void *context)
+{
+	avl_tree_insert((avl_tree *) context, node->item);
+}
+
+static void bench_set_ops(void)
+{
+	static const uint64_t small_shifts[] = { 6, 10, 14, 18, 20 };
+	uint64_t n = 1ULL << 20;
+	int64_t *keys = shuffled_keys(n, 1);
+	int64_t *others = shuffled_keys(n, 2);
+	size_t b;
+
+	// The large tree holds even keys, the small one a mix of even and odd.
+	printf("set_ops: n=%llu, in-order walk + avl_tree_insert() vs. avl_tree_union()\n",
+	       (unsigned long long) n);
+
+	for (b = 0 ; b < sizeof(small_shifts) / sizeof(small_shifts[0]) ; ++b) {
+		uint64_t m = 1ULL << small_shifts[b];
+		uint64_t mode;
+		uint64_t i;
+
+		printf(" m=%llu\n", (unsigned long long) m);
+
+		for (mode = 0 ; mode < 4 ; ++mode) {
+			static const char *names[] = { "walk", "union", "intersect", "difference" };
+			avl_tree t1;
+			avl_tree t2;
+			uint64_t start;
+			uint64_t end;
+
+			avl_tree_init(&t1, bench_allocate_node, bench_free_node,
+				      bench_int_compare, NULL, NULL);
+			avl_tree_init(&t2, bench_allocate_node, bench_free_node,
+				      bench_int_compare, NULL, NULL);
+			for (i = 0 ; i < n ; ++i)
+				avl_tree_insert(&t1, (void *) (keys[i] * 2));
+			for (i = 0 ; i < m ; ++i)
+				avl_tree_insert(&t2, (void *) (others[i] * 2 + (i & 1)));
+
+			start = now_ns();
+			if (mode == 0)
+				avl_tree_in_order(&t2, bench_insert_visitor, &t1);
+			else if (mode == 1)
+				avl_tree_union(&t1, &t2);
+			else if (mode == 2)
+				avl_tree_intersection(&t1, &t2);
+			else
+				avl_tree_difference(&t1, &t2);
+			end = now_ns();
+
+			printf("  %-10s %10.1f us   result %llu items\n", names[mode],
+			       (end - start) / 1000.0,
+			       (unsigned long long) avl_tree_num_items(&t1));
+
+			avl_tree_destroy(&t1);
+			avl_tree_destroy(&t2);
+		}
+	}
+
+	free(keys);
+	free(others);
+}
+
+// Build, merge and tear down large trees with pools of 1, 2, 4, ...
+// threads, up to the number of processors online. "seq" is without a pool.
+static void bench_parallel(void)
+{
+	uint64_t n = 1ULL << 22;
+	long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	void **items = (void **) malloc(n * sizeof(void *));
+	int64_t *keys = shuffled_keys(n, 1);
+	long threads;
+	uint64_t i;
+
+	if (max_threads < 1)
+		max_threads = 1;
+
+	for (i = 0 ; i < n ; ++i)
+		items[i] = (void *) (int64_t) i;
+
+	printf("parallel: n=%llu, %ld processors online\n",
+	       (unsigned long long) n, max_threads);
+
+	for (threads = 0 ; threads <= max_threads ; threads = threads ? threads * 2 : 1) {
+		avl_pool *p = threads ? avl_pool_create((int) threads) : NULL;
+		avl_tree t1;
+		avl_tree t2;
+		uint64_t t_build;
+		uint64_t t_union;
+		uint64_t t_intersect;
+		uint64_t t_destroy;
+		uint64_t start;
+
+		avl_tree_init(&t1, bench_allocate_node, bench_free_node,
+			      bench_int_compare, NULL, NULL);
+		avl_tree_init(&t2, bench_allocate_node, bench_free_node,
+			      bench_int_compare, NULL, NULL);
+
+		start = now_ns();
+		avl_tree_build_sorted_parallel(p, &t1, items, n);
+		t_build = now_ns() - start;
+
+		// t2 holds every third key, inserted in random order
+		for (i = 0 ; i < n ; ++i)
+			if (!(keys[i] % 3))
+				avl_tree_insert(&t2, (void *) (keys[i] + n / 2));
+
+		start = now_ns();
+		avl_tree_union_parallel(p, &t1, &t2);
+		t_union = now_ns() - start;
+
+		for (i = 0 ; i < n ; ++i)
+			if (!(keys[i] % 5))
+				avl_tree_insert(&t2, (void *) keys[i]);
+
+		start = now_ns();
+		avl_tree_intersection_parallel(p, &t1, &t2);
+		t_intersect = now_ns() - start;
+
+		avl_tree_destroy(&t1);
+		avl_tree_build_sorted(&t1, items, n);
+
+		start = now_ns();
+		avl_tree_destroy_parallel(p, &t1);
+		t_destroy = now_ns() - start;
+
+		if (threads)
+			printf("  %2ld threads", threads);
+		else
+			printf("  %-10s", "seq");
+		printf("  build %7.1f ms   union %7.1f ms   intersect %7.1f ms   destroy %7.1f ms\n",
+		       t_build / 1e6, t_union / 1e6, t_intersect / 1e6, t_destroy / 1e6);
+
+		avl_tree_destroy(&t2);
+		if (p)
+			avl_pool_destroy(p);
+	}
+
+	free(items);
+	free(keys);
+}
+
+typedef struct _bench_mix {
+	avl_tree *t;               // under lock, or
+	avl_concurrent_tree *ct;   // on its own
+	pthread_mutex_t *lock;
+	uint64_t n;
+	uint64_t ops;
+	int write_percent;
+	uint64_t seed;
+} bench_mix;
+
+// Lookups of random even keys, all present, mixed with insertions and
+// removals of random odd keys.
+static void * bench_mix_thread(void *arg)
+{
+	bench_mix *m = (bench_mix *) arg;
+	uint64_t state = m->seed | 1;
+	uint64_t i;
+
+	for (i = 0 ; i < m->ops ; ++i) {
+		uint64_t r = bench_random(&state);
+		void *item = (void *) (int64_t) ((r >> 8) % m->n * 2);
+		int write = (int) (r % 100) < m->write_percent;
+
+		if (write)
+			item = (void *) ((int64_t) item + 1);
+
+		if (m->ct) {
+			if (!write)
+				avl_concurrent_tree_find(m->ct, item, NULL);
+			else if (!avl_concurrent_tree_insert(m->ct, item))
+				avl_concurrent_tree_remove(m->ct, item);
+		} else {
+			pthread_mutex_lock(m->lock);
+			if (!write)
+				avl_tree_find(m->t, item);
+			else if (!avl_tree_insert(m->t, item))
+				avl_tree_remove(m->t, item);
+			pthread_mutex_unlock(m->lock);
+		}
+	}
+
+	return NULL;
+}
+
+static void bench_concurrent(void)
+{
+	static const int write_percents[] = { 0, 1, 10, 50 };
+	uint64_t n = 1ULL << 20;
+	uint64_t ops = 1ULL << 18;
+	long max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int64_t *keys = shuffled_keys(n, 1);
+	size_t w;
+
+	if (max_threads < 4)
+		max_threads = 4;
+
+	printf("concurrent: n=%llu, %llu ops per thread, global mutex vs. avl_concurrent_tree\n",
+	       (unsigned long long) n, (unsigned long long) ops);
+
+	for (w = 0 ; w < sizeof(write_percents) / sizeof(write_percents[0]) ; ++w) {
+		long threads;
+
+		printf(" %d%% writes\n", write_percents[w]);
+
+		for (threads = 1 ; threads <= max_threads ; threads *= 2) {
+			bench_mix mixes[threads];
+			pthread_t tids[threads];
+			pthread_mutex_t lock;
+			avl_tree t;
+			avl_concurrent_tree ct;
+			double mops[2];
+			int mode;
+			long i;
+
+			for (mode = 0 ; mode < 2 ; ++mode) {
+				uint64_t start;
+				uint64_t end;
+				uint64_t j;
+
+				pthread_mutex_init(&lock, NULL);
+				avl_tree_init(&t, NULL, NULL, bench_int_compare, NULL, NULL);
+				avl_concurrent_tree_init(&ct, NULL, NULL, bench_int_compare);
+				for (j = 0 ; j < n ; ++j) {
+					if (mode)
+						avl_concurrent_tree_insert(&ct, (void *) (keys[j] * 2));
+					else
+						avl_tree_insert(&t, (void *) (keys[j] * 2));
+				}
+
+				for (i = 0 ; i < threads ; ++i) {
+					mixes[i].t = &t;
+					mixes[i].ct = mode ? &ct : NULL;
+					mixes[i].lock = &lock;
+					mixes[i].n = n;
+					mixes[i].ops = ops;
+					mixes[i].write_percent = write_percents[w];
+					mixes[i].seed = 1 + i;
+				}
+
+				start = now_ns();
+				for (i = 0 ; i < threads ; ++i)
+					pthread_create(&tids[i], NULL, bench_mix_thread, &mixes[i]);
+				for (i = 0 ; i < threads ; ++i)
+					pthread_join(tids[i], NULL);
+				end = now_ns();
+
+				mops[mode] = (double) (ops * threads) * 1e3 / (double) (end - start);
+
+				avl_tree_destroy(&t);
+				avl_concurrent_tree_destroy(&ct);
+				pthread_mutex_destroy(&lock);
+			}
+
+			printf("  %2ld threads   mutex %7.2f Mops/s   concurrent %7.2f Mops/s\n",
+			       threads, mops[0], mops[1]);
+		}
+	}
+
+	free(keys);
+}
+
+typedef struct _bench_object {
+	int64_t key;
+	avl_link link;
+} bench_object;
+
+static int64_t bench_object_compare(void *a, void *b)
+{
+	int64_t ia = ((bench_object *) a)->key;
+	int64_t ib = ((bench_object *) b)->key;
+	return (ia > ib) - (ia < ib);
+}
+
+static int64_t bench_link_compare(const void *key, const avl_link *link)
+{
+	int64_t a = *(const int64_t *) key;
+	int64_t b = avl_entry(link, bench_object, link)->key;
+	return (a > b) - (a < b);
+}
+
+static void bench_intrusive(void)
+{
+	size_t s;
+
+	printf("intrusive: find, items stored by pointer vs. embedded links\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *keys = shuffled_keys(n, 1);
+		int64_t *probes = shuffled_keys(n, 2);
+		bench_object **objects;
+		bench_object probe;
+		avl_tree t;
+		avl_root root;
+		uint64_t start;
+		uint64_t end;
+		uint64_t found;
+		uint64_t i;
+
+		// objects are allocated one by one, as a caller would
+		objects = (bench_object **) malloc(n * sizeof(bench_object *));
+		avl_tree_init(&t, bench_allocate_node, bench_free_node,
+			      bench_object_compare, NULL, NULL);
+		avl_root_init(&root);
+
+		for (i = 0 ; i < n ; ++i) {
+			objects[i] = (bench_object *) malloc(sizeof(bench_object));
+			objects[i]->key = keys[i];
+			avl_tree_insert(&t, objects[i]);
+			avl_link_insert(&root, &objects[i]->link,
+					&objects[i]->key, bench_link_compare);
+		}
+
+		printf(" n=%llu\n", (unsigned long long) n);
+
+		found = 0;
+		start = now_ns();
+		for (i = 0 ; i < n ; ++i) {
+			probe.key = probes[i];
+			found += avl_tree_find(&t, &probe) != NULL;
+		}
+		end = now_ns();
+		printf("  %-10s find %8.1f ns/op\n", "avl_tree", ns_per(start, end, n));
+
+		start = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			found += avl_link_find(&root, &probes[i], bench_link_compare) != NULL;
+		end = now_ns();
+		printf("  %-10s find %8.1f ns/op\n", "avl_link", ns_per(start, end, n));
+
+		if (found != 2 * n)
+			printf("  unexpected: found %llu\n", (unsigned long long) found);
+
+		avl_tree_destroy(&t);
+		for (i = 0 ; i < n ; ++i)
+			free(objects[i]);
+		free(objects);
+		free(keys);
+		free(probes);
+	}
+}
+
+static void bench_typed(void)
+{
+	size_t s;
+
+	printf("typed: int64 keys, generic tree vs. avl_int64_tree\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *keys = shuffled_keys(n, 1);
+		int64_t *probes = shuffled_keys(n, 2);
+		avl_tree t;
+		avl_int64_tree it;
+		uint64_t start;
+		uint64_t insert_end;
+		uint64_t find_end;
+		uint64_t end;
+		uint64_t found = 0;
+		uint64_t i;
+
+		printf(" n=%llu\n", (unsigned long long) n);
+
+		avl_tree_init(&t, NULL, NULL, bench_int_compare, NULL, NULL);
+
+		start = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&t, (void *) keys[i]);
+		insert_end = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			found += avl_tree_find(&t, (void *) probes[i]) != NULL;
+		find_end = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_remove(&t, (void *) probes[i]);
+		end = now_ns();
+
+		printf("  %-10s insert %7.1f   find %7.1f   remove %7.1f ns/op\n",
+		       "generic", ns_per(start, insert_end, n),
+		       ns_per(insert_end, find_end, n), ns_per(find_end, end, n));
+
+		avl_tree_destroy(&t);
+		avl_int64_tree_init(&it);
+
+		start = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			avl_int64_tree_insert(&it, keys[i]);
+		insert_end = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			found += avl_int64_tree_find(&it, probes[i]) != NULL;
+		find_end = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			avl_int64_tree_remove(&it, probes[i]);
+		end = now_ns();
+
+		printf("  %-10s insert %7.1f   find %7.1f   remove %7.1f ns/op\n",
+		       "typed", ns_per(start, insert_end, n),
+		       ns_per(insert_end, find_end, n), ns_per(find_end, end, n));
+
+		if (found != 2 * n)
+			printf("  unexpected: found %llu\n", (unsigned long long) found);
+
+		avl_int64_tree_destroy(&it);
+		free(keys);
+		free(probes);
+	}
+}
+
+static void bench_compact(void)
+{
+	size_t s;
+
+	printf("compact: random keys, avl_tree (slab) vs. avl_compact_tree\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *keys = shuffled_keys(n, 1);
+		int64_t *probes = shuffled_keys(n, 2);
+		avl_tree t;
+		avl_compact_tree ct;
+		uint64_t start;
+		uint64_t insert_end;
+		uint64_t end;
+		uint64_t found = 0;
+		uint64_t i;
+
+		printf(" n=%llu\n", (unsigned long long) n);
+
+		avl_tree_init(&t, NULL, NULL, bench_int_compare, NULL, NULL);
+
+		start = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&t, (void *) keys[i]);
+		insert_end = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			found += avl_tree_find(&t, (void *) probes[i]) != NULL;
+		end = now_ns();
+
+		printf("  %-10s insert %7.1f   find %7.1f ns/op   %3zu bytes/node\n",
+		       "avl_tree", ns_per(start, insert_end, n),
+		       ns_per(insert_end, end, n), sizeof(avl_tree_node));
+
+		avl_tree_destroy(&t);
+		avl_compact_tree_init(&ct, bench_int_compare);
+
+		start = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			avl_compact_tree_insert(&ct, (void *) keys[i]);
+		insert_end = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			found += avl_compact_tree_find(&ct, (void *) probes[i]) != NULL;
+		end = now_ns();
+
+		printf("  %-10s insert %7.1f   find %7.1f ns/op   %3zu bytes/node\n",
+		       "compact", ns_per(start, insert_end, n),
+		       ns_per(insert_end, end, n), sizeof(avl_compact_node));
+
+		if (found != 2 * n)
+			printf("  unexpected: found %llu\n", (unsigned long long) found);
+
+		avl_compact_tree_destroy(&ct);
+		free(keys);
+		free(probes);
+	}
+}
+
+static void bench_frozen(void)
+{
+	size_t s;
+
+	printf("frozen: random probes, live tree vs. frozen snapshot\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *keys = shuffled_keys(n, 1);
+		int64_t *probes = shuffled_keys(n, 2);
+		avl_tree t;
+		avl_frozen f;
+		uint64_t start;
+		uint64_t end;
+		uint64_t found = 0;
+		uint64_t i;
+		uint64_t pos;
+
+		printf(" n=%llu\n", (unsigned long long) n);
+
+		avl_tree_init(&t, bench_allocate_node, bench_free_node,
+			      bench_int_compare, NULL, NULL);
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&t, (void *) keys[i]);
+
+		start = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			found += avl_tree_find(&t, (void *) probes[i]) != NULL;
+		end = now_ns();
+		printf("  %-10s find %7.1f ns/op\n", "live", ns_per(start, end, n));
+
+		start = now_ns();
+		avl_tree_freeze(&t, &f);
+		end = now_ns();
+		printf("  %-10s      %7.1f ns/item\n", "freeze", ns_per(start, end, n));
+
+		start = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			found += avl_frozen_find(&f, (void *) probes[i]) != 0;
+		end = now_ns();
+		printf("  %-10s find %7.1f ns/op\n", "frozen", ns_per(start, end, n));
+
+		start = now_ns();
+		for (pos = avl_frozen_first(&f) ; pos ; pos = avl_frozen_next(&f, pos))
+			found += avl_frozen_item(&f, pos) != (void *) -1;
+		end = now_ns();
+		printf("  %-10s next %7.1f ns/item\n", "frozen", ns_per(start, end, n));
+
+		if (found != 3 * n)
+			printf("  unexpected: found %llu\n", (unsigned long long) found);
+
+		avl_frozen_destroy(&f);
+		avl_tree_destroy(&t);
+		free(keys);
+		free(probes);
+	}
+}
+
+static void bench_frozen_keys(void)
+{
+	static const char *isa_names[] = { "scalar", "sse4.2", "avx2" };
+	size_t s;
+
+	printf("frozen_keys: random int64 probes, implicit B-tree per instruction set\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *keys = shuffled_keys(n, 1);
+		int64_t *probes = shuffled_keys(n, 2);
+		uint64_t *slots = (uint64_t *) malloc(n * sizeof(uint64_t));
+		avl_tree t;
+		avl_frozen_keys k;
+		uint64_t start;
+		uint64_t mid;
+		uint64_t end;
+		uint64_t found = 0;
+		uint64_t i;
+		int isa;
+
+		printf(" n=%llu\n", (unsigned long long) n);
+
+		avl_tree_init(&t, NULL, NULL, bench_int_compare, NULL, NULL);
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&t, (void *) keys[i]);
+		avl_tree_freeze_keys(&t, &k, NULL);
+
+		for (isa = AVL_FROZEN_KEYS_SCALAR ; isa <= AVL_FROZEN_KEYS_AVX2 ; ++isa) {
+			if (!avl_frozen_keys_use(&k, isa)) {
+				printf("  %-10s not supported\n", isa_names[isa]);
+				continue;
+			}
+
+			start = now_ns();
+			for (i = 0 ; i < n ; ++i)
+				found += avl_frozen_keys_find(&k, probes[i]) != AVL_FROZEN_KEYS_NONE;
+			mid = now_ns();
+			avl_frozen_keys_find_batch(&k, probes, n, slots);
+			end = now_ns();
+
+			for (i = 0 ; i < n ; ++i)
+				found += slots[i] != AVL_FROZEN_KEYS_NONE;
+
+			printf("  %-10s find %7.1f ns/op   batch %7.1f ns/op\n",
+			       isa_names[isa], ns_per(start, mid, n), ns_per(mid, end, n));
+
+			if (found != 2 * n)
+				printf("  unexpected: found %llu\n", (unsigned long long) found);
+			found = 0;
+		}
+
+		avl_frozen_keys_destroy(&k);
+		avl_tree_destroy(&t);
+		free(slots);
+		free(keys);
+		free(probes);
+	}
+}
+
+static void bench_find_batch(void)
+{
+	static const uint64_t tree_sizes[] = { 1ULL << 16, 1ULL << 20, 1ULL << 23 };
+	static const uint64_t batch_sizes[] = { 1, 2, 4, 8, 16, 32, 64 };
+	size_t s;
+	size_t b;
+
+	printf("find_batch: random probes, avl_tree_find() vs. avl_tree_find_batch()\n");
+
+	for (s = 0 ; s < sizeof(tree_sizes) / sizeof(tree_sizes[0]) ; ++s) {
+		uint64_t n = tree_sizes[s];
+		uint64_t num_probes = 1ULL << 20;
+		int64_t *keys = shuffled_keys(n, 1);
+		int64_t *probes = shuffled_keys(n, 2);
+		avl_tree_node **results;
+		avl_tree t;
+		uint64_t start;
+		uint64_t end;
+		uint64_t found = 0;
+		uint64_t i;
+
+		if (num_probes > n)
+			num_probes = n;
+
+		results = (avl_tree_node **) malloc(num_probes * sizeof(avl_tree_node *));
+
+		avl_tree_init(&t, NULL, NULL, bench_int_compare, NULL, NULL);
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&t, (void *) keys[i]);
+
+		printf(" n=%llu (%llu MiB of nodes)\n", (unsigned long long) n,
+		       (unsigned long long) (n * sizeof(avl_tree_node) >> 20));
+
+		start = now_ns();
+		for (i = 0 ; i < num_probes ; ++i)
+			found += avl_tree_find(&t, (void *) probes[i]) != NULL;
+		end = now_ns();
+		printf("  %-10s %8.1f ns/op\n", "find", ns_per(start, end, num_probes));
+
+		for (b = 0 ; b < sizeof(batch_sizes) / sizeof(batch_sizes[0]) ; ++b) {
+			uint64_t batch = batch_sizes[b];
+
+			start = now_ns();
+			for (i = 0 ; i + batch <= num_probes ; i += batch)
+				avl_tree_find_batch(&t, (void **) (probes + i), batch, results + i);
+			end = now_ns();
+
+			printf("  batch %-4llu %8.1f ns/op\n", (unsigned long long) batch,
+			       ns_per(start, end, i));
+
+			while (i--)
+				found += results[i] != NULL;
+		}
+
+		if (found != num_probes * (1 + b))
+			printf("  unexpected: found %llu\n", (unsigned long long) found);
+
+		avl_tree_destroy(&t);
+		free(results);
+		free(keys);
+		free(probes);
+	}
+}
+
+static void bench_copy_visitor(avl_tree_node *node, void *context)
+{
+	void ***next = (void ***) context;
+	*(*next)++ = node->item;
+}
+
+static void bench_persistent(void)
+{
+	size_t s;
+
+	printf("persistent: copy vs. snapshot, and updates that copy their path\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *keys = shuffled_keys(n, 1);
+		uint64_t num_ops = n < 100000 ? n : 100000;
+		void **items = (void **) malloc(n * sizeof(void *));
+		void **next = items;
+		avl_tree t;
+		avl_tree copy;
+		avl_persistent_tree pt;
+		avl_persistent_tree snapshot;
+		uint64_t start;
+		uint64_t end;
+		uint64_t i;
+
+		printf(" n=%llu\n", (unsigned long long) n);
+
+		bench_tree_init(&t);
+		bench_tree_init(&copy);
+		avl_persistent_tree_init(&pt, bench_int_compare);
+		for (i = 0 ; i < n ; ++i) {
+			avl_tree_insert(&t, (void *) (keys[i] * 2));
+			avl_persistent_tree_insert(&pt, (void *) (keys[i] * 2));
+		}
+
+		start = now_ns();
+		avl_tree_in_order(&t, bench_copy_visitor, &next);
+		avl_tree_build_sorted(&copy, items, n);
+		end = now_ns();
+		printf("  %-22s %12.1f ns\n", "avl_tree copy", ns_per(start, end, 1));
+		avl_tree_destroy(&copy);
+
+		start = now_ns();
+		avl_persistent_tree_snapshot(&pt, &snapshot);
+		end = now_ns();
+		printf("  %-22s %12.1f ns\n", "persistent snapshot", ns_per(start, end, 1));
+		avl_persistent_tree_destroy(&snapshot);
+
+		start = now_ns();
+		for (i = 0 ; i < num_ops ; ++i) {
+			avl_tree_insert(&t, (void *) (keys[i] * 2 + 1));
+			avl_tree_remove(&t, (void *) (keys[i] * 2 + 1));
+		}
+		end = now_ns();
+		printf("  %-22s %12.1f ns/op\n", "avl_tree update", ns_per(start, end, 2 * num_ops));
+
+		start = now_ns();
+		for (i = 0 ; i < num_ops ; ++i) {
+			avl_persistent_tree_insert(&pt, (void *) (keys[i] * 2 + 1));
+			avl_persistent_tree_remove(&pt, (void *) (keys[i] * 2 + 1));
+		}
+		end = now_ns();
+		printf("  %-22s %12.1f ns/op\n", "persistent, unshared", ns_per(start, end, 2 * num_ops));
+
+		// a snapshot before each update, so every update copies its path
+		start = now_ns();
+		for (i = 0 ; i < num_ops ; ++i) {
+			avl_persistent_tree_snapshot(&pt, &snapshot);
+			avl_persistent_tree_insert(&pt, (void *) (keys[i] * 2 + 1));
+			avl_persistent_tree_destroy(&snapshot);
+			avl_persistent_tree_snapshot(&pt, &snapshot);
+			avl_persistent_tree_remove(&pt, (void *) (keys[i] * 2 + 1));
+			avl_persistent_tree_destroy(&snapshot);
+		}
+		end = now_ns();
+		printf("  %-22s %12.1f ns/op\n", "persistent, shared", ns_per(start, end, 2 * num_ops));
+
+		avl_persistent_tree_destroy(&pt);
+		avl_tree_destroy(&t);
+		free(items);
+		free(keys);
+	}
+}
+
+typedef struct _bench_page {
+	int64_t start;
+	uint64_t taken;
+	int64_t sum;
+} bench_page;
+
+// The callback way to read a page: walk everything, keep what fits.
+static void bench_page_visitor(avl_tree_node *node, void *context)
+{
+	bench_page *page = (bench_page *) context;
+
+	if ((int64_t) node->item >= page->start && page->taken < 100) {
+		page->sum += (int64_t) node->item;
+		++page->taken;
+	}
+}
+
+static void bench_iter(void)
+{
+	size_t s;
+
+	printf("iter: pages of 100 items from random keys, in-order walk vs. iterator\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *keys = shuffled_keys(n, 1);
+		uint64_t num_pages = n < 100000 ? 1000 : 20;
+		avl_tree t;
+		avl_tree_iter it;
+		avl_tree_node *node;
+		bench_page page;
+		int64_t walk_sum = 0;
+		int64_t iter_sum = 0;
+		uint64_t start;
+		uint64_t end;
+		uint64_t i;
+		uint64_t j;
+
+		bench_tree_init(&t);
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&t, (void *) keys[i]);
+
+		printf(" n=%llu\n", (unsigned long long) n);
+
+		start = now_ns();
+		for (i = 0 ; i < num_pages ; ++i) {
+			page.start = keys[i];
+			page.taken = 0;
+			page.sum = 0;
+			avl_tree_in_order(&t, bench_page_visitor, &page);
+			walk_sum += page.sum;
+		}
+		end = now_ns();
+		printf("  %-10s %12.1f ns/page\n", "in_order", ns_per(start, end, num_pages));
+
+		avl_tree_iter_init(&it, &t);
+		start = now_ns();
+		for (i = 0 ; i < num_pages ; ++i) {
+			node = avl_tree_iter_seek_lower_bound(&it, (void *) keys[i]);
+			for (j = 0 ; node && j < 100 ; ++j) {
+				iter_sum += (int64_t) node->item;
+				node = avl_tree_iter_next(&it);
+			}
+		}
+		end = now_ns();
+		printf("  %-10s %12.1f ns/page\n", "iterator", ns_per(start, end, num_pages));
+
+		if (walk_sum != iter_sum)
+			printf("  unexpected: sums differ\n");
+
+		avl_tree_destroy(&t);
+		free(keys);
+	}
+}
+
+static void bench_count_visitor(avl_tree_node *node, void *context)
+{
+	++*(uint64_t *) context;
+}
+
+static void bench_range_fill(avl_tree *t, int64_t *keys, uint64_t n)
+{
+	uint64_t i;
+
+	bench_tree_init(t);
+	for (i = 0 ; i < n ; ++i)
+		avl_tree_insert(t, (void *) keys[i]);
+}
+
+static void bench_range(void)
+{
+	size_t s;
+
+	printf("range: k items of [n/4, n/4 + k), filtered walk vs. range_visit, removes vs. range_remove\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *keys = shuffled_keys(n, 1);
+		uint64_t sizes[2] = { 100, n / 10 };
+		avl_tree t;
+		bench_page page;
+		uint64_t visited;
+		uint64_t start;
+		uint64_t end;
+		uint64_t i;
+		int k;
+
+		printf(" n=%llu\n", (unsigned long long) n);
+
+		for (k = 0 ; k < 2 ; ++k) {
+			int64_t lo = n / 4;
+			int64_t hi = lo + sizes[k];
+
+			bench_range_fill(&t, keys, n);
+
+			// the walk with an early cutoff of 100, as a best case
+			page.start = lo;
+			page.taken = 0;
+			page.sum = 0;
+			start = now_ns();
+			avl_tree_in_order(&t, bench_page_visitor, &page);
+			end = now_ns();
+			printf("  k=%-8llu %-13s %12.1f ns\n", (unsigned long long) sizes[k],
+			       "in_order", ns_per(start, end, 1));
+
+			visited = 0;
+			start = now_ns();
+			avl_tree_range_visit(&t, (void *) lo, (void *) hi, bench_count_visitor, &visited);
+			end = now_ns();
+			printf("  k=%-8llu %-13s %12.1f ns\n", (unsigned long long) sizes[k],
+			       "range_visit", ns_per(start, end, 1));
+
+			start = now_ns();
+			for (i = lo ; i < (uint64_t) hi ; ++i)
+				avl_tree_remove(&t, (void *) i);
+			end = now_ns();
+			printf("  k=%-8llu %-13s %12.1f ns\n", (unsigned long long) sizes[k],
+			       "remove loop", ns_per(start, end, 1));
+			avl_tree_destroy(&t);
+
+			bench_range_fill(&t, keys, n);
+			start = now_ns();
+			i = avl_tree_range_remove(&t, (void *) lo, (void *) hi);
+			end = now_ns();
+			printf("  k=%-8llu %-13s %12.1f ns\n", (unsigned long long) sizes[k],
+			       "range_remove", ns_per(start, end, 1));
+			avl_tree_destroy(&t);
+
+			if (visited != sizes[k] || i != sizes[k])
+				printf("  unexpected: visited %llu, removed %llu\n",
+				       (unsigned long long) visited, (unsigned long long) i);
+		}
+
+		free(keys);
+	}
+}
+
+static void bench_level_visitor(avl_tree_node *node, void *context, int level)
+{
+	*(uint64_t *) context += level;
+}
+
+static void bench_level_order(void)
+{
+	size_t s;
+
+	printf("level_order: linked queues (old) vs. ring buffer\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *keys = shuffled_keys(n, 1);
+		uint64_t old_sum = 0;
+		uint64_t new_sum = 0;
+		uint64_t start;
+		uint64_t end;
+		avl_tree t;
+		uint64_t i;
+
+		bench_tree_init(&t);
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&t, (void *) keys[i]);
+
+		printf(" n=%llu\n", (unsigned long long) n);
+
+		// The old version is quadratic in the width of each level.
+		if (n <= (1ULL << 16)) {
+			start = now_ns();
+			ref_level_order(&t, bench_level_visitor, &old_sum);
+			end = now_ns();
+			printf("  %-10s %10.1f ns/node\n", "old", ns_per(start, end, n));
+		} else {
+			printf("  %-10s %10s\n", "old", "(skipped)");
+		}
+
+		start = now_ns();
+		avl_tree_level_order(&t, bench_level_visitor, &new_sum);
+		end = now_ns();
+		printf("  %-10s %10.1f ns/node   queue %llu pointers\n", "new",
+		       ns_per(start, end, n),
+		       (unsigned long long) avl_tree_level_order_scratch_size(&t));
+
+		if (old_sum && old_sum != new_sum)
+			printf("  unexpected: level sums differ\n");
+
+		avl_tree_destroy(&t);
+		free(keys);
+	}
+}
+
+static void bench_sum_visitor(avl_tree_node *node, void *context)
+{
+	*(int64_t *) context += (int64_t) node->item;
+}
+
+static void bench_walk(void)
+{
+	static const char *names[3] = { "pre_order", "in_order", "post_order" };
+	void (*refs[3])(avl_tree *, void (*)(avl_tree_node *, void *), void *,
+			avl_tree_node *) = {
+		ref_pre_order_node, ref_in_order_node, ref_post_order_node
+	};
+	void (*walks[3])(avl_tree *, void (*)(avl_tree_node *, void *), void *) = {
+		avl_tree_pre_order, avl_tree_in_order, avl_tree_post_order
+	};
+	size_t s;
+
+	printf("walk: recursive vs. iterative walks and destroy\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *keys = shuffled_keys(n, 1);
+		int64_t ref_sum = 0;
+		int64_t sum = 0;
+		uint64_t start;
+		uint64_t mid;
+		uint64_t end;
+		avl_tree t;
+		uint64_t i;
+		int w;
+
+		bench_tree_init(&t);
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&t, (void *) keys[i]);
+
+		printf(" n=%llu\n", (unsigned long long) n);
+
+		for (w = 0 ; w < 3 ; ++w) {
+			start = now_ns();
+			refs[w](&t, bench_sum_visitor, &ref_sum, t.root);
+			mid = now_ns();
+			walks[w](&t, bench_sum_visitor, &sum);
+			end = now_ns();
+			printf("  %-10s recursive %6.2f   iterative %6.2f ns/node\n",
+			       names[w], ns_per(start, mid, n), ns_per(mid, end, n));
+		}
+
+		start = now_ns();
+		ref_destroy_node(&t, t.root);
+		end = now_ns();
+		t.root = NULL;
+
+		bench_tree_init(&t);
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&t, (void *) keys[i]);
+
+		mid = now_ns();
+		avl_tree_destroy(&t);
+		printf("  %-10s recursive %6.2f   vine      %6.2f ns/node\n",
+		       "destroy", ns_per(start, end, n), ns_per(mid, now_ns(), n));
+
+		if (sum != ref_sum)
+			printf("  unexpected: sums differ\n");
+
+		free(keys);
+	}
+}
+
+static void bench_foreach(void)
+{
+	size_t s;
+
+	printf("foreach: summing items, callback walk vs. inline loop\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		uint64_t reps = n < 100000 ? 200 : 4;
+		int64_t walk_sum = 0;
+		int64_t loop_sum = 0;
+		avl_tree_node *node;
+		uint64_t start;
+		uint64_t mid;
+		uint64_t end;
+		avl_tree t;
+		uint64_t i;
+
+		// built in order, so that the nodes are laid out in order and
+		// the walk is not dominated by cache misses
+		avl_tree_init(&t, NULL, NULL, bench_int_compare, NULL, NULL);
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&t, (void *) i);
+
+		printf(" n=%llu\n", (unsigned long long) n);
+
+		start = now_ns();
+		for (i = 0 ; i < reps ; ++i)
+			avl_tree_pre_order(&t, bench_sum_visitor, &walk_sum);
+		mid = now_ns();
+		for (i = 0 ; i < reps ; ++i)
+			AVL_FOREACH_PRE_ORDER(&t, node)
+				loop_sum += (int64_t) node->item;
+		end = now_ns();
+		printf("  %-10s callback %6.2f   inline %6.2f ns/node\n", "pre_order",
+		       ns_per(start, mid, n * reps), ns_per(mid, end, n * reps));
+
+		start = now_ns();
+		for (i = 0 ; i < reps ; ++i)
+			avl_tree_in_order(&t, bench_sum_visitor, &walk_sum);
+		mid = now_ns();
+		for (i = 0 ; i < reps ; ++i)
+			AVL_FOREACH_IN_ORDER(&t, node)
+				loop_sum += (int64_t) node->item;
+		end = now_ns();
+		printf("  %-10s callback %6.2f   inline %6.2f ns/node\n", "in_order",
+		       ns_per(start, mid, n * reps), ns_per(mid, end, n * reps));
+
+		start = now_ns();
+		for (i = 0 ; i < reps ; ++i)
+			avl_tree_post_order(&t, bench_sum_visitor, &walk_sum);
+		mid = now_ns();
+		for (i = 0 ; i < reps ; ++i)
+			AVL_FOREACH_POST_ORDER(&t, node)
+				loop_sum += (int64_t) node->item;
+		end = now_ns();
+		printf("  %-10s callback %6.2f   inline %6.2f ns/node\n", "post_order",
+		       ns_per(start, mid, n * reps), ns_per(mid, end, n * reps));
+
+		if (walk_sum != loop_sum)
+			printf("  unexpected: sums differ\n");
+
+		avl_tree_destroy(&t);
+	}
+}
+
+static void bench_interval_visitor(avl_interval *interval, void *context)
+{
+	++*(uint64_t *) context;
+}
+
+static void bench_interval(void)
+{
+	size_t s;
+
+	printf("interval: inserts with and without the hook, overlap queries vs. a full scan\n");
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *keys = shuffled_keys(n, 1);
+		avl_interval *intervals = (avl_interval *) malloc(n * sizeof(avl_interval));
+		uint64_t num_queries = n < 100000 ? 1000 : 100;
+		uint64_t scan_found = 0;
+		uint64_t found = 0;
+		avl_tree_node *node;
+		uint64_t start;
+		uint64_t end;
+		avl_tree t;
+		uint64_t i;
+
+		// intervals of length up to 64 starting at 0, 4, 8, ...
+		for (i = 0 ; i < n ; ++i) {
+			intervals[i].lo = keys[i] * 4;
+			intervals[i].hi = intervals[i].lo + (keys[i] * 7919) % 64 + 1;
+			intervals[i].data = NULL;
+		}
+
+		printf(" n=%llu\n", (unsigned long long) n);
+
+		avl_tree_init(&t, NULL, NULL, avl_interval_compare, NULL, NULL);
+		start = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&t, &intervals[i]);
+		end = now_ns();
+		printf("  %-14s %10.1f ns/op\n", "insert", ns_per(start, end, n));
+		avl_tree_destroy(&t);
+
+		avl_interval_tree_init(&t, NULL, NULL);
+		start = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&t, &intervals[i]);
+		end = now_ns();
+		printf("  %-14s %10.1f ns/op\n", "insert, hook", ns_per(start, end, n));
+
+		start = now_ns();
+		for (i = 0 ; i < num_queries ; ++i) {
+			int64_t lo = keys[i] * 4;
+			AVL_FOREACH_IN_ORDER(&t, node) {
+				avl_interval *interval = (avl_interval *) node->item;
+				scan_found += interval->lo < lo + 16 && lo < interval->hi;
+			}
+		}
+		end = now_ns();
+		printf("  %-14s %10.1f ns/query\n", "scan", ns_per(start, end, num_queries));
+
+		start = now_ns();
+		for (i = 0 ; i < num_queries ; ++i)
+			avl_interval_tree_overlaps(&t, keys[i] * 4, keys[i] * 4 + 16,
+						   bench_interval_visitor, &found);
+		end = now_ns();
+		printf("  %-14s %10.1f ns/query\n", "overlaps", ns_per(start, end, num_queries));
+
+		if (found != scan_found)
+			printf("  unexpected: found %llu, scan found %llu\n",
+			       (unsigned long long) found, (unsigned long long) scan_found);
+
+		avl_tree_destroy(&t);
+		free(intervals);
+		free(keys);
+	}
+}
+
+typedef struct _benchmark {
+	const char *name;
+	void (*run)(void);
+} benchmark;
+
+static void bench_image(void)
+{
+	char path[] = "/tmp/avl_bench_image_XXXXXX";
+	size_t s;
+	int fd;
+
+	printf("image: rebuilding by insertion vs. saving and mapping an image\n");
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		printf("  cannot create %s\n", path);
+		return;
+	}
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *keys = shuffled_keys(n, 1);
+		uint64_t found = 0;
+		avl_image img;
+		uint64_t start;
+		uint64_t end;
+		avl_tree t;
+		uint64_t i;
+		int64_t k;
+
+		printf(" n=%llu\n", (unsigned long long) n);
+
+		bench_tree_init(&t);
+		start = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&t, (void *) keys[i]);
+		end = now_ns();
+		printf("  %-14s %10.1f ns/item\n", "insert", ns_per(start, end, n));
+
+		if (ftruncate(fd, 0) || lseek(fd, 0, SEEK_SET)) {
+			printf("  cannot truncate %s\n", path);
+			break;
+		}
+		start = now_ns();
+		if (!avl_tree_save(&t, fd, sizeof(int64_t), NULL))
+			printf("  save failed\n");
+		end = now_ns();
+		printf("  %-14s %10.1f ns/item\n", "save", ns_per(start, end, n));
+
+		start = now_ns();
+		if (!avl_tree_load_mmap(&img, path, NULL, 1))
+			printf("  load failed\n");
+		end = now_ns();
+		printf("  %-14s %10.1f ns/item\n", "load, verify", ns_per(start, end, n));
+		avl_image_close(&img);
+
+		start = now_ns();
+		if (!avl_tree_load_mmap(&img, path, NULL, 0))
+			printf("  load failed\n");
+		end = now_ns();
+		printf("  %-14s %10.1f ns/item\n", "load", ns_per(start, end, n));
+
+		start = now_ns();
+		for (i = 0 ; i < n ; ++i)
+			found += avl_tree_find(&t, (void *) keys[i]) != NULL;
+		end = now_ns();
+		printf("  %-14s %10.1f ns/op\n", "find, tree", ns_per(start, end, n));
+
+		start = now_ns();
+		for (i = 0 ; i < n ; ++i) {
+			k = keys[i];
+			found += avl_image_find(&img, &k) != NULL;
+		}
+		end = now_ns();
+		printf("  %-14s %10.1f ns/op\n", "find, image", ns_per(start, end, n));
+
+		if (found != 2 * n)
+			printf("  unexpected: found %llu of %llu\n",
+			       (unsigned long long) found, (unsigned long long) (2 * n));
+
+		avl_image_close(&img);
+		avl_tree_destroy(&t);
+		free(keys);
+	}
+
+	close(fd);
+	unlink(path);
+}
+
+static void bench_collect_visitor(avl_tree_node *node, void *context)
+{
+	void ***next = (void ***) context;
+	*(*next)++ = node->item;
+}
+
+static void bench_stream(void)
+{
+	char path[] = "/tmp/avl_bench_stream_XXXXXX";
+	size_t s;
+	int fd;
+
+	printf("stream: copying a tree by export and import vs. buffering the items\n");
+
+	fd = mkstemp(path);
+	if (fd < 0) {
+		printf("  cannot create %s\n", path);
+		return;
+	}
+
+	for (s = 0 ; s < NUM_BENCH_SIZES ; ++s) {
+		uint64_t n = bench_sizes[s];
+		int64_t *keys = shuffled_keys(n, 1);
+		void **items = (void **) malloc(n * sizeof(void *));
+		void **next;
+		uint64_t start;
+		uint64_t end;
+		avl_tree copy;
+		avl_tree t;
+		uint64_t i;
+
+		printf(" n=%llu\n", (unsigned long long) n);
+
+		bench_tree_init(&t);
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&t, (void *) keys[i]);
+
+		bench_tree_init(&copy);
+		start = now_ns();
+		next = items;
+		avl_tree_in_order(&t, bench_collect_visitor, &next);
+		for (i = 0 ; i < n ; ++i)
+			avl_tree_insert(&copy, items[i]);
+		end = now_ns();
+		printf("  %-14s %10.1f ns/item\n", "insert", ns_per(start, end, n));
+		avl_tree_destroy(&copy);
+
+		bench_tree_init(&copy);
+		start = now_ns();
+		next = items;
+		avl_tree_in_order(&t, bench_collect_visitor, &next);
+		avl_tree_build_sorted(&copy, items, n);
+		end = now_ns();
+		printf("  %-14s %10.1f ns/item\n", "build_sorted", ns_per(start, end, n));
+		avl_tree_destroy(&copy);
+
+		if (ftruncate(fd, 0) || lseek(fd, 0, SEEK_SET)) {
+			printf("  cannot truncate %s\n", path);
+			break;
+		}
+		start = now_ns();
+		if (!avl_tree_export(&t, fd, sizeof(int64_t), NULL))
+			printf("  export failed\n");
+		end = now_ns();
+		printf("  %-14s %10.1f ns/item\n", "export", ns_per(start, end, n));
+
+		bench_tree_init(&copy);
+		lseek(fd, 0, SEEK_SET);
+		start = now_ns();
+		if (!avl_tree_import(&copy, fd, NULL, NULL))
+			printf("  import failed\n");
+		end = now_ns();
+		printf("  %-14s %10.1f ns/item\n", "import", ns_per(start, end, n));
+
+		if (avl_tree_num_items(&copy) != n)
+			printf("  unexpected: imported %llu of %llu\n",
+			       (unsigned long long) avl_tree_num_items(&copy),
+			       (unsigned long long) n);
+
+		avl_tree_destroy(&copy);
+		avl_tree_destroy(&t);
+		free(items);
+		free(keys);
+	}
+
+	close(fd);
+	unlink(path);
+}
+
+static const benchmark benchmarks[] = {
+	{ "insert_remove", bench_insert_remove },
+	{ "compares",      bench_compares      },
+	{ "slab",          bench_slab          },
+	{ "intrusive",     bench_intrusive     },
+	{ "typed",         bench_typed         },
+	{ "compact",       bench_compact       },
+	{ "frozen",        bench_frozen        },
+	{ "frozen_keys",   bench_frozen_keys   },
+	{ "find_batch",    bench_find_batch    },
+	{ "build",         bench_build         },
+	{ "batch",         bench_batch         },
+	{ "set_ops",       bench_set_ops       },
+	{ "parallel",      bench_parallel      },
+	{ "concurrent",    bench_concurrent    },
+	{ "persistent",    bench_persistent    },
+	{ "iter",          bench_iter          },
+	{ "range",         bench_range         },
+	{ "level_order",   bench_level_order   },
+	{ "walk",          bench_walk          },
+	{ "foreach",       bench_foreach       },
+	{ "interval",      bench_interval      },
+	{ "image",         bench_image         },
+	{ "stream",        bench_stream        },
+};
+#define NUM_BENCHMARKS (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+// Run the benchmarks named on the command line, or all of them.
+int main(int argc, char *argv[])
+{
+	size_t b;
+	int i;
+
+	if (argc < 2) {
+		for (b = 0 ; b < NUM_BENCHMARKS ; ++b)
+			benchmarks[b].run();
+		return 0;
+	}
+
+	for (i = 1 ; i < argc ; ++i) {
+		for (b = 0 ; b < NUM_BENCHMARKS ; ++b) {
+			if (!strcmp(argv[i], benchmarks[b].name)) {
+				benchmarks[b].run();
+				break;
+			}
+		}
+		if (b == NUM_BENCHMARKS) {
+			fprintf(stderr, "unknown benchmark: %s\n", argv[i]);
+			return 1;
+		}
+	}
+
+	return 0;
+}
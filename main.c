@@ -18,10 +18,22 @@
 */
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <assert.h>
+#include <unistd.h>
 
 #include "avl.h"
 #include "avl_util.h"
+#include "avl_link.h"
+#include "avl_typed.h"
+#include "avl_compact.h"
+#include "avl_frozen.h"
+#include "avl_pool.h"
+#include "avl_concurrent.h"
+#include "avl_persistent.h"
+#include "avl_foreach.h"
+#include "avl_interval.h"
+#include "avl_image.h"
 
 #define mymin(a, b)            \
 ({                             \
@@ -48,6 +60,18 @@ avl_tree_node * my_allocate_avl_node(void *item)
 	return node;
 }
 
+// big enough for order statistics mode
+avl_tree_node * my_allocate_counted_avl_node(void *item)
+{
+	avl_tree_node *node = (avl_tree_node *)
+				calloc(1, sizeof(avl_tree_counted_node));
+	if (node) {
+		node->item = item;
+	}
+
+	return node;
+}
+
 avl_queue_entry * my_allocate_avl_entry(avl_tree_node *node)
 {
 	avl_queue_entry *entry = (avl_queue_entry *)
@@ -72,7 +96,8 @@ int64_t my_int_compare(void *a, void *b)
 {
 	int64_t ia = (int64_t) a;
 	int64_t ib = (int64_t) b;
-	return ia - ib;
+	// ia - ib would overflow for keys far apart
+	return (ia > ib) - (ia < ib);
 }
 
 void print_tree_item(avl_tree_node *node, void *context, int level)
@@ -236,32 +261,39 @@ void free_randomizer(int_randomizer *r)
 	free(r);
 }
 
-int brute_force_height(avl_tree_node *node)
+// Checks every node: ordering, stored height and balance.
+// Returns the height of the subtree, or -1 if it is not an AVL tree.
+int checked_height(avl_tree *t, avl_tree_node *node)
 {
+	int left_height;
+	int right_height;
+
 	if (!node)
 		return 0;
-	return 1 + mymax(brute_force_height(node->left),
-			 brute_force_height(node->right));
-}
 
-int is_avl_tree(avl_tree *t)
-{
-	int left_height;
-	int right_height;
+	if (node->left && t->compare_items(node->left->item, node->item) >= 0)
+		return -1;
+	if (node->right && t->compare_items(node->right->item, node->item) <= 0)
+		return -1;
 
-	int max_height;
-	int min_height;
+	left_height = checked_height(t, node->left);
+	right_height = checked_height(t, node->right);
 
-	if (!t->root)
-		return 1;
+	if (left_height < 0 || right_height < 0)
+		return -1;
 
-	left_height = brute_force_height(t->root->left);
-	right_height = brute_force_height(t->root->right);
+	if ((mymax(left_height, right_height) - mymin(left_height, right_height)) > 1)
+		return -1;
 
-	max_height = mymax(left_height, right_height);
-	min_height = mymin(left_height, right_height);
+	if (node->height != 1 + mymax(left_height, right_height))
+		return -1;
+
+	return node->height;
+}
 
-	return (max_height - min_height) <= 1;
+int is_avl_tree(avl_tree *t)
+{
+	return checked_height(t, t->root) >= 0;
 }
 
 void insert_and_remove_stress(void)
@@ -297,7 +329,7 @@ void insert_and_remove_stress(void)
 				item = get_random(r);
 				avl_tree_insert(&t, (void *) (int64_t) item);
 				assert(is_avl_tree(&t));
-				assert(avl_tree_num_items(&t) == (uint32_t)i+1);
+				assert(avl_tree_num_items(&t) == (uint64_t)i+1);
 			}
 
 			reset_randomizer(r);
@@ -307,7 +339,7 @@ void insert_and_remove_stress(void)
 				item = get_random(r);
 				avl_tree_remove(&t, (void *) (int64_t) item);
 				assert(is_avl_tree(&t));
-				assert(avl_tree_num_items(&t) == ((uint32_t)num_items - ((uint32_t)i+1)));
+				assert(avl_tree_num_items(&t) == ((uint64_t)num_items - ((uint64_t)i+1)));
 			}
 
 			free_randomizer(r);
@@ -322,113 +354,2532 @@ void insert_and_remove_stress(void)
 	avl_tree_destroy(&t);
 }
 
-typedef struct _visit_sequence {
+uint64_t brute_force_size(avl_tree_node *node)
+{
+	if (!node)
+		return 0;
+	return 1 + brute_force_size(node->left) + brute_force_size(node->right);
+}
+
+int sizes_are_valid(avl_tree_node *node)
+{
+	if (!node)
+		return 1;
+	return avl_tree_size_node(node) == brute_force_size(node) &&
+	       sizes_are_valid(node->left) &&
+	       sizes_are_valid(node->right);
+}
+
+void order_statistics_stress(void)
+{
+	avl_tree t;
+	int max_items = 128;
+	int num_items;
+	int item;
 	int i;
-	int item_sequence[3];
-} visit_sequence;
 
-void sequence_visitor(avl_tree_node *node, void *context)
+	for (num_items = 1 ; num_items < max_items ; ++num_items) {
+		int_randomizer *r;
+
+		avl_tree_init(&t,
+			      my_allocate_counted_avl_node,
+			      my_free_avl_node,
+			      my_int_compare,
+			      my_allocate_avl_entry,
+			      my_free_avl_entry);
+		avl_tree_set_node_size(&t, sizeof(avl_tree_counted_node));
+
+		assert(!avl_tree_select(&t, 0));
+		assert(0 == avl_tree_rank(&t, (void *) 0));
+
+		r = allocate_randomizer(num_items);
+
+		// enable the mode half way through populating the tree
+		for (i = 0 ; i < num_items ; ++i) {
+			if (i == num_items / 2)
+				assert(avl_tree_enable_order_statistics(&t));
+			item = get_random(r);
+			avl_tree_insert(&t, (void *) (int64_t) (item * 2));
+		}
+		assert(sizes_are_valid(t.root));
+
+		// items are 0, 2, 4, ...
+		for (i = 0 ; i < num_items ; ++i) {
+			assert(avl_tree_select(&t, i)->item == (void *) (int64_t) (i * 2));
+			assert(avl_tree_rank(&t, (void *) (int64_t) (i * 2)) == (uint64_t) i);
+			assert(avl_tree_rank(&t, (void *) (int64_t) (i * 2 + 1)) == (uint64_t) i + 1);
+		}
+		assert(!avl_tree_select(&t, num_items));
+		assert(avl_tree_count_range(&t, (void *) -1, (void *) (int64_t) (num_items * 2)) ==
+		       (uint64_t) num_items);
+		assert(avl_tree_count_range(&t, (void *) 2, (void *) 7) ==
+		       (uint64_t) mymax(0, mymin(num_items - 1, 3)));
+		assert(0 == avl_tree_count_range(&t, (void *) 7, (void *) 2));
+
+		reset_randomizer(r);
+
+		// remove all but one item, randomly
+		for (i = 0 ; i < num_items - 1 ; ++i) {
+			item = get_random(r);
+			avl_tree_remove(&t, (void *) (int64_t) (item * 2));
+			assert(sizes_are_valid(t.root));
+		}
+		assert(1 == avl_tree_size_node(t.root));
+
+		free_randomizer(r);
+		avl_tree_destroy(&t);
+	}
+
+	// only trees in the mode pay for the counts: a slab tree moves to
+	// counted nodes when the mode is turned on
+	assert(sizeof(avl_tree_node) < sizeof(avl_tree_counted_node));
+	avl_tree_init(&t, NULL, NULL, my_int_compare, NULL, NULL);
+	for (i = 0 ; i < 1000 ; ++i) {
+		if (i == 500) {
+			assert(t.slab.node_size == sizeof(avl_tree_node));
+			assert(avl_tree_enable_order_statistics(&t));
+			assert(t.slab.node_size == sizeof(avl_tree_counted_node));
+			assert(is_avl_tree(&t) && sizes_are_valid(t.root));
+		}
+		assert(avl_tree_insert(&t, (void *) (int64_t) (999 - i)));
+	}
+	assert(is_avl_tree(&t) && sizes_are_valid(t.root));
+	for (i = 0 ; i < 1000 ; ++i)
+		assert(avl_tree_select(&t, i)->item == (void *) (int64_t) i);
+	avl_tree_destroy(&t);
+
+	// an allocator of plain nodes has no room for the counts, so the
+	// mode is refused and the tree goes on without it
+	avl_tree_init(&t,
+		      my_allocate_avl_node,
+		      my_free_avl_node,
+		      my_int_compare,
+		      my_allocate_avl_entry,
+		      my_free_avl_entry);
+	for (i = 0 ; i < 100 ; ++i)
+		assert(avl_tree_insert(&t, (void *) (int64_t) i));
+	assert(!avl_tree_enable_order_statistics(&t));
+	assert(!t.order_statistics && !avl_tree_select(&t, 0));
+	for (i = 100 ; i < 200 ; ++i)
+		assert(avl_tree_insert(&t, (void *) (int64_t) i));
+	assert(is_avl_tree(&t) && avl_tree_num_items(&t) == 200);
+	avl_tree_destroy(&t);
+}
+
+static uint64_t compare_count;
+
+int64_t my_counting_compare(void *a, void *b)
 {
-	visit_sequence *seq = (visit_sequence *) context;
-	assert(seq->item_sequence[seq->i++] == (int) (int64_t) node->item);
+	++compare_count;
+	return my_int_compare(a, b);
 }
 
-void sequence_visitor_level(avl_tree_node *node, void *context, int level)
+// The number of nodes visited while searching for item.
+int search_depth(avl_tree *t, void *item)
 {
-	visit_sequence *seq = (visit_sequence *) context;
-	(void) level;
-	assert(seq->item_sequence[seq->i++] == (int) (int64_t) node->item);
+	avl_tree_node *node = t->root;
+	int depth = 0;
+
+	while (node) {
+		++depth;
+		if ((int64_t) item < (int64_t) node->item)
+			node = node->left;
+		else if ((int64_t) item > (int64_t) node->item)
+			node = node->right;
+		else
+			break;
+	}
+
+	return depth;
 }
 
-void other_coverage(void)
+void compare_count_insert_remove(void)
 {
 	avl_tree t;
-	avl_tree_node *n;
-	visit_sequence seq;
+	int_randomizer *r;
+	int num_items = 1000;
+	int depth;
+	int item;
 	int i;
 
-	avl_tree_init(&t, 
+	avl_tree_init(&t,
 		      my_allocate_avl_node,
 		      my_free_avl_node,
+		      my_counting_compare,
+		      my_allocate_avl_entry,
+		      my_free_avl_entry);
+
+	r = allocate_randomizer(num_items);
+
+	// exactly one comparison per level, rotations included
+	for (i = 0 ; i < num_items ; ++i) {
+		item = get_random(r);
+		depth = search_depth(&t, (void *) (int64_t) item);
+		compare_count = 0;
+		assert(avl_tree_insert(&t, (void *) (int64_t) item));
+		assert(compare_count == (uint64_t) depth);
+	}
+
+	reset_randomizer(r);
+
+	for (i = 0 ; i < num_items ; ++i) {
+		item = get_random(r);
+		depth = search_depth(&t, (void *) (int64_t) item);
+		compare_count = 0;
+		assert(avl_tree_remove(&t, (void *) (int64_t) item));
+		assert(compare_count == (uint64_t) depth);
+	}
+
+	free_randomizer(r);
+	avl_tree_destroy(&t);
+}
+
+void slab_insert_remove(void)
+{
+	avl_tree t;
+	avl_tree_node *n;
+	int_randomizer *r;
+	int num_items = 1000;
+	int item;
+	int i;
+
+	// NULL allocate_node and free_node select the built-in slab.
+	avl_tree_init(&t,
+		      NULL,
+		      NULL,
 		      my_int_compare,
 		      my_allocate_avl_entry,
 		      my_free_avl_entry);
-	assert(!t.root);
 
+	r = allocate_randomizer(num_items);
+
+	for (i = 0 ; i < num_items ; ++i) {
+		item = get_random(r);
+		assert(avl_tree_insert(&t, (void *) (int64_t) item));
+		assert(is_avl_tree(&t));
+	}
+	assert(avl_tree_num_items(&t) == (uint64_t) num_items);
+
+	// a removed node is the next one handed out
+	n = avl_tree_find(&t, (void *) 5);
+	assert(avl_tree_remove(&t, (void *) 5));
+	assert(avl_tree_insert(&t, (void *) (int64_t) num_items));
+	assert(avl_tree_find(&t, (void *) (int64_t) num_items) == n);
+
+	reset_randomizer(r);
+
+	for (i = 0 ; i < num_items / 2 ; ++i) {
+		item = get_random(r);
+		avl_tree_remove(&t, (void *) (int64_t) item);
+		assert(is_avl_tree(&t));
+	}
+
+	// releases every chunk, without visiting the nodes
 	avl_tree_destroy(&t);
 	assert(!t.root);
+	assert(!t.slab.chunks);
 	assert(0 == avl_tree_num_items(&t));
-	assert(!avl_tree_find(&t, (void *) 1));
-	assert(0 == avl_tree_height(&t));
-
-	seq.i = 0;
-	avl_tree_pre_order(&t, sequence_visitor, &seq);
-	avl_tree_in_order(&t, sequence_visitor, &seq);
-	avl_tree_post_order(&t, sequence_visitor, &seq);
-	avl_tree_level_order(&t, sequence_visitor_level, &seq);
-	assert(0 == seq.i);
 
+	// the tree is still usable after destroy
 	assert(avl_tree_insert(&t, (void *) 1));
-	assert(avl_tree_insert(&t, (void *) 2));
-	assert(avl_tree_insert(&t, (void *) 0));
+	assert(avl_tree_find(&t, (void *) 1));
+	avl_tree_destroy(&t);
+
+	// with only one callback given, the slab does both jobs
+	for (i = 0 ; i < 2 ; ++i) {
+		avl_tree_init(&t,
+			      i ? my_allocate_avl_node : NULL,
+			      i ? NULL : my_free_avl_node,
+			      my_int_compare,
+			      NULL,
+			      NULL);
+		assert(t.use_slab);
+		for (item = 0 ; item < 100 ; ++item)
+			assert(avl_tree_insert(&t, (void *) (int64_t) item));
+		for (item = 0 ; item < 100 ; item += 2)
+			assert(avl_tree_remove(&t, (void *) (int64_t) item));
+		avl_tree_destroy(&t);
+	}
+
+	free_randomizer(r);
+}
+
+typedef struct _my_object {
+	int64_t key;
+	avl_link link;
+} my_object;
+
+int64_t my_object_compare(const void *key, const avl_link *link)
+{
+	int64_t a = *(const int64_t *) key;
+	int64_t b = avl_entry(link, my_object, link)->key;
+	return (a > b) - (a < b);
+}
+
+// Returns the height of the subtree, or -1 if it is not an AVL tree.
+int checked_link_height(avl_link *link)
+{
+	int left_height;
+	int right_height;
+	int64_t key;
+
+	if (!link)
+		return 0;
+
+	key = avl_entry(link, my_object, link)->key;
+
+	if (link->left && my_object_compare(&key, link->left) <= 0)
+		return -1;
+	if (link->right && my_object_compare(&key, link->right) >= 0)
+		return -1;
+
+	left_height = checked_link_height(link->left);
+	right_height = checked_link_height(link->right);
+
+	if (left_height < 0 || right_height < 0)
+		return -1;
+
+	if ((mymax(left_height, right_height) - mymin(left_height, right_height)) > 1)
+		return -1;
+
+	if (link->height != 1 + mymax(left_height, right_height))
+		return -1;
+
+	return link->height;
+}
+
+void link_in_order_visitor(avl_link *link, void *context)
+{
+	int64_t *expected = (int64_t *) context;
+	assert(avl_entry(link, my_object, link)->key == *expected);
+	*expected += 1;
+}
+
+void intrusive_insert_remove(void)
+{
+	avl_root root;
+	my_object *objects;
+	avl_link *link;
+	int_randomizer *r;
+	int num_items = 1000;
+	int64_t key;
+	int item;
+	int i;
+
+	avl_root_init(&root);
+
+	objects = (my_object *) calloc(num_items, sizeof(my_object));
+	for (i = 0 ; i < num_items ; ++i)
+		objects[i].key = i;
+
+	r = allocate_randomizer(num_items);
+
+	for (i = 0 ; i < num_items ; ++i) {
+		item = get_random(r);
+		assert(avl_link_insert(&root, &objects[item].link,
+				       &objects[item].key, my_object_compare));
+		assert(checked_link_height(root.link) >= 0);
+	}
+	assert(root.num_items == (uint64_t) num_items);
 
 	// duplicates not allowed
-	assert(!avl_tree_insert(&t, (void *) 0));
-	assert(3 == avl_tree_num_items(&t));
-	n = avl_tree_find(&t, (void *) 2);
-	assert(n);
-	assert(n->item == (void *) 2);
-	assert(!avl_tree_find(&t, (void *) 3));
+	key = 7;
+	assert(!avl_link_insert(&root, &objects[0].link, &key, my_object_compare));
+
+	for (i = 0 ; i < num_items ; ++i) {
+		key = i;
+		link = avl_link_find(&root, &key, my_object_compare);
+		assert(link == &objects[i].link);
+		assert(avl_entry(link, my_object, link) == &objects[i]);
+	}
+	key = num_items;
+	assert(!avl_link_find(&root, &key, my_object_compare));
+
+	key = 0;
+	avl_link_in_order(&root, link_in_order_visitor, &key);
+	assert(key == num_items);
+
+	reset_randomizer(r);
+
+	for (i = 0 ; i < num_items ; ++i) {
+		item = get_random(r);
+		key = item;
+		link = avl_link_remove(&root, &key, my_object_compare);
+		assert(link == &objects[item].link);
+		assert(!avl_link_remove(&root, &key, my_object_compare));
+		assert(checked_link_height(root.link) >= 0);
+	}
+	assert(!root.link);
+	assert(0 == root.num_items);
 
-	n = avl_tree_find(&t, (void *) 0);
-	assert(n);
-	assert(n->item == (void *) 0);
-	n = avl_tree_find(&t, (void *) 1);
-	assert(n);
-	assert(n->item == (void *) 1);
-	n = avl_tree_find(&t, (void *) 2);
-	assert(n);
-	assert(n->item == (void *) 2);
+	free_randomizer(r);
+	free(objects);
+}
 
-	// test pre-order traversal
-	seq.i = 0;
-	seq.item_sequence[0] = 1;
-	seq.item_sequence[1] = 0;
-	seq.item_sequence[2] = 2;
-	avl_tree_pre_order(&t, sequence_visitor, &seq);
-	assert(3 == seq.i);
+// Returns the height of the subtree, or -1 if it is not an AVL tree.
+int checked_int64_tree_height(avl_int64_tree_node *node)
+{
+	int left_height;
+	int right_height;
 
-	// test in-order traversal
-	seq.i = 0;
-	seq.item_sequence[0] = 0;
-	seq.item_sequence[1] = 1;
-	seq.item_sequence[2] = 2;
-	avl_tree_in_order(&t, sequence_visitor, &seq);
-	assert(3 == seq.i);
+	if (!node)
+		return 0;
 
-	// test post-order traversal
-	seq.i = 0;
-	seq.item_sequence[0] = 0;
-	seq.item_sequence[1] = 2;
-	seq.item_sequence[2] = 1;
-	avl_tree_post_order(&t, sequence_visitor, &seq);
-	assert(3 == seq.i);
+	if (node->left && node->left->key >= node->key)
+		return -1;
+	if (node->right && node->right->key <= node->key)
+		return -1;
 
-	// test level-order traversal
-	seq.i = 0;
-	seq.item_sequence[0] = 1;
-	seq.item_sequence[1] = 0;
-	seq.item_sequence[2] = 2;
-	avl_tree_level_order(&t, sequence_visitor_level, &seq);
-	assert(3 == seq.i);
+	left_height = checked_int64_tree_height(node->left);
+	right_height = checked_int64_tree_height(node->right);
 
-	for (i = 3 ; i < 10 ; ++i)
-		assert(avl_tree_insert(&t, (void *) (int64_t) i));
+	if (left_height < 0 || right_height < 0)
+		return -1;
 
-	assert(!avl_tree_remove(&t, (void *) (int64_t) 99));
+	if ((mymax(left_height, right_height) - mymin(left_height, right_height)) > 1)
+		return -1;
 
-	avl_tree_destroy(&t);
+	if (node->height != 1 + mymax(left_height, right_height))
+		return -1;
+
+	return node->height;
+}
+
+void typed_insert_remove(void)
+{
+	avl_int64_tree t;
+	avl_tree g;
+	int_randomizer *r;
+	int num_items = 1000;
+	int item;
+	int i;
+
+	avl_int64_tree_init(&t);
+	assert(!avl_int64_tree_find(&t, 0));
+	assert(0 == avl_int64_tree_height(&t));
+
+	r = allocate_randomizer(num_items);
+
+	for (i = 0 ; i < num_items ; ++i) {
+		item = get_random(r);
+		assert(avl_int64_tree_insert(&t, item));
+		assert(checked_int64_tree_height(t.root) >= 0);
+	}
+	assert(avl_int64_tree_num_items(&t) == (uint64_t) num_items);
+	assert(!avl_int64_tree_insert(&t, 5));
+
+	for (i = 0 ; i < num_items ; ++i)
+		assert(avl_int64_tree_find(&t, i)->key == i);
+	assert(!avl_int64_tree_find(&t, num_items));
+
+	reset_randomizer(r);
+
+	for (i = 0 ; i < num_items / 2 ; ++i) {
+		item = get_random(r);
+		assert(avl_int64_tree_remove(&t, item));
+		assert(!avl_int64_tree_remove(&t, item));
+		assert(checked_int64_tree_height(t.root) >= 0);
+	}
+	assert(avl_int64_tree_num_items(&t) == (uint64_t) (num_items - num_items / 2));
+
+	avl_int64_tree_destroy(&t);
 	assert(!t.root);
+	assert(0 == avl_int64_tree_num_items(&t));
+
+	// keys far enough apart to overflow a subtraction
+	avl_int64_tree_init(&t);
+	avl_tree_init(&g,
+		      my_allocate_avl_node,
+		      my_free_avl_node,
+		      my_int_compare,
+		      my_allocate_avl_entry,
+		      my_free_avl_entry);
+
+	assert(avl_int64_tree_insert(&t, INT64_MAX));
+	assert(avl_int64_tree_insert(&t, INT64_MIN));
+	assert(avl_int64_tree_insert(&t, 0));
+	assert(avl_int64_tree_find(&t, INT64_MIN));
+	assert(avl_int64_tree_find(&t, INT64_MAX));
+
+	assert(avl_tree_insert(&g, (void *) INT64_MAX));
+	assert(avl_tree_insert(&g, (void *) INT64_MIN));
+	assert(avl_tree_insert(&g, (void *) 0));
+	assert(avl_tree_find(&g, (void *) INT64_MIN));
+	assert(avl_tree_find(&g, (void *) INT64_MAX));
+	assert(is_avl_tree(&g));
+
+	avl_int64_tree_destroy(&t);
+	avl_tree_destroy(&g);
+	free_randomizer(r);
+}
+
+// Returns the height of the subtree, or -1 if it is not an AVL tree
+// with correct balance bits.
+int checked_compact_height(avl_compact_tree *t, uint32_t index)
+{
+	avl_compact_node *node;
+	uint32_t left;
+	uint32_t right;
+	int left_height;
+	int right_height;
+	int balance;
+
+	if (!index)
+		return 0;
+
+	node = &t->nodes[index];
+	left = AVL_COMPACT_INDEX(node->left);
+	right = AVL_COMPACT_INDEX(node->right);
+
+	if (left && t->compare_items(t->nodes[left].item, node->item) >= 0)
+		return -1;
+	if (right && t->compare_items(t->nodes[right].item, node->item) <= 0)
+		return -1;
+
+	left_height = checked_compact_height(t, left);
+	right_height = checked_compact_height(t, right);
+
+	if (left_height < 0 || right_height < 0)
+		return -1;
+
+	balance = (int) (node->right >> 31) - (int) (node->left >> 31);
+	if (right_height - left_height != balance)
+		return -1;
+
+	return 1 + mymax(left_height, right_height);
+}
+
+void compact_in_order_visitor(avl_compact_node *node, void *context)
+{
+	int64_t *expected = (int64_t *) context;
+	assert((int64_t) node->item == *expected);
+	*expected += 1;
+}
+
+void compact_insert_remove(void)
+{
+	avl_compact_tree t;
+	int_randomizer *r;
+	int num_items;
+	int64_t expected;
+	int item;
+	int i;
+
+	assert(16 == sizeof(avl_compact_node));
+
+	avl_compact_tree_init(&t, my_int_compare);
+	assert(!avl_compact_tree_find(&t, (void *) 0));
+	assert(0 == avl_compact_tree_height(&t));
+
+	for (num_items = 1 ; num_items < 300 ; num_items += 7) {
+		r = allocate_randomizer(num_items);
+
+		for (i = 0 ; i < num_items ; ++i) {
+			item = get_random(r);
+			assert(avl_compact_tree_insert(&t, (void *) (int64_t) item));
+			assert(checked_compact_height(&t, t.root) >= 0);
+		}
+		assert(!avl_compact_tree_insert(&t, (void *) 0));
+		assert(avl_compact_tree_num_items(&t) == (uint64_t) num_items);
+		assert(avl_compact_tree_height(&t) == checked_compact_height(&t, t.root));
+
+		for (i = 0 ; i < num_items ; ++i)
+			assert(avl_compact_tree_find(&t, (void *) (int64_t) i)->item ==
+			       (void *) (int64_t) i);
+		assert(!avl_compact_tree_find(&t, (void *) (int64_t) num_items));
+
+		expected = 0;
+		avl_compact_tree_in_order(&t, compact_in_order_visitor, &expected);
+		assert(expected == num_items);
+
+		reset_randomizer(r);
+
+		for (i = 0 ; i < num_items ; ++i) {
+			item = get_random(r);
+			assert(avl_compact_tree_remove(&t, (void *) (int64_t) item));
+			assert(!avl_compact_tree_remove(&t, (void *) (int64_t) item));
+			assert(checked_compact_height(&t, t.root) >= 0);
+		}
+		assert(!t.root);
+		assert(0 == avl_compact_tree_num_items(&t));
+
+		free_randomizer(r);
+	}
+
+	// removed nodes are reused before the array grows
+	assert(t.used <= 300);
+
+	avl_compact_tree_destroy(&t);
+	assert(!t.nodes);
+}
+
+void build_sorted_is_balanced(void)
+{
+	avl_tree t;
+	void *items[1000];
+	int num_items;
+	int i;
+
+	for (i = 0 ; i < 1000 ; ++i)
+		items[i] = (void *) (int64_t) (i * 2);
+
+	for (num_items = 0 ; num_items <= 1000 ; num_items += 1 + num_items / 8) {
+		avl_tree_init(&t,
+			      num_items & 1 ? NULL : my_allocate_counted_avl_node,
+			      num_items & 1 ? NULL : my_free_avl_node,
+			      my_int_compare,
+			      my_allocate_avl_entry,
+			      my_free_avl_entry);
+		avl_tree_set_node_size(&t, sizeof(avl_tree_counted_node));
+		assert(avl_tree_enable_order_statistics(&t));
+
+		assert(avl_tree_build_sorted(&t, items, num_items));
+		assert(is_avl_tree(&t));
+		assert(sizes_are_valid(t.root));
+		assert(avl_tree_num_items(&t) == (uint64_t) num_items);
+
+		// perfectly balanced: height is floor(log2(n)) + 1
+		for (i = 0 ; (1 << i) <= num_items ; ++i)
+			;
+		assert(avl_tree_height(&t) == i);
+
+		for (i = 0 ; i < num_items ; ++i)
+			assert(avl_tree_select(&t, i)->item == items[i]);
+
+		// a built tree takes ordinary updates
+		assert(avl_tree_insert(&t, (void *) 1));
+		assert(avl_tree_remove(&t, (void *) 0) == (num_items > 0));
+		assert(is_avl_tree(&t));
+		assert(sizes_are_valid(t.root));
+
+		// only an empty tree can be built
+		assert(!avl_tree_build_sorted(&t, items, num_items));
+
+		avl_tree_destroy(&t);
+	}
+
+	avl_tree_init(&t,
+		      my_allocate_avl_node,
+		      my_free_avl_node,
+		      my_int_compare,
+		      my_allocate_avl_entry,
+		      my_free_avl_entry);
+
+	// not strictly increasing
+	items[500] = items[499];
+	assert(!avl_tree_build_sorted(&t, items, 1000));
+	items[500] = (void *) -1;
+	assert(!avl_tree_build_sorted(&t, items, 1000));
+	assert(!t.root);
+	assert(0 == avl_tree_num_items(&t));
+	assert(avl_tree_build_sorted(&t, items, 500));
+
+	avl_tree_destroy(&t);
+}
+
+void batch_insert_remove(void)
+{
+	avl_tree t;
+	char present[512];
+	void *batch[600];
+	uint64_t expected;
+	int_randomizer *r;
+	int num_items;
+	int m;
+	int i;
+
+	r = allocate_randomizer(512);
+
+	for (num_items = 0 ; num_items <= 256 ; num_items += 16) {
+		for (m = 1 ; m <= 600 ; m *= 3) {
+			avl_tree_init(&t,
+				      my_allocate_counted_avl_node,
+				      my_free_avl_node,
+				      my_int_compare,
+				      my_allocate_avl_entry,
+				      my_free_avl_entry);
+			avl_tree_set_node_size(&t, sizeof(avl_tree_counted_node));
+			assert(avl_tree_enable_order_statistics(&t));
+
+			memset(present, 0, sizeof(present));
+			for (i = 0 ; i < num_items ; ++i) {
+				int item = (i * 7) % 512;
+				avl_tree_insert(&t, (void *) (int64_t) item);
+				present[item] = 1;
+			}
+
+			// random items, some already present, some repeated
+			reset_randomizer(r);
+			expected = 0;
+			for (i = 0 ; i < m ; ++i) {
+				int item = get_random(r) % 300;
+				batch[i] = (void *) (int64_t) item;
+				if (!present[item]) {
+					present[item] = 1;
+					++expected;
+				}
+			}
+
+			assert(avl_tree_insert_batch(&t, batch, m) == expected);
+			assert(is_avl_tree(&t));
+			assert(sizes_are_valid(t.root));
+			for (i = 0 ; i < 512 ; ++i)
+				assert(!avl_tree_find(&t, (void *) (int64_t) i) == !present[i]);
+
+			reset_randomizer(r);
+			expected = 0;
+			for (i = 0 ; i < m ; ++i) {
+				int item = 100 + get_random(r) % 412;
+				batch[i] = (void *) (int64_t) item;
+				if (present[item]) {
+					present[item] = 0;
+					++expected;
+				}
+			}
+
+			assert(avl_tree_remove_batch(&t, batch, m) == expected);
+			assert(is_avl_tree(&t));
+			assert(sizes_are_valid(t.root));
+			for (i = 0 ; i < 512 ; ++i)
+				assert(!avl_tree_find(&t, (void *) (int64_t) i) == !present[i]);
+
+			avl_tree_destroy(&t);
+		}
+	}
+
+	assert(0 == avl_tree_insert_batch(&t, batch, 0));
+	assert(0 == avl_tree_remove_batch(&t, batch, 10));
+
+	free_randomizer(r);
+}
+
+// Fill t with the items i < range for which rand() picks them, about
+// one in every spacing, and mark them in present.
+void random_set(avl_tree *t, char *present, int range, int spacing)
+{
+	int i;
+
+	for (i = 0 ; i < range ; ++i) {
+		present[i] = !(rand() % spacing);
+		if (present[i])
+			assert(avl_tree_insert(t, (void *) (int64_t) i));
+	}
+}
+
+int tree_matches_set(avl_tree *t, char *present, int range)
+{
+	uint64_t count = 0;
+	int i;
+
+	for (i = 0 ; i < range ; ++i) {
+		if (!avl_tree_find(t, (void *) (int64_t) i) != !present[i])
+			return 0;
+		count += present[i];
+	}
+
+	return is_avl_tree(t) &&
+	       (!t->order_statistics || sizes_are_valid(t->root)) &&
+	       avl_tree_num_items(t) == count;
+}
+
+// Batches that are neither tiny nor large next to the tree go through
+// avl_tree_union() and avl_tree_difference().
+void batch_set_operations(void)
+{
+	static char present[20000];
+	static void *batch[2400];
+	int sizes[] = { 65, 300, 2400 };
+	uint64_t expected;
+	avl_tree t;
+	int item;
+	int i;
+	int j;
+	int k;
+
+	srand(29);
+	for (j = 0 ; j < 12 ; ++j) {
+		if (j & 1)
+			avl_tree_init(&t, NULL, NULL, my_int_compare, NULL, NULL);
+		else
+			avl_tree_init(&t,
+				      my_allocate_counted_avl_node,
+				      my_free_avl_node,
+				      my_int_compare,
+				      my_allocate_avl_entry,
+				      my_free_avl_entry);
+		avl_tree_set_node_size(&t, sizeof(avl_tree_counted_node));
+		if (j & 2)
+			assert(avl_tree_enable_order_statistics(&t));
+		random_set(&t, present, 20000, 2);
+
+		for (k = 0 ; k < 3 ; ++k) {
+			expected = 0;
+			for (i = 0 ; i < sizes[k] ; ++i) {
+				item = rand() % 20000;
+				batch[i] = (void *) (int64_t) item;
+				if (j < 6 ? !present[item] : present[item]) {
+					present[item] = j < 6;
+					++expected;
+				}
+			}
+
+			if (j < 6)
+				assert(avl_tree_insert_batch(&t, batch, sizes[k]) == expected);
+			else
+				assert(avl_tree_remove_batch(&t, batch, sizes[k]) == expected);
+			assert(tree_matches_set(&t, present, 20000));
+		}
+
+		avl_tree_destroy(&t);
+	}
+}
+
+void join_split_and_set_operations(void)
+{
+	avl_tree t1;
+	avl_tree t2;
+	char present1[1024];
+	char present2[1024];
+	int range = 1024;
+	int op;
+	int j;
+	int i;
+
+	for (j = 0 ; j < 200 ; ++j) {
+		// slab trees every other time; sizes from about 1 to 1024
+		int slab = j & 1;
+		int spacing1 = 1 << (j % 10);
+		int spacing2 = 1 << ((j / 10) % 10);
+
+		for (op = 0 ; op < 3 ; ++op) {
+			avl_tree_init(&t1,
+				      slab ? NULL : my_allocate_counted_avl_node,
+				      slab ? NULL : my_free_avl_node,
+				      my_int_compare,
+				      my_allocate_avl_entry,
+				      my_free_avl_entry);
+			avl_tree_set_node_size(&t1, sizeof(avl_tree_counted_node));
+			avl_tree_init(&t2,
+				      slab ? NULL : my_allocate_counted_avl_node,
+				      slab ? NULL : my_free_avl_node,
+				      my_int_compare,
+				      my_allocate_avl_entry,
+				      my_free_avl_entry);
+			avl_tree_set_node_size(&t2, sizeof(avl_tree_counted_node));
+			if (j & 2)
+				assert(avl_tree_enable_order_statistics(&t1));
+
+			random_set(&t1, present1, range, spacing1);
+			random_set(&t2, present2, range, spacing2);
+
+			if (op == 0) {
+				assert(avl_tree_union(&t1, &t2));
+				for (i = 0 ; i < range ; ++i)
+					present1[i] |= present2[i];
+			} else if (op == 1) {
+				avl_tree_intersection(&t1, &t2);
+				for (i = 0 ; i < range ; ++i)
+					present1[i] &= present2[i];
+			} else {
+				avl_tree_difference(&t1, &t2);
+				for (i = 0 ; i < range ; ++i)
+					present1[i] &= !present2[i];
+			}
+
+			assert(tree_matches_set(&t1, present1, range));
+			assert(!t2.root);
+			assert(0 == avl_tree_num_items(&t2));
+
+			// the result takes ordinary updates
+			for (i = 0 ; i < range ; i += 7) {
+				if (present1[i])
+					assert(avl_tree_remove(&t1, (void *) (int64_t) i));
+				else
+					assert(avl_tree_insert(&t1, (void *) (int64_t) i));
+				present1[i] = !present1[i];
+			}
+			assert(tree_matches_set(&t1, present1, range));
+
+			avl_tree_destroy(&t1);
+			avl_tree_destroy(&t2);
+		}
+	}
+
+	// split at every position, then join back together
+	avl_tree_init(&t1,
+		      my_allocate_counted_avl_node,
+		      my_free_avl_node,
+		      my_int_compare,
+		      my_allocate_avl_entry,
+		      my_free_avl_entry);
+	avl_tree_set_node_size(&t1, sizeof(avl_tree_counted_node));
+	avl_tree_init(&t2,
+		      my_allocate_counted_avl_node,
+		      my_free_avl_node,
+		      my_int_compare,
+		      my_allocate_avl_entry,
+		      my_free_avl_entry);
+	avl_tree_set_node_size(&t2, sizeof(avl_tree_counted_node));
+	assert(avl_tree_enable_order_statistics(&t2));
+
+	for (i = 0 ; i < 200 ; ++i)
+		assert(avl_tree_insert(&t1, (void *) (int64_t) (i * 2)));
+
+	for (i = -1 ; i < 401 ; ++i) {
+		int pivot = mymin(i & ~1, 398); // the largest item not above i
+
+		assert(avl_tree_split(&t1, (void *) (int64_t) i, &t2));
+		memset(present1, 0, sizeof(present1));
+		memset(present2, 0, sizeof(present2));
+		for (j = 0 ; j < 200 ; ++j) {
+			if (j * 2 <= i)
+				present1[j * 2] = 1;
+			else
+				present2[j * 2] = 1;
+		}
+		assert(tree_matches_set(&t1, present1, 400));
+		assert(tree_matches_set(&t2, present2, 400));
+
+		// the trees are the wrong way round
+		if (t1.root && t2.root)
+			assert(!avl_tree_join(&t2, (void *) 1000, &t1));
+
+		// put the largest item of t1 back as the middle item
+		if (t1.root) {
+			assert(avl_tree_remove(&t1, (void *) (int64_t) pivot));
+			assert(avl_tree_join(&t1, (void *) (int64_t) pivot, &t2));
+		} else {
+			assert(avl_tree_union(&t1, &t2));
+		}
+		assert(200 == avl_tree_num_items(&t1));
+		assert(!t2.root);
+		assert(is_avl_tree(&t1));
+	}
+
+	// t2 must be empty
+	assert(avl_tree_insert(&t2, (void *) 1));
+	assert(!avl_tree_split(&t1, (void *) 5, &t2));
+	assert(!avl_tree_join(&t1, (void *) 1000, &t1));
+
+	avl_tree_destroy(&t1);
+	avl_tree_destroy(&t2);
+
+	// join trees of very different heights
+	for (i = 0 ; i < 64 ; ++i) {
+		avl_tree_init(&t1,
+			      my_allocate_avl_node,
+			      my_free_avl_node,
+			      my_int_compare,
+			      my_allocate_avl_entry,
+			      my_free_avl_entry);
+		avl_tree_init(&t2,
+			      my_allocate_avl_node,
+			      my_free_avl_node,
+			      my_int_compare,
+			      my_allocate_avl_entry,
+			      my_free_avl_entry);
+
+		for (j = 0 ; j < (i & 7) * 30 ; ++j)
+			assert(avl_tree_insert(&t1, (void *) (int64_t) j));
+		for (j = 0 ; j < (i >> 3) * 30 ; ++j)
+			assert(avl_tree_insert(&t2, (void *) (int64_t) (j + 1000)));
+
+		if (t2.root)
+			assert(!avl_tree_join(&t1, (void *) 2000, &t2));
+		assert(avl_tree_join(&t1, (void *) 500, &t2));
+		assert(avl_tree_num_items(&t1) == (uint64_t) ((i & 7) + (i >> 3)) * 30 + 1);
+		assert(is_avl_tree(&t1));
+		assert(!t2.root);
+
+		avl_tree_destroy(&t1);
+		avl_tree_destroy(&t2);
+	}
+}
+
+void parallel_build_and_set_operations(void)
+{
+	static char present1[1 << 16];
+	static char present2[1 << 16];
+	int range = 1 << 16;
+	avl_pool *pool;
+	avl_tree t1;
+	avl_tree t2;
+	void **items;
+	int num_items = 100000;
+	int op;
+	int j;
+	int i;
+
+	assert(!avl_pool_create(0));
+	pool = avl_pool_create(4);
+	assert(pool);
+	assert(4 == avl_pool_num_threads(pool));
+
+	items = (void **) malloc(num_items * sizeof(void *));
+	for (i = 0 ; i < num_items ; ++i)
+		items[i] = (void *) (int64_t) i;
+
+	for (j = 0 ; j < 4 ; ++j) {
+		int slab = j & 1;
+		avl_pool *p = j & 2 ? pool : NULL;
+
+		avl_tree_init(&t1,
+			      slab ? NULL : my_allocate_counted_avl_node,
+			      slab ? NULL : my_free_avl_node,
+			      my_int_compare,
+			      my_allocate_avl_entry,
+			      my_free_avl_entry);
+		avl_tree_set_node_size(&t1, sizeof(avl_tree_counted_node));
+		assert(avl_tree_enable_order_statistics(&t1));
+
+		// out of order near the end
+		items[num_items - 10] = (void *) (int64_t) num_items;
+		assert(!avl_tree_build_sorted_parallel(p, &t1, items, num_items));
+		assert(!t1.root);
+		assert(0 == avl_tree_num_items(&t1));
+		items[num_items - 10] = (void *) (int64_t) (num_items - 10);
+
+		assert(avl_tree_build_sorted_parallel(p, &t1, items, num_items));
+		assert(is_avl_tree(&t1));
+		assert(sizes_are_valid(t1.root));
+		assert(avl_tree_num_items(&t1) == (uint64_t) num_items);
+		for (i = 0 ; i < num_items ; i += 97)
+			assert(avl_tree_select(&t1, i)->item == items[i]);
+
+		avl_tree_destroy_parallel(p, &t1);
+		assert(!t1.root);
+		assert(0 == avl_tree_num_items(&t1));
+	}
+
+	// large enough that the recursion forks
+	for (j = 0 ; j < 12 ; ++j) {
+		int slab = j & 1;
+
+		op = (j / 2) % 3;
+
+		avl_tree_init(&t1,
+			      slab ? NULL : my_allocate_counted_avl_node,
+			      slab ? NULL : my_free_avl_node,
+			      my_int_compare,
+			      my_allocate_avl_entry,
+			      my_free_avl_entry);
+		avl_tree_set_node_size(&t1, sizeof(avl_tree_counted_node));
+		avl_tree_init(&t2,
+			      slab ? NULL : my_allocate_counted_avl_node,
+			      slab ? NULL : my_free_avl_node,
+			      my_int_compare,
+			      my_allocate_avl_entry,
+			      my_free_avl_entry);
+		avl_tree_set_node_size(&t2, sizeof(avl_tree_counted_node));
+		if (j >= 6)
+			assert(avl_tree_enable_order_statistics(&t1));
+
+		random_set(&t1, present1, range, 2);
+		random_set(&t2, present2, range, 1 + (j % 3));
+
+		if (op == 0) {
+			assert(avl_tree_union_parallel(pool, &t1, &t2));
+			for (i = 0 ; i < range ; ++i)
+				present1[i] |= present2[i];
+		} else if (op == 1) {
+			avl_tree_intersection_parallel(pool, &t1, &t2);
+			for (i = 0 ; i < range ; ++i)
+				present1[i] &= present2[i];
+		} else {
+			avl_tree_difference_parallel(pool, &t1, &t2);
+			for (i = 0 ; i < range ; ++i)
+				present1[i] &= !present2[i];
+		}
+
+		assert(tree_matches_set(&t1, present1, range));
+		assert(!t2.root);
+		assert(0 == avl_tree_num_items(&t2));
+
+		avl_tree_destroy_parallel(pool, &t1);
+		avl_tree_destroy_parallel(pool, &t2);
+	}
+
+	free(items);
+	avl_pool_destroy(pool);
+}
+
+static int64_t concurrent_nodes; // allocated and not yet freed
+
+avl_tree_node * my_counting_allocate_node(void *item)
+{
+	__atomic_fetch_add(&concurrent_nodes, 1, __ATOMIC_RELAXED);
+	return my_allocate_avl_node(item);
+}
+
+void my_counting_free_node(avl_tree_node *node)
+{
+	__atomic_fetch_sub(&concurrent_nodes, 1, __ATOMIC_RELAXED);
+	my_free_avl_node(node);
+}
+
+typedef struct _concurrent_reader {
+	avl_concurrent_tree *ct;
+	int stop;
+	uint64_t lookups;
+} concurrent_reader;
+
+// Even items are always present; odd ones come and go.
+void * concurrent_reader_thread(void *arg)
+{
+	concurrent_reader *r = (concurrent_reader *) arg;
+	unsigned int seed = (unsigned int) (uintptr_t) r;
+	void *found;
+	int64_t item;
+
+	while (!__atomic_load_n(&r->stop, __ATOMIC_ACQUIRE)) {
+		item = rand_r(&seed) % 2000;
+		found = NULL;
+		if (avl_concurrent_tree_find(r->ct, (void *) item, &found))
+			assert(found == (void *) item);
+		else
+			assert(item & 1);
+		++r->lookups;
+	}
+
+	return NULL;
+}
+
+void concurrent_sorted_visitor(avl_tree_node *node, void *context)
+{
+	int64_t *last = (int64_t *) context;
+	assert((int64_t) node->item > *last);
+	*last = (int64_t) node->item;
+}
+
+void concurrent_count_visitor(avl_tree_node *node, void *context)
+{
+	++*(int64_t *) context;
+}
+
+void concurrent_readers_and_writer(void)
+{
+	avl_concurrent_tree ct;
+	concurrent_reader readers[3];
+	pthread_t threads[3];
+	char present[2000];
+	uint64_t count = 1000;
+	int64_t last;
+	void *found;
+	int slab;
+	int i;
+
+	for (slab = 0 ; slab < 2 ; ++slab) {
+		avl_concurrent_tree_init(&ct,
+					 slab ? NULL : my_counting_allocate_node,
+					 slab ? NULL : my_counting_free_node,
+					 my_int_compare);
+
+		assert(!avl_concurrent_tree_find(&ct, (void *) 0, NULL));
+
+		memset(present, 0, sizeof(present));
+		for (i = 0 ; i < 2000 ; i += 2) {
+			assert(avl_concurrent_tree_insert(&ct, (void *) (int64_t) i));
+			present[i] = 1;
+		}
+		assert(!avl_concurrent_tree_insert(&ct, (void *) 0));
+		count = 1000;
+
+		for (i = 0 ; i < 3 ; ++i) {
+			readers[i].ct = &ct;
+			readers[i].stop = 0;
+			readers[i].lookups = 0;
+			assert(!pthread_create(&threads[i], NULL,
+					       concurrent_reader_thread, &readers[i]));
+		}
+
+		// enough removals to go through several reclaims
+		for (i = 0 ; i < 20000 ; ++i) {
+			int64_t item = (rand() % 1000) * 2 + 1;
+			if (present[item]) {
+				assert(avl_concurrent_tree_remove(&ct, (void *) item));
+				--count;
+			} else {
+				assert(avl_concurrent_tree_insert(&ct, (void *) item));
+				++count;
+			}
+			present[item] = !present[item];
+
+			if (!(i % 1000)) {
+				last = -1;
+				avl_concurrent_tree_in_order(&ct, concurrent_sorted_visitor, &last);
+			}
+		}
+
+		for (i = 0 ; i < 3 ; ++i) {
+			__atomic_store_n(&readers[i].stop, 1, __ATOMIC_RELEASE);
+			assert(!pthread_join(threads[i], NULL));
+		}
+
+		assert(avl_concurrent_tree_num_items(&ct) == count);
+		assert(is_avl_tree(&ct.tree));
+		for (i = 0 ; i < 2000 ; ++i) {
+			assert(avl_concurrent_tree_find(&ct, (void *) (int64_t) i, &found) == present[i]);
+			assert(!present[i] || found == (void *) (int64_t) i);
+		}
+		assert(!avl_concurrent_tree_remove(&ct, (void *) 2001));
+
+		last = 0;
+		avl_concurrent_tree_pre_order(&ct, concurrent_count_visitor, &last);
+		assert(last == (int64_t) count);
+		last = 0;
+		avl_concurrent_tree_post_order(&ct, concurrent_count_visitor, &last);
+		assert(last == (int64_t) count);
+
+		avl_concurrent_tree_destroy(&ct);
+		assert(0 == concurrent_nodes);
+	}
+}
+
+typedef struct _range_visit_state {
+	int64_t last;
+	int count;
+} range_visit_state;
+
+void range_visitor(avl_tree_node *node, void *context)
+{
+	range_visit_state *state = (range_visit_state *) context;
+	assert((int64_t) node->item > state->last);
+	state->last = (int64_t) node->item;
+	++state->count;
+}
+
+void range_visit_and_remove(void)
+{
+	avl_tree t;
+	char present[400];
+	range_visit_state state;
+	int expected;
+	int slab;
+	int lo;
+	int hi;
+	uint64_t n;
+	int i;
+	int j;
+	int k;
+
+	srand(19);
+	for (i = 0 ; i < 200 ; ++i) {
+		slab = i & 1;
+		if (slab)
+			avl_tree_init(&t, NULL, NULL, my_int_compare, NULL, NULL);
+		else {
+			avl_tree_init(&t,
+				      my_allocate_counted_avl_node,
+				      my_free_avl_node,
+				      my_int_compare,
+				      my_allocate_avl_entry,
+				      my_free_avl_entry);
+			avl_tree_set_node_size(&t, sizeof(avl_tree_counted_node));
+		}
+		if (i & 2)
+			assert(avl_tree_enable_order_statistics(&t));
+
+		random_set(&t, present, 400, 1 + i % 3);
+
+		for (j = 0 ; j < 10 ; ++j) {
+			lo = rand() % 420 - 10;
+			hi = lo + rand() % (j < 8 ? 60 : 420);
+
+			expected = 0;
+			for (k = mymax(lo, 0) ; k < mymin(hi, 400) ; ++k)
+				expected += present[k];
+
+			state.last = lo - 1;
+			state.count = 0;
+			avl_tree_range_visit(&t, (void *) (int64_t) lo, (void *) (int64_t) hi,
+					     range_visitor, &state);
+			assert(state.count == expected);
+			assert(state.last < hi);
+
+			assert(avl_tree_range_remove(&t, (void *) (int64_t) lo,
+						     (void *) (int64_t) hi) == (uint64_t) expected);
+			for (k = mymax(lo, 0) ; k < mymin(hi, 400) ; ++k)
+				present[k] = 0;
+			assert(tree_matches_set(&t, present, 400));
+		}
+
+		// empty and reversed ranges remove nothing
+		assert(!avl_tree_range_remove(&t, (void *) 5, (void *) 5));
+		assert(!avl_tree_range_remove(&t, (void *) 300, (void *) 100));
+
+		n = avl_tree_num_items(&t);
+		assert(avl_tree_range_remove(&t, (void *) -1, (void *) 400) == n);
+		assert(!t.root);
+		assert(0 == avl_tree_num_items(&t));
+
+		avl_tree_destroy(&t);
+	}
+}
+
+typedef struct _level_order_state {
+	avl_tree *t;
+	uint64_t count;
+	int level;
+	int64_t last;
+} level_order_state;
+
+void level_order_visitor(avl_tree_node *node, void *context, int level)
+{
+	level_order_state *state = (level_order_state *) context;
+	avl_tree_node *n = state->t->root;
+	int depth = 0;
+
+	while (n != node) {
+		n = (int64_t) node->item < (int64_t) n->item ? n->left : n->right;
+		++depth;
+	}
+	assert(level == depth);
+
+	// levels in order, each from left to right
+	if (level == state->level) {
+		assert((int64_t) node->item > state->last);
+	} else {
+		assert(level == state->level + 1);
+		state->level = level;
+	}
+	state->last = (int64_t) node->item;
+	++state->count;
+}
+
+void level_order_in_scratch(void)
+{
+	avl_tree t;
+	char present[3000];
+	avl_tree_node *scratch[1500];
+	level_order_state state;
+	uint64_t size;
+	int i;
+
+	srand(20);
+	for (i = 0 ; i < 60 ; ++i) {
+		avl_tree_init(&t, NULL, NULL, my_int_compare, NULL, NULL);
+		random_set(&t, present, i * 50, 1 + i % 4);
+
+		size = avl_tree_level_order_scratch_size(&t);
+		assert(size <= (avl_tree_num_items(&t) + 1) / 2);
+		assert(!t.root || size);
+
+		state.t = &t;
+		state.count = 0;
+		state.level = -1;
+		assert(avl_tree_level_order(&t, level_order_visitor, &state));
+		assert(state.count == avl_tree_num_items(&t));
+
+		// exactly the reported size is enough, and the queue wraps
+		state.count = 0;
+		state.level = -1;
+		assert(avl_tree_level_order_scratch(&t, level_order_visitor, &state,
+						    scratch, size));
+		assert(state.count == avl_tree_num_items(&t));
+
+		if (size) {
+			state.count = 0;
+			assert(!avl_tree_level_order_scratch(&t, level_order_visitor, &state,
+							     scratch, size - 1));
+			assert(!state.count);
+		}
+
+		avl_tree_destroy(&t);
+	}
+}
+
+typedef struct _walk_record {
+	avl_tree_node *nodes[3000];
+	int count;
+} walk_record;
+
+void walk_record_visitor(avl_tree_node *node, void *context)
+{
+	walk_record *w = (walk_record *) context;
+	w->nodes[w->count++] = node;
+}
+
+// order: 0 pre, 1 in, 2 post
+void recursive_walk(avl_tree_node *node, int order, walk_record *w)
+{
+	if (!node)
+		return;
+	if (order == 0)
+		walk_record_visitor(node, w);
+	recursive_walk(node->left, order, w);
+	if (order == 1)
+		walk_record_visitor(node, w);
+	recursive_walk(node->right, order, w);
+	if (order == 2)
+		walk_record_visitor(node, w);
+}
+
+void free_node_visitor(avl_tree_node *node, void *context)
+{
+	++*(int *) context;
+	my_free_avl_node(node);
+}
+
+void walks_match_recursion(void)
+{
+	avl_tree t;
+	char present[3000];
+	walk_record expected;
+	walk_record actual;
+	avl_tree_node *node;
+	avl_tree_node *other;
+	int pairs;
+	int freed;
+	int order;
+	int i;
+	int j;
+	int k;
+
+	srand(21);
+	for (i = 0 ; i < 60 ; ++i) {
+		avl_tree_init(&t, my_allocate_avl_node, my_free_avl_node,
+			      my_int_compare, NULL, NULL);
+		random_set(&t, present, i * 50, 1 + i % 4);
+
+		for (order = 0 ; order < 3 ; ++order) {
+			expected.count = 0;
+			recursive_walk(t.root, order, &expected);
+
+			actual.count = 0;
+			if (order == 0)
+				avl_tree_pre_order(&t, walk_record_visitor, &actual);
+			else if (order == 1)
+				avl_tree_in_order(&t, walk_record_visitor, &actual);
+			else
+				avl_tree_post_order(&t, walk_record_visitor, &actual);
+
+			assert(actual.count == expected.count);
+			assert(!memcmp(actual.nodes, expected.nodes,
+				       expected.count * sizeof(avl_tree_node *)));
+
+			// the inline loops visit the same nodes
+			actual.count = 0;
+			if (order == 0) {
+				AVL_FOREACH_PRE_ORDER(&t, node)
+					walk_record_visitor(node, &actual);
+			} else if (order == 1) {
+				AVL_FOREACH_IN_ORDER(&t, node)
+					walk_record_visitor(node, &actual);
+			} else {
+				AVL_FOREACH_POST_ORDER(&t, node)
+					walk_record_visitor(node, &actual);
+			}
+
+			assert(actual.count == expected.count);
+			assert(!memcmp(actual.nodes, expected.nodes,
+				       expected.count * sizeof(avl_tree_node *)));
+		}
+
+		// nested loops and break: count the pairs a < b < a + 10
+		pairs = 0;
+		AVL_FOREACH_IN_ORDER(&t, node) {
+			AVL_FOREACH_IN_ORDER(&t, other) {
+				if ((int64_t) other->item >= (int64_t) node->item + 10)
+					break;
+				pairs += (int64_t) other->item > (int64_t) node->item;
+			}
+		}
+		for (j = 0 ; j < i * 50 ; ++j)
+			for (k = j + 1 ; k < mymin(j + 10, i * 50) ; ++k)
+				pairs -= present[j] && present[k];
+		assert(!pairs);
+
+		// a post order visitor (or loop body) may free the nodes
+		if (i % 4 == 3) {
+			freed = 0;
+			AVL_FOREACH_PRE_ORDER(&t, node)
+				free_node_visitor(node, &freed);
+			assert(freed == (int) avl_tree_num_items(&t));
+			t.root = NULL;
+			t.num_items = 0;
+		} else if (i & 1) {
+			freed = 0;
+			avl_tree_post_order(&t, free_node_visitor, &freed);
+			assert(freed == (int) avl_tree_num_items(&t));
+			t.root = NULL;
+			t.num_items = 0;
+		}
+
+		avl_tree_destroy(&t);
+	}
+}
+
+// Returns the greatest hi of a non-empty interval under node, or
+// INT64_MIN; clears *ok if some max_hi is wrong.
+int64_t checked_max_hi(avl_tree_node *node, int *ok)
+{
+	avl_interval *interval;
+	int64_t max_hi;
+
+	if (!node)
+		return INT64_MIN;
+
+	interval = (avl_interval *) node->item;
+	max_hi = mymax(interval->lo < interval->hi ? interval->hi : INT64_MIN,
+		       mymax(checked_max_hi(node->left, ok),
+			     checked_max_hi(node->right, ok)));
+	if (interval->max_hi != max_hi)
+		*ok = 0;
+	return max_hi;
+}
+
+int interval_tree_is_valid(avl_tree *t)
+{
+	int ok = 1;
+	checked_max_hi(t->root, &ok);
+	return ok && is_avl_tree(t);
+}
+
+typedef struct _overlap_state {
+	char seen[400];
+	int count;
+} overlap_state;
+
+void overlap_visitor(avl_interval *interval, void *context)
+{
+	overlap_state *state = (overlap_state *) context;
+	int i = (int) (int64_t) interval->data;
+
+	assert(!state->seen[i]);
+	state->seen[i] = 1;
+	++state->count;
+}
+
+void check_overlaps(avl_tree *t, avl_interval *intervals, char *present,
+		    int64_t lo, int64_t hi)
+{
+	overlap_state state;
+	avl_interval *any;
+	int expected = 0;
+	int i;
+
+	memset(state.seen, 0, sizeof(state.seen));
+	state.count = 0;
+	avl_interval_tree_overlaps(t, lo, hi, overlap_visitor, &state);
+
+	for (i = 0 ; i < 400 ; ++i) {
+		int overlaps = present[i] && intervals[i].lo < hi && lo < intervals[i].hi &&
+			       lo < hi && intervals[i].lo < intervals[i].hi;
+		assert(state.seen[i] == overlaps);
+		expected += overlaps;
+	}
+	assert(state.count == expected);
+
+	any = avl_interval_tree_find_any(t, lo, hi);
+	if (expected)
+		assert(any && state.seen[(int64_t) any->data]);
+	else
+		assert(!any);
+}
+
+void interval_tree_augmented(void)
+{
+	avl_interval intervals[400];
+	avl_interval probe_lo;
+	avl_interval probe_hi;
+	char present[400];
+	void *batch[400];
+	avl_tree t;
+	avl_tree greater;
+	int slab;
+	int lo;
+	int n;
+	int i;
+	int j;
+
+	srand(23);
+	for (i = 0 ; i < 400 ; ++i) {
+		intervals[i].lo = rand() % 1000;
+		intervals[i].hi = intervals[i].lo + rand() % (i % 8 ? 20 : 300);
+		intervals[i].data = (void *) (int64_t) i;
+	}
+	// a duplicate of an interval, which is a separate item
+	intervals[1] = intervals[0];
+	intervals[1].data = (void *) 1;
+
+	for (slab = 0 ; slab < 2 ; ++slab) {
+		if (slab)
+			avl_interval_tree_init(&t, NULL, NULL);
+		else
+			avl_interval_tree_init(&t, my_allocate_avl_node, my_free_avl_node);
+		memset(present, 0, sizeof(present));
+
+		for (j = 0 ; j < 4000 ; ++j) {
+			i = rand() % 400;
+			if (present[i])
+				assert(avl_tree_remove(&t, &intervals[i]));
+			else
+				assert(avl_tree_insert(&t, &intervals[i]));
+			present[i] = !present[i];
+
+			if (j % 100 == 0) {
+				assert(interval_tree_is_valid(&t));
+				lo = rand() % 1100 - 50;
+				check_overlaps(&t, intervals, present, lo, lo + rand() % 40);
+				check_overlaps(&t, intervals, present, lo, lo);
+			}
+		}
+
+		// batches, which may rebuild the tree
+		for (i = 0, n = 0 ; i < 400 ; ++i)
+			if (!present[i] && i % 3)
+				batch[n++] = &intervals[i];
+		assert(avl_tree_insert_batch(&t, batch, n) == (uint64_t) n);
+		for (i = 0 ; i < n ; ++i)
+			present[(int64_t) ((avl_interval *) batch[i])->data] = 1;
+		assert(interval_tree_is_valid(&t));
+		check_overlaps(&t, intervals, present, 100, 400);
+
+		for (i = 0, n = 0 ; i < 400 ; ++i)
+			if (present[i] && i % 2)
+				batch[n++] = &intervals[i];
+		assert(avl_tree_remove_batch(&t, batch, n) == (uint64_t) n);
+		for (i = 0 ; i < n ; ++i)
+			present[(int64_t) ((avl_interval *) batch[i])->data] = 0;
+		assert(interval_tree_is_valid(&t));
+		check_overlaps(&t, intervals, present, 0, 2000);
+
+		// cutting out the intervals that start in [300, 600)
+		probe_lo.lo = 300;
+		probe_lo.hi = INT64_MIN;
+		probe_hi.lo = 600;
+		probe_hi.hi = INT64_MIN;
+		n = 0;
+		for (i = 0 ; i < 400 ; ++i) {
+			if (present[i] && intervals[i].lo >= 300 && intervals[i].lo < 600) {
+				present[i] = 0;
+				++n;
+			}
+		}
+		assert(avl_tree_range_remove(&t, &probe_lo, &probe_hi) == (uint64_t) n);
+		assert(interval_tree_is_valid(&t));
+		check_overlaps(&t, intervals, present, 250, 700);
+
+		if (!slab) {
+			// split and join back; greater has no hook until joined
+			avl_tree_init(&greater, my_allocate_avl_node, my_free_avl_node,
+				      avl_interval_compare, NULL, NULL);
+			assert(avl_tree_split(&t, &probe_lo, &greater));
+			assert(interval_tree_is_valid(&t));
+			assert(avl_tree_union(&t, &greater));
+			assert(interval_tree_is_valid(&t));
+			check_overlaps(&t, intervals, present, 0, 2000);
+			avl_tree_destroy(&greater);
+		}
+
+		// switching the hook off and on recomputes every node
+		avl_tree_set_augment(&t, NULL);
+		for (i = 0 ; i < 400 ; ++i)
+			intervals[i].max_hi = -1;
+		avl_tree_set_augment(&t, avl_interval_augment);
+		assert(interval_tree_is_valid(&t));
+
+		avl_tree_destroy(&t);
+	}
+}
+
+void my_store_int32_key(void *item, void *key)
+{
+	int32_t k = (int32_t) (int64_t) item;
+	memcpy(key, &k, sizeof(k));
+}
+
+int64_t my_int32_key_compare(const void *a, const void *b)
+{
+	int32_t ia;
+	int32_t ib;
+	memcpy(&ia, a, sizeof(ia));
+	memcpy(&ib, b, sizeof(ib));
+	return (ia > ib) - (ia < ib);
+}
+
+int64_t my_image_key(avl_image *img, const void *key)
+{
+	int64_t k;
+	int32_t k32;
+
+	if (img->key_size == sizeof(k32)) {
+		memcpy(&k32, key, sizeof(k32));
+		return k32;
+	}
+	memcpy(&k, key, sizeof(k));
+	return k;
+}
+
+void image_save_and_load_mmap(void)
+{
+	char path[] = "/tmp/avl_image_XXXXXX";
+	avl_tree t;
+	avl_image img;
+	avl_image_iter it;
+	avl_tree_iter tree_it;
+	avl_tree_node *node;
+	const void *key;
+	unsigned char byte;
+	int64_t k;
+	int32_t k32;
+	int num_items;
+	int wide;
+	int fd;
+	int i;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+
+	avl_tree_init(&t,
+		      my_allocate_avl_node,
+		      my_free_avl_node,
+		      my_int_compare,
+		      my_allocate_avl_entry,
+		      my_free_avl_entry);
+
+	for (num_items = 0 ; num_items < 300 ; num_items += 37) {
+		// items are 0, 2, ..., 2 * (num_items - 1), inserted at random
+		while (avl_tree_num_items(&t) < num_items)
+			avl_tree_insert(&t, (void *) (int64_t) (2 * (rand() % num_items)));
+
+		for (wide = 0 ; wide < 2 ; ++wide) {
+			assert(!ftruncate(fd, 0));
+			assert(lseek(fd, 0, SEEK_SET) == 0);
+			if (wide) {
+				assert(avl_tree_save(&t, fd, sizeof(int64_t), NULL));
+				assert(avl_tree_load_mmap(&img, path, NULL, 1));
+			} else {
+				assert(avl_tree_save(&t, fd, sizeof(int32_t), my_store_int32_key));
+				assert(avl_tree_load_mmap(&img, path, my_int32_key_compare, 1));
+				assert(!avl_tree_load_mmap(&img, path, NULL, 1));
+				assert(avl_tree_load_mmap(&img, path, my_int32_key_compare, 1));
+			}
+			assert(avl_image_num_items(&img) == num_items);
+			assert(img.height == avl_tree_height(&t));
+			avl_tree_iter_init(&tree_it, &t);
+
+			for (i = -1 ; i <= 2 * num_items + 1 ; ++i) {
+				k = i;
+				k32 = i;
+				key = avl_image_find(&img, wide ? (void *) &k : (void *) &k32);
+				if (avl_tree_find(&t, (void *) k))
+					assert(key && my_image_key(&img, key) == k);
+				else
+					assert(!key);
+
+				// the lower bound matches the tree's
+				key = avl_image_iter_seek_lower_bound(&it, &img,
+					wide ? (void *) &k : (void *) &k32);
+				node = avl_tree_iter_seek_lower_bound(&tree_it, (void *) k);
+				if (node)
+					assert(key && my_image_key(&img, key) == (int64_t) node->item);
+				else
+					assert(!key);
+			}
+
+			// in-order iteration gives the tree's items
+			node = avl_tree_iter_first(&tree_it);
+			for (key = avl_image_iter_first(&it, &img) ; key ;
+			     key = avl_image_iter_next(&it)) {
+				assert(node);
+				assert(my_image_key(&img, key) == (int64_t) node->item);
+				node = avl_tree_iter_next(&tree_it);
+			}
+			assert(!node);
+
+			avl_image_close(&img);
+		}
+	}
+
+	// a damaged link fails the checksum; unchecked, it is still safe to walk
+	assert(avl_tree_num_items(&t) > 1);
+	assert(pread(fd, &byte, 1, sizeof(avl_image_header) + 1) == 1);
+	byte ^= 0x40;
+	assert(pwrite(fd, &byte, 1, sizeof(avl_image_header) + 1) == 1);
+	assert(!avl_tree_load_mmap(&img, path, NULL, 1));
+	assert(avl_tree_load_mmap(&img, path, NULL, 0));
+	for (i = 0 ; i < 2 * num_items ; ++i) {
+		k = i;
+		avl_image_find(&img, &k);
+	}
+	for (key = avl_image_iter_first(&it, &img) ; key ; key = avl_image_iter_next(&it))
+		;
+	avl_image_close(&img);
+
+	// a short file or a missing one does not load
+	assert(!ftruncate(fd, sizeof(avl_image_header)));
+	assert(!avl_tree_load_mmap(&img, path, NULL, 0));
+	assert(!avl_tree_load_mmap(&img, "/nonexistent/avl_image", NULL, 0));
+
+	close(fd);
+	unlink(path);
+	avl_tree_destroy(&t);
+}
+
+void * my_load_int32_item(const void *key)
+{
+	int32_t k;
+	memcpy(&k, key, sizeof(k));
+	return (void *) (int64_t) k;
+}
+
+void my_store_negated_key(void *item, void *key)
+{
+	int64_t k = -(int64_t) item;
+	memcpy(key, &k, sizeof(k));
+}
+
+int boxed_items_alive;
+
+void * my_load_boxed_item(const void *key)
+{
+	int64_t *box = (int64_t *) malloc(sizeof(int64_t));
+	if (box) {
+		memcpy(box, key, sizeof(*box));
+		++boxed_items_alive;
+	}
+	return box;
+}
+
+void my_free_boxed_item(void *item)
+{
+	free(item);
+	--boxed_items_alive;
+}
+
+int64_t my_boxed_compare(void *a, void *b)
+{
+	return my_int_compare((void *) *(int64_t *) a, (void *) *(int64_t *) b);
+}
+
+void stream_export_and_import(void)
+{
+	char path[] = "/tmp/avl_stream_XXXXXX";
+	int sizes[] = { 0, 1, 7, 300, 40000 };
+	char *present;
+	avl_tree t;
+	avl_tree copy;
+	avl_tree boxed;
+	avl_tree_iter it;
+	unsigned char byte;
+	int pipe_fds[2];
+	int32_t height;
+	uint64_t n;
+	off_t size;
+	int range;
+	int fd;
+	int i;
+	int j;
+
+	fd = mkstemp(path);
+	assert(fd >= 0);
+	present = (char *) malloc(40000);
+
+	for (j = 0 ; j < 5 ; ++j) {
+		range = sizes[j];
+		avl_tree_init(&t, NULL, NULL, my_int_compare, NULL, NULL);
+		assert(avl_tree_enable_order_statistics(&t));
+		random_set(&t, present, range, 1 + j % 2);
+
+		assert(!ftruncate(fd, 0));
+		assert(lseek(fd, 0, SEEK_SET) == 0);
+		assert(avl_tree_export(&t, fd, sizeof(int64_t), NULL));
+
+		// the copy is perfectly balanced, and a slab tree takes it too
+		assert(lseek(fd, 0, SEEK_SET) == 0);
+		avl_tree_init(&copy, NULL, NULL, my_int_compare, NULL, NULL);
+		assert(avl_tree_enable_order_statistics(&copy));
+		assert(avl_tree_import(&copy, fd, NULL, NULL));
+		assert(tree_matches_set(&copy, present, range));
+		for (n = avl_tree_num_items(&copy), height = 0 ; n ; n >>= 1)
+			++height;
+		assert(avl_tree_height(&copy) == height);
+
+		// only into an empty tree
+		assert(lseek(fd, 0, SEEK_SET) == 0);
+		assert(!avl_tree_import(&copy, fd, NULL, NULL) || !avl_tree_num_items(&t));
+		avl_tree_destroy(&copy);
+
+		// the items of [1, range), with 4-byte keys
+		n = avl_tree_count_range(&t, (void *) 1, (void *) (int64_t) range);
+		assert(!ftruncate(fd, 0));
+		assert(lseek(fd, 0, SEEK_SET) == 0);
+		avl_tree_iter_init(&it, &t);
+		avl_tree_iter_seek_lower_bound(&it, (void *) 1);
+		assert(avl_tree_iter_export(&it, n, fd, sizeof(int32_t), my_store_int32_key));
+		assert(!avl_tree_iter_node(&it));
+		assert(lseek(fd, 0, SEEK_SET) == 0);
+		avl_tree_init(&copy, NULL, NULL, my_int_compare, NULL, NULL);
+		assert(avl_tree_import(&copy, fd, my_load_int32_item, NULL));
+		if (range)
+			present[0] = 0;
+		assert(tree_matches_set(&copy, present, range));
+		avl_tree_destroy(&copy);
+
+		// asking for more items than there are fails
+		avl_tree_iter_first(&it);
+		assert(!avl_tree_iter_export(&it, avl_tree_num_items(&t) + 1, fd,
+					     sizeof(int64_t), NULL));
+
+		avl_tree_destroy(&t);
+	}
+
+	// a stream goes through a pipe too
+	avl_tree_init(&t, NULL, NULL, my_int_compare, NULL, NULL);
+	random_set(&t, present, 500, 2);
+	assert(!pipe(pipe_fds));
+	assert(avl_tree_export(&t, pipe_fds[1], sizeof(int64_t), NULL));
+	close(pipe_fds[1]);
+	avl_tree_init(&copy, NULL, NULL, my_int_compare, NULL, NULL);
+	assert(avl_tree_import(&copy, pipe_fds[0], NULL, NULL));
+	close(pipe_fds[0]);
+	assert(tree_matches_set(&copy, present, 500));
+	avl_tree_destroy(&copy);
+
+	// items out of order are refused
+	assert(!ftruncate(fd, 0));
+	assert(lseek(fd, 0, SEEK_SET) == 0);
+	assert(avl_tree_export(&t, fd, sizeof(int64_t), my_store_negated_key));
+	assert(lseek(fd, 0, SEEK_SET) == 0);
+	assert(!avl_tree_import(&copy, fd, NULL, NULL));
+	assert(!copy.root && !avl_tree_num_items(&copy));
+
+	// and every item load_item made for them goes to free_item
+	avl_tree_init(&boxed, NULL, NULL, my_boxed_compare, NULL, NULL);
+	assert(lseek(fd, 0, SEEK_SET) == 0);
+	assert(!avl_tree_import(&boxed, fd, my_load_boxed_item, my_free_boxed_item));
+	assert(!boxed.root && !boxed_items_alive);
+
+	// so are a damaged key and a short stream
+	assert(!ftruncate(fd, 0));
+	assert(lseek(fd, 0, SEEK_SET) == 0);
+	assert(avl_tree_export(&t, fd, sizeof(int64_t), NULL));
+	size = lseek(fd, 0, SEEK_CUR);
+	i = sizeof(avl_stream_header) + sizeof(avl_stream_batch) + 8 * 100;
+	assert(pread(fd, &byte, 1, i) == 1);
+	byte ^= 1;
+	assert(pwrite(fd, &byte, 1, i) == 1);
+	assert(lseek(fd, 0, SEEK_SET) == 0);
+	assert(!avl_tree_import(&copy, fd, NULL, NULL));
+	byte ^= 1;
+	assert(pwrite(fd, &byte, 1, i) == 1);
+	assert(!ftruncate(fd, size - 1));
+	assert(lseek(fd, 0, SEEK_SET) == 0);
+	assert(!avl_tree_import(&copy, fd, NULL, NULL));
+	assert(!copy.root);
+	assert(lseek(fd, 0, SEEK_SET) == 0);
+	assert(!avl_tree_import(&boxed, fd, my_load_boxed_item, my_free_boxed_item));
+	assert(!boxed.root && !boxed_items_alive);
+
+	avl_tree_destroy(&boxed);
+	avl_tree_destroy(&copy);
+	avl_tree_destroy(&t);
+	free(present);
+	close(fd);
+	unlink(path);
+}
+
+void find_batch_matches_find(void)
+{
+	avl_tree t;
+	void *items[2011];
+	avl_tree_node *results[2011];
+	int i;
+
+	avl_tree_init(&t,
+		      my_allocate_avl_node,
+		      my_free_avl_node,
+		      my_int_compare,
+		      my_allocate_avl_entry,
+		      my_free_avl_entry);
+
+	for (i = 0 ; i < 2011 ; ++i)
+		items[i] = (void *) (int64_t) (i - 5);
+
+	// empty tree
+	avl_tree_find_batch(&t, items, 2011, results);
+	for (i = 0 ; i < 2011 ; ++i)
+		assert(!results[i]);
+
+	for (i = 0 ; i < 1000 ; ++i)
+		assert(avl_tree_insert(&t, (void *) (int64_t) (i * 2)));
+
+	// every batch length up to a few groups
+	for (i = 0 ; i < 50 ; ++i) {
+		int j;
+		avl_tree_find_batch(&t, items + 3, i, results);
+		for (j = 0 ; j < i ; ++j)
+			assert(results[j] == avl_tree_find(&t, items[3 + j]));
+	}
+
+	avl_tree_find_batch(&t, items, 2011, results);
+	for (i = 0 ; i < 2011 ; ++i)
+		assert(results[i] == avl_tree_find(&t, items[i]));
+
+	avl_tree_destroy(&t);
+}
+
+void iterate_and_seek(void)
+{
+	avl_tree t;
+	avl_tree_iter it;
+	avl_tree_iter page;
+	avl_tree_node *node;
+	int num_items;
+	int i;
+	int j;
+
+	avl_tree_init(&t,
+		      my_allocate_avl_node,
+		      my_free_avl_node,
+		      my_int_compare,
+		      my_allocate_avl_entry,
+		      my_free_avl_entry);
+
+	for (num_items = 0 ; num_items < 300 ; ++num_items) {
+		// items are 0, 2, 4, ...
+		if (num_items)
+			assert(avl_tree_insert(&t, (void *) (int64_t) ((num_items - 1) * 2)));
+
+		avl_tree_iter_init(&it, &t);
+		assert(!avl_tree_iter_node(&it));
+		assert(!avl_tree_iter_next(&it));
+		assert(!avl_tree_iter_prev(&it));
+
+		i = 0;
+		for (node = avl_tree_iter_first(&it) ; node ; node = avl_tree_iter_next(&it))
+			assert(node->item == (void *) (int64_t) (2 * i++));
+		assert(i == num_items);
+		assert(!avl_tree_iter_node(&it));
+
+		for (node = avl_tree_iter_last(&it) ; node ; node = avl_tree_iter_prev(&it))
+			assert(node->item == (void *) (int64_t) (2 * --i));
+		assert(i == 0);
+
+		for (i = -1 ; i <= num_items * 2 ; ++i) {
+			// the bounds of an item sit at the next even item
+			node = avl_tree_iter_seek_lower_bound(&it, (void *) (int64_t) i);
+			j = i < 0 ? 0 : (i + 1) & ~1;
+			if (j < num_items * 2) {
+				assert(node && node->item == (void *) (int64_t) j);
+				assert(avl_tree_iter_node(&it) == node);
+			} else
+				assert(!node);
+
+			node = avl_tree_iter_seek_upper_bound(&it, (void *) (int64_t) i);
+			j = i < 0 ? 0 : (i + 2) & ~1;
+			if (j < num_items * 2)
+				assert(node && node->item == (void *) (int64_t) j);
+			else
+				assert(!node);
+
+			// step both ways from a seek
+			if (node) {
+				node = avl_tree_iter_prev(&it);
+				if (j)
+					assert(node->item == (void *) (int64_t) (j - 2));
+				else
+					assert(!node);
+			}
+		}
+
+		// pages of 7 items, each resumed from the last item seen
+		avl_tree_iter_init(&page, &t);
+		node = avl_tree_iter_first(&page);
+		for (i = 0 ; node ; ) {
+			void *last = NULL;
+
+			for (j = 0 ; node && j < 7 ; ++j) {
+				assert(node->item == (void *) (int64_t) (2 * i++));
+				last = node->item;
+				node = avl_tree_iter_next(&page);
+			}
+
+			if (node)
+				node = avl_tree_iter_seek_upper_bound(&page, last);
+		}
+		assert(i == num_items);
+	}
+
+	avl_tree_destroy(&t);
+}
+
+void frozen_find_and_iterate(void)
+{
+	avl_tree t;
+	avl_frozen f;
+	uint64_t pos;
+	int num_items;
+	int i;
+
+	avl_tree_init(&t,
+		      my_allocate_avl_node,
+		      my_free_avl_node,
+		      my_int_compare,
+		      my_allocate_avl_entry,
+		      my_free_avl_entry);
+
+	for (num_items = 0 ; num_items < 300 ; ++num_items) {
+		// items are 0, 2, 4, ...
+		if (num_items)
+			assert(avl_tree_insert(&t, (void *) (int64_t) ((num_items - 1) * 2)));
+
+		assert(avl_tree_freeze(&t, &f));
+		assert(f.num_items == (uint64_t) num_items);
+
+		for (i = 0 ; i < num_items ; ++i) {
+			pos = avl_frozen_find(&f, (void *) (int64_t) (i * 2));
+			assert(pos);
+			assert(avl_frozen_item(&f, pos) == (void *) (int64_t) (i * 2));
+			assert(!avl_frozen_find(&f, (void *) (int64_t) (i * 2 + 1)));
+
+			// lower bound of an absent item is the next one up
+			pos = avl_frozen_lower_bound(&f, (void *) (int64_t) (i * 2 - 1));
+			assert(avl_frozen_item(&f, pos) == (void *) (int64_t) (i * 2));
+		}
+		assert(!avl_frozen_lower_bound(&f, (void *) (int64_t) (num_items * 2 - 1)));
+		assert(!avl_frozen_find(&f, (void *) -2));
+
+		i = 0;
+		for (pos = avl_frozen_first(&f) ; pos ; pos = avl_frozen_next(&f, pos))
+			assert(avl_frozen_item(&f, pos) == (void *) (int64_t) (2 * i++));
+		assert(i == num_items);
+
+		for (pos = avl_frozen_last(&f) ; pos ; pos = avl_frozen_prev(&f, pos))
+			assert(avl_frozen_item(&f, pos) == (void *) (int64_t) (2 * --i));
+		assert(i == 0);
+
+		avl_frozen_destroy(&f);
+		assert(!f.items);
+	}
+
+	avl_tree_destroy(&t);
+}
+
+void frozen_keys_find(void)
+{
+	avl_tree t;
+	avl_frozen_keys k;
+	int64_t probes[64];
+	uint64_t slots[64];
+	uint64_t slot;
+	int64_t end;
+	int64_t j;
+	int num_items;
+	int isa;
+	int i;
+
+	for (isa = AVL_FROZEN_KEYS_SCALAR ; isa <= AVL_FROZEN_KEYS_AVX2 ; ++isa) {
+		avl_tree_init(&t,
+			      my_allocate_avl_node,
+			      my_free_avl_node,
+			      my_int_compare,
+			      my_allocate_avl_entry,
+			      my_free_avl_entry);
+
+		for (num_items = 0 ; num_items < 200 ; ++num_items) {
+			// items are 0, -3, 3, -6, 6, ...
+			if (num_items)
+				assert(avl_tree_insert(&t, (void *) (int64_t)
+					((num_items & 1 ? 1 : -1) * 3 * (num_items / 2))));
+
+			assert(avl_tree_freeze_keys(&t, &k, NULL));
+			if (!avl_frozen_keys_use(&k, isa)) {
+				// not supported by this CPU
+				avl_frozen_keys_destroy(&k);
+				break;
+			}
+
+			for (i = -3 * (num_items / 2) - 3 ; i <= 3 * (num_items / 2) + 3 ; ++i) {
+				int present = (i % 3 == 0) &&
+					      avl_tree_find(&t, (void *) (int64_t) i);
+
+				slot = avl_frozen_keys_find(&k, i);
+				if (present) {
+					assert(slot != AVL_FROZEN_KEYS_NONE);
+					assert(avl_frozen_keys_key(&k, slot) == i);
+					assert(avl_frozen_keys_item(&k, slot) == (void *) (int64_t) i);
+				} else
+					assert(slot == AVL_FROZEN_KEYS_NONE);
+
+				// nothing lies between i and its lower bound
+				slot = avl_frozen_keys_lower_bound(&k, i);
+				end = slot != AVL_FROZEN_KEYS_NONE ?
+				      avl_frozen_keys_key(&k, slot) : 3 * (num_items / 2) + 4;
+				assert(end >= i);
+				for (j = i ; j < end ; ++j)
+					assert(!avl_tree_find(&t, (void *) j));
+			}
+
+			// batch lookups match single ones
+			for (i = 0 ; i < 64 ; ++i)
+				probes[i] = i - 32;
+			avl_frozen_keys_find_batch(&k, probes, 64, slots);
+			for (i = 0 ; i < 64 ; ++i)
+				assert(slots[i] == avl_frozen_keys_find(&k, probes[i]));
+
+			avl_frozen_keys_destroy(&k);
+		}
+
+		avl_tree_destroy(&t);
+	}
+
+	// the extremes, which the padding also uses
+	avl_tree_init(&t,
+		      my_allocate_avl_node,
+		      my_free_avl_node,
+		      my_int_compare,
+		      my_allocate_avl_entry,
+		      my_free_avl_entry);
+
+	assert(avl_tree_insert(&t, (void *) INT64_MIN));
+	assert(avl_tree_insert(&t, (void *) 0));
+	assert(avl_tree_freeze_keys(&t, &k, NULL));
+	assert(avl_frozen_keys_find(&k, INT64_MAX) == AVL_FROZEN_KEYS_NONE);
+	assert(avl_frozen_keys_lower_bound(&k, 1) == AVL_FROZEN_KEYS_NONE);
+	assert(avl_frozen_keys_key(&k, avl_frozen_keys_find(&k, INT64_MIN)) == INT64_MIN);
+	avl_frozen_keys_destroy(&k);
+
+	assert(avl_tree_insert(&t, (void *) INT64_MAX));
+	assert(avl_tree_freeze_keys(&t, &k, NULL));
+	assert(avl_frozen_keys_key(&k, avl_frozen_keys_find(&k, INT64_MAX)) == INT64_MAX);
+	assert(avl_frozen_keys_key(&k, avl_frozen_keys_lower_bound(&k, 1)) == INT64_MAX);
+	avl_frozen_keys_destroy(&k);
+
+	avl_tree_destroy(&t);
+}
+
+// Returns the height of the subtree, or -1 if it is not an AVL tree.
+int checked_persistent_height(avl_persistent_tree *t, avl_persistent_node *node)
+{
+	int left_height;
+	int right_height;
+
+	if (!node)
+		return 0;
+
+	if (node->left && t->compare_items(node->left->item, node->item) >= 0)
+		return -1;
+	if (node->right && t->compare_items(node->right->item, node->item) <= 0)
+		return -1;
+
+	left_height = checked_persistent_height(t, node->left);
+	right_height = checked_persistent_height(t, node->right);
+
+	if (left_height < 0 || right_height < 0 ||
+	    left_height - right_height > 1 || right_height - left_height > 1)
+		return -1;
+	if (node->height != 1 + mymax(left_height, right_height))
+		return -1;
+
+	return node->height;
+}
+
+typedef struct _persistent_version {
+	avl_persistent_tree t;
+	char present[400];
+} persistent_version;
+
+void persistent_in_order_visitor(avl_persistent_node *node, void *context)
+{
+	int64_t *count = (int64_t *) context;
+	++*count;
+}
+
+void persistent_version_matches(persistent_version *v)
+{
+	int64_t count = 0;
+	int64_t expected = 0;
+	int i;
+
+	assert(checked_persistent_height(&v->t, v->t.root) ==
+	       avl_persistent_tree_height(&v->t));
+
+	for (i = 0 ; i < 400 ; ++i) {
+		assert(!!avl_persistent_tree_find(&v->t, (void *) (int64_t) i) ==
+		       v->present[i]);
+		expected += v->present[i];
+	}
+
+	assert(avl_persistent_tree_num_items(&v->t) == (uint64_t) expected);
+	avl_persistent_tree_in_order(&v->t, persistent_in_order_visitor, &count);
+	assert(count == expected);
+}
+
+void persistent_snapshots(void)
+{
+	persistent_version versions[8];
+	persistent_version current;
+	avl_persistent_tree copy;
+	int item;
+	int i;
+	int j;
+
+	avl_persistent_tree_init(&current.t, my_int_compare);
+	memset(current.present, 0, sizeof(current.present));
+	assert(!avl_persistent_tree_remove(&current.t, (void *) 0));
+	assert(0 == avl_persistent_tree_height(&current.t));
+
+	for (j = 0 ; j < 8 ; ++j) {
+		avl_persistent_tree_init(&versions[j].t, my_int_compare);
+		memset(versions[j].present, 0, sizeof(versions[j].present));
+	}
+
+	srand(17);
+	for (i = 0 ; i < 20000 ; ++i) {
+		item = rand() % 400;
+
+		if (current.present[item]) {
+			assert(avl_persistent_tree_remove(&current.t, (void *) (int64_t) item));
+			assert(!avl_persistent_tree_remove(&current.t, (void *) (int64_t) item));
+		} else {
+			assert(avl_persistent_tree_insert(&current.t, (void *) (int64_t) item));
+			assert(!avl_persistent_tree_insert(&current.t, (void *) (int64_t) item));
+		}
+		current.present[item] = !current.present[item];
+
+		if (i % 97 == 0) {
+			// replace an old version with a snapshot of the current one
+			j = rand() % 8;
+			persistent_version_matches(&versions[j]);
+			avl_persistent_tree_destroy(&versions[j].t);
+			avl_persistent_tree_snapshot(&current.t, &versions[j].t);
+			memcpy(versions[j].present, current.present, sizeof(current.present));
+			assert(versions[j].t.root == current.t.root);
+		}
+
+		if (i % 1000 == 0)
+			persistent_version_matches(&current);
+	}
+
+	persistent_version_matches(&current);
+
+	// the versions are independent of which is destroyed first
+	for (j = 0 ; j < 8 ; j += 2) {
+		persistent_version_matches(&versions[j]);
+		avl_persistent_tree_destroy(&versions[j].t);
+	}
+
+	avl_persistent_tree_snapshot(&current.t, &copy);
+	avl_persistent_tree_destroy(&current.t);
+	assert(!current.t.root);
+	assert(0 == avl_persistent_tree_num_items(&current.t));
+
+	for (j = 1 ; j < 8 ; j += 2) {
+		persistent_version_matches(&versions[j]);
+		avl_persistent_tree_destroy(&versions[j].t);
+	}
+
+	// a version whose nodes are no longer shared changes in place
+	assert(copy.root->refs == 1);
+	item = (int64_t) copy.root->item;
+	avl_persistent_tree_snapshot(&copy, &current.t);
+	avl_persistent_tree_destroy(&current.t);
+	assert(avl_persistent_tree_remove(&copy, (void *) (int64_t) item));
+	assert(avl_persistent_tree_insert(&copy, (void *) (int64_t) item));
+	assert(checked_persistent_height(&copy, copy.root) >= 0);
+	avl_persistent_tree_destroy(&copy);
+}
+
+static int persistent_allocs_left; // -1 for no limit
+static int64_t persistent_nodes;   // allocated and not yet freed
+
+avl_persistent_node * my_failing_allocate_persistent_node(void *item)
+{
+	avl_persistent_node *node;
+
+	if (!persistent_allocs_left)
+		return NULL;
+	if (persistent_allocs_left > 0)
+		--persistent_allocs_left;
+
+	node = (avl_persistent_node *) malloc(sizeof(avl_persistent_node));
+	if (node) {
+		node->item = item;
+		++persistent_nodes;
+	}
+
+	return node;
+}
+
+void my_free_persistent_node(avl_persistent_node *node)
+{
+	--persistent_nodes;
+	free(node);
+}
+
+void persistent_out_of_memory(void)
+{
+	persistent_version versions[4];
+	persistent_version current;
+	int failures = 0;
+	int item;
+	int i;
+	int j;
+
+	avl_persistent_tree_init(&current.t, my_int_compare);
+	avl_persistent_tree_set_allocator(&current.t,
+					  my_failing_allocate_persistent_node,
+					  my_free_persistent_node);
+	memset(current.present, 0, sizeof(current.present));
+	for (j = 0 ; j < 4 ; ++j) {
+		avl_persistent_tree_snapshot(&current.t, &versions[j].t);
+		memset(versions[j].present, 0, sizeof(versions[j].present));
+	}
+
+	// Snapshots keep the nodes shared, so updates copy their paths and
+	// the nodes their rotations move. Whenever memory runs out, the
+	// update fails as a whole and every version is still an AVL tree.
+	srand(23);
+	for (i = 0 ; i < 20000 ; ++i) {
+		item = rand() % 400;
+		persistent_allocs_left = i < 2000 ? -1 : rand() % 12;
+
+		if (current.present[item]) {
+			if (avl_persistent_tree_remove(&current.t, (void *) (int64_t) item))
+				current.present[item] = 0;
+			else
+				++failures;
+		} else {
+			if (avl_persistent_tree_insert(&current.t, (void *) (int64_t) item))
+				current.present[item] = 1;
+			else
+				++failures;
+		}
+		persistent_allocs_left = -1;
+
+		if (i % 7 == 0) {
+			j = rand() % 4;
+			persistent_version_matches(&versions[j]);
+			avl_persistent_tree_destroy(&versions[j].t);
+			avl_persistent_tree_snapshot(&current.t, &versions[j].t);
+			memcpy(versions[j].present, current.present, sizeof(current.present));
+		}
+
+		if (i % 100 == 0)
+			persistent_version_matches(&current);
+	}
+	assert(failures > 0);
+
+	persistent_version_matches(&current);
+	avl_persistent_tree_destroy(&current.t);
+	for (j = 0 ; j < 4 ; ++j) {
+		persistent_version_matches(&versions[j]);
+		avl_persistent_tree_destroy(&versions[j].t);
+	}
+	assert(!persistent_nodes);
+}
+
+typedef struct _visit_sequence {
+	int i;
+	int item_sequence[3];
+} visit_sequence;
+
+void sequence_visitor(avl_tree_node *node, void *context)
+{
+	visit_sequence *seq = (visit_sequence *) context;
+	assert(seq->item_sequence[seq->i++] == (int) (int64_t) node->item);
+}
+
+void sequence_visitor_level(avl_tree_node *node, void *context, int level)
+{
+	visit_sequence *seq = (visit_sequence *) context;
+	(void) level;
+	assert(seq->item_sequence[seq->i++] == (int) (int64_t) node->item);
+}
+
+void other_coverage(void)
+{
+	avl_tree t;
+	avl_tree_node *n;
+	visit_sequence seq;
+	int i;
+
+	avl_tree_init(&t, 
+		      my_allocate_avl_node,
+		      my_free_avl_node,
+		      my_int_compare,
+		      my_allocate_avl_entry,
+		      my_free_avl_entry);
+	assert(!t.root);
+
+	avl_tree_destroy(&t);
+	assert(!t.root);
+	assert(0 == avl_tree_num_items(&t));
+	assert(!avl_tree_find(&t, (void *) 1));
+	assert(0 == avl_tree_height(&t));
+
+	seq.i = 0;
+	avl_tree_pre_order(&t, sequence_visitor, &seq);
+	avl_tree_in_order(&t, sequence_visitor, &seq);
+	avl_tree_post_order(&t, sequence_visitor, &seq);
+	avl_tree_level_order(&t, sequence_visitor_level, &seq);
+	assert(0 == seq.i);
+
+	assert(avl_tree_insert(&t, (void *) 1));
+	assert(avl_tree_insert(&t, (void *) 2));
+	assert(avl_tree_insert(&t, (void *) 0));
+
+	// duplicates not allowed
+	assert(!avl_tree_insert(&t, (void *) 0));
+	assert(3 == avl_tree_num_items(&t));
+	n = avl_tree_find(&t, (void *) 2);
+	assert(n);
+	assert(n->item == (void *) 2);
+	assert(!avl_tree_find(&t, (void *) 3));
+
+	n = avl_tree_find(&t, (void *) 0);
+	assert(n);
+	assert(n->item == (void *) 0);
+	n = avl_tree_find(&t, (void *) 1);
+	assert(n);
+	assert(n->item == (void *) 1);
+	n = avl_tree_find(&t, (void *) 2);
+	assert(n);
+	assert(n->item == (void *) 2);
+
+	// test pre-order traversal
+	seq.i = 0;
+	seq.item_sequence[0] = 1;
+	seq.item_sequence[1] = 0;
+	seq.item_sequence[2] = 2;
+	avl_tree_pre_order(&t, sequence_visitor, &seq);
+	assert(3 == seq.i);
+
+	// test in-order traversal
+	seq.i = 0;
+	seq.item_sequence[0] = 0;
+	seq.item_sequence[1] = 1;
+	seq.item_sequence[2] = 2;
+	avl_tree_in_order(&t, sequence_visitor, &seq);
+	assert(3 == seq.i);
+
+	// test post-order traversal
+	seq.i = 0;
+	seq.item_sequence[0] = 0;
+	seq.item_sequence[1] = 2;
+	seq.item_sequence[2] = 1;
+	avl_tree_post_order(&t, sequence_visitor, &seq);
+	assert(3 == seq.i);
+
+	// test level-order traversal
+	seq.i = 0;
+	seq.item_sequence[0] = 1;
+	seq.item_sequence[1] = 0;
+	seq.item_sequence[2] = 2;
+	avl_tree_level_order(&t, sequence_visitor_level, &seq);
+	assert(3 == seq.i);
+
+	for (i = 3 ; i < 10 ; ++i)
+		assert(avl_tree_insert(&t, (void *) (int64_t) i));
+
+	assert(!avl_tree_remove(&t, (void *) (int64_t) 99));
+	assert(10 == avl_tree_num_items(&t));
+
+	avl_tree_destroy(&t);
+	assert(!t.root);
+	assert(0 == avl_tree_num_items(&t));
 
 	avl_tree_balance_node(NULL);
 }
@@ -437,6 +2888,30 @@ int main(int argc, char *argv[])
 {
 	simple_insert_and_level_order();
 	insert_and_remove_stress();
+	order_statistics_stress();
+	compare_count_insert_remove();
+	slab_insert_remove();
+	intrusive_insert_remove();
+	typed_insert_remove();
+	compact_insert_remove();
+	build_sorted_is_balanced();
+	batch_insert_remove();
+	batch_set_operations();
+	join_split_and_set_operations();
+	parallel_build_and_set_operations();
+	concurrent_readers_and_writer();
+	find_batch_matches_find();
+	iterate_and_seek();
+	range_visit_and_remove();
+	level_order_in_scratch();
+	walks_match_recursion();
+	interval_tree_augmented();
+	frozen_find_and_iterate();
+	frozen_keys_find();
+	image_save_and_load_mmap();
+	stream_export_and_import();
+	persistent_snapshots();
+	persistent_out_of_memory();
 	other_coverage();
 	return 0;
 }
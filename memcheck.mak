@@ -4,16 +4,31 @@ CFLAGS   ?= -std=gnu99 -g -O0 -Wall -Werror -fno-inline
 
 all: libavl.so main
 
-libavl.so: avl.h avl.c avl_insert.c avl_remove.c avl_util.h
+libavl.so: avl.h avl_link.h avl_compact.h avl_frozen.h avl_pool.h avl_concurrent.h avl_persistent.h avl_foreach.h avl_interval.h avl_image.h avl.c avl_insert.c avl_remove.c avl_order.c avl_slab.c avl_link.c avl_compact.c avl_frozen.c avl_frozen_keys.c avl_build.c avl_join.c avl_pool.c avl_concurrent.c avl_persistent.c avl_iter.c avl_augment.c avl_interval.c avl_image.c avl_util.h
 	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl.o avl.c
 	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_insert.o avl_insert.c
 	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_remove.o avl_remove.c
-	$(CC) -shared -o libavl.so avl.o avl_insert.o avl_remove.o
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_order.o avl_order.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_slab.o avl_slab.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_link.o avl_link.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_compact.o avl_compact.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_frozen.o avl_frozen.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_frozen_keys.o avl_frozen_keys.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_build.o avl_build.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_join.o avl_join.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_pool.o avl_pool.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_concurrent.o avl_concurrent.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_persistent.o avl_persistent.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_iter.o avl_iter.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_augment.o avl_augment.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_interval.o avl_interval.c
+	$(CC) $(CPPFLAGS) $(CFLAGS) -c -fPIC -o avl_image.o avl_image.c
+	$(CC) -shared -o libavl.so avl.o avl_insert.o avl_remove.o avl_order.o avl_slab.o avl_link.o avl_compact.o avl_frozen.o avl_frozen_keys.o avl_build.o avl_join.o avl_pool.o avl_concurrent.o avl_persistent.o avl_iter.o avl_augment.o avl_interval.o avl_image.o -lpthread
 
 main: main.c
-	$(CC) $(CPPFLAGS) $(CFLAGS) -o main main.c -L$(PWD) -lavl
+	$(CC) $(CPPFLAGS) $(CFLAGS) -o main main.c -L$(PWD) -lavl -lpthread
 
 clean:
-	$(RM) libavl.so avl.o avl_insert.o avl_remove.o main
+	$(RM) libavl.so avl.o avl_insert.o avl_remove.o avl_order.o avl_slab.o avl_link.o avl_compact.o avl_frozen.o avl_frozen_keys.o avl_build.o avl_join.o avl_pool.o avl_concurrent.o avl_persistent.o avl_iter.o avl_augment.o avl_interval.o avl_image.o main
 
 .PHONY: all clean